@@ -15,7 +15,7 @@
 #define MQTT_SW_VERSION_NUM     0x10100
 
 #ifndef PKG_PAHOMQTT_SUBSCRIBE_HANDLERS
-#define MAX_MESSAGE_HANDLERS    1 /* redefinable - how many subscriptions do you want? */
+#define MAX_MESSAGE_HANDLERS    1 /* subscriptions set before paho_mqtt_start, more can be added at runtime */
 #else
 #define MAX_MESSAGE_HANDLERS    PKG_PAHOMQTT_SUBSCRIBE_HANDLERS
 #endif
@@ -24,10 +24,112 @@
 
 #define MQTT_SOCKET_TIMEO       6000
 
+#define MQTT_PING_TIMEOUT       5000 /* ms to wait for PINGRESP before the connection is considered lost */
+
+#define MQTT_REQUEST_TIMEOUT    5000 /* ms to wait for CONNACK or SUBACK */
+
+#ifndef PKG_PAHOMQTT_RECONNECT_MIN
+#define MQTT_RECONNECT_MIN      1000 /* ms, reconnect backoff floor unless reconnect_interval is set */
+#else
+#define MQTT_RECONNECT_MIN      PKG_PAHOMQTT_RECONNECT_MIN
+#endif
+
+#ifndef PKG_PAHOMQTT_RECONNECT_MAX
+#define MQTT_RECONNECT_MAX      60000 /* ms, reconnect backoff ceiling unless reconnect_max is set */
+#else
+#define MQTT_RECONNECT_MAX      PKG_PAHOMQTT_RECONNECT_MAX
+#endif
+
+#ifndef PKG_PAHOMQTT_DNS_CACHE_TTL
+#define MQTT_DNS_CACHE_TTL      600000 /* ms a resolved broker address is reused without a DNS lookup */
+#else
+#define MQTT_DNS_CACHE_TTL      PKG_PAHOMQTT_DNS_CACHE_TTL
+#endif
+
+#ifndef PKG_PAHOMQTT_CONNECT_DELAY
+#define MQTT_CONNECT_DELAY      250 /* ms before the next broker address is tried alongside a pending connect */
+#else
+#define MQTT_CONNECT_DELAY      PKG_PAHOMQTT_CONNECT_DELAY
+#endif
+
+#ifndef PKG_PAHOMQTT_RETRY_INTERVAL
+#define MQTT_RETRY_INTERVAL     20000 /* ms before an unacknowledged QoS1/QoS2 publish is sent again, 0 only on reconnect */
+#else
+#define MQTT_RETRY_INTERVAL     PKG_PAHOMQTT_RETRY_INTERVAL
+#endif
+
+#ifndef PKG_PAHOMQTT_RECV_RING_SIZE
+#define MQTT_RECV_RING_SIZE     512 /* bytes taken from the socket by one read */
+#else
+#define MQTT_RECV_RING_SIZE     PKG_PAHOMQTT_RECV_RING_SIZE
+#endif
+
+#ifndef PKG_PAHOMQTT_PUB_RING_SIZE
+#define MQTT_PUB_RING_SIZE      4096 /* bytes of serialized publish packets waiting to be sent */
+#else
+#define MQTT_PUB_RING_SIZE      PKG_PAHOMQTT_PUB_RING_SIZE
+#endif
+
+#ifndef PKG_PAHOMQTT_PUB_RING_SLOTS
+#define MQTT_PUB_RING_SLOTS     32   /* publish packets waiting to be sent */
+#else
+#define MQTT_PUB_RING_SLOTS     PKG_PAHOMQTT_PUB_RING_SLOTS
+#endif
+
+#ifndef PKG_PAHOMQTT_INFLIGHT_WINDOW
+#define MQTT_INFLIGHT_WINDOW    16   /* QoS1/QoS2 publishes sent and not completed yet */
+#else
+#define MQTT_INFLIGHT_WINDOW    PKG_PAHOMQTT_INFLIGHT_WINDOW
+#endif
+
+#ifndef PKG_PAHOMQTT_SUB_ARENA_SIZE
+#define MQTT_SUB_ARENA_SIZE     256  /* bytes per block of subscription topic filter strings */
+#else
+#define MQTT_SUB_ARENA_SIZE     PKG_PAHOMQTT_SUB_ARENA_SIZE
+#endif
+
+#ifndef PKG_PAHOMQTT_DISPATCH_THREADS
+#define MQTT_DISPATCH_THREADS   0    /* message callback threads, 0 runs the callbacks on the MQTT thread */
+#else
+#define MQTT_DISPATCH_THREADS   PKG_PAHOMQTT_DISPATCH_THREADS
+#endif
+
+#ifndef PKG_PAHOMQTT_DISPATCH_QUEUE_SIZE
+#define MQTT_DISPATCH_QUEUE_SIZE 16  /* messages waiting for each callback thread */
+#else
+#define MQTT_DISPATCH_QUEUE_SIZE PKG_PAHOMQTT_DISPATCH_QUEUE_SIZE
+#endif
+
+#define MQTT_DISPATCH_TIMEOUT   1000 /* ms a stop waits for the callback threads to finish their queues */
+
 #ifdef MQTT_USING_TLS
-#define MQTT_TLS_READ_BUFFER    4096
+#ifndef PKG_PAHOMQTT_TLS_MAX_FRAG_LEN
+#define MQTT_TLS_MAX_FRAG_LEN   0 /* record size requested with max_fragment_length: 512, 1024, 2048, 4096 or 0 for none */
+#else
+#define MQTT_TLS_MAX_FRAG_LEN   PKG_PAHOMQTT_TLS_MAX_FRAG_LEN
 #endif
 
+#ifndef PKG_PAHOMQTT_TLS_RECORD_SIZE
+#define MQTT_TLS_RECORD_SIZE    1024 /* packets sent in one worker turn are coalesced into TLS records of up to this size */
+#else
+#define MQTT_TLS_RECORD_SIZE    PKG_PAHOMQTT_TLS_RECORD_SIZE
+#endif
+#endif
+
+#ifdef MQTT_USING_STORE
+#ifndef PKG_PAHOMQTT_STORE_SEGMENT_SIZE
+#define MQTT_STORE_SEGMENT_SIZE 65536 /* bytes of publish records per store file */
+#else
+#define MQTT_STORE_SEGMENT_SIZE PKG_PAHOMQTT_STORE_SEGMENT_SIZE
+#endif
+
+#ifndef PKG_PAHOMQTT_STORE_SEGMENTS
+#define MQTT_STORE_SEGMENTS     16   /* store files at most, publishes are refused once they are full */
+#else
+#define MQTT_STORE_SEGMENTS     PKG_PAHOMQTT_STORE_SEGMENTS
+#endif
+#endif /* MQTT_USING_STORE */
+
 enum QoS { QOS0, QOS1, QOS2 } ALIGN(4);
 
 /* all failure return codes must be negative */
@@ -39,6 +141,8 @@ enum mqttControl
     MQTT_CTRL_SET_RECONN_INTERVAL,     /* set reconnect interval */  
     MQTT_CTRL_SET_KEEPALIVE_INTERVAL,  /* set keepalive interval */  
     MQTT_CTRL_PUBLISH_BLOCK,           /* publish data block or nonblock */  
+    MQTT_CTRL_SET_INFLIGHT_WINDOW,     /* set the number of uncompleted QoS1/QoS2 publishes */
+    MQTT_CTRL_SET_RECONN_MAX_INTERVAL, /* set the longest wait between reconnects */
 };  
 
 typedef struct MQTTMessage
@@ -58,6 +162,23 @@ typedef struct MessageData
 } MessageData;
 
 typedef struct MQTTClient MQTTClient;
+typedef struct MQTTReactor MQTTReactor;
+
+struct MQTTPubSlot;
+struct MQTTTopicIndex;
+struct MQTTSubscription;
+struct MQTTSubArena;
+struct MQTTDispatchPool;
+struct MQTTClientTimers;
+struct MQTTStore;
+struct MQTTAddrCache;
+
+typedef struct MQTTDispatchStat
+{
+    rt_uint32_t posted;               /* messages queued to the callback threads */
+    rt_uint32_t dropped;              /* messages lost to a full queue or no memory */
+    rt_uint32_t depth_max;            /* the most messages seen waiting for one thread */
+} MQTTDispatchStat;
 
 struct MQTTClient
 {
@@ -65,35 +186,79 @@ struct MQTTClient
     int sock;
 
     MQTTPacket_connectData condata;
+    unsigned char *connect_pkt;       /* CONNECT serialized on the first connect, resent on every reconnect */
+    int connect_len;
 
     unsigned int next_packetid, command_timeout_ms;
     size_t buf_size, readbuf_size;
     unsigned char *buf, *readbuf;
+    unsigned char *recv_ring;         /* receive ring, one recv() may buffer several packets */
+    size_t recv_ring_size, recv_ring_pos, recv_ring_len;
+    MQTTTransport transport;          /* resumable parse state of the packet being received */
     unsigned int keepAliveInterval;
     int connect_timeout;
-    int reconnect_interval;
+    int reconnect_interval;           /* ms, shortest wait between reconnects */
+    int reconnect_max;                /* ms, longest wait between reconnects */
+    rt_uint32_t reconnect_delay;      /* ms, the last wait, 0 once online */
+    rt_uint32_t reconnect_rand;       /* jitter state */
+    struct MQTTAddrCache *addr_cache; /* broker address of the last lookup */
+    struct MQTTConnectAttempt *attempt; /* connection being made, worker thread only */
     int isblocking;
     int isconnected;
-    uint32_t tick_ping;
+    uint32_t tick_ping;               /* last PINGREQ sent */
+    int ping_outstanding;             /* PINGREQ sent and PINGRESP not received yet, 2 once the wait was extended */
+    struct MQTTClientTimers *timers;  /* keepalive, retry, reconnect and request deadlines */
+    uint32_t tick_sent, tick_recv;    /* last packet sent, for keepalive, and last data received, for the PINGRESP wait */
 
     void (*connect_callback)(MQTTClient *);
     void (*online_callback)(MQTTClient *);
     void (*offline_callback)(MQTTClient *);
+    void (*delivery_callback)(MQTTClient *, unsigned short packetid, int rc); /* QoS1/QoS2 publish completed */
 
     struct MessageHandlers
     {
         char *topicFilter;
         void (*callback)(MQTTClient *, MessageData *);
         enum QoS qos;
-    } messageHandlers[MAX_MESSAGE_HANDLERS]; /* Message handlers are indexed by subscription topic */
+    } messageHandlers[MAX_MESSAGE_HANDLERS]; /* initial subscriptions, copied into subs by paho_mqtt_start */
+    struct MQTTSubscription *subs;    /* subscription table, grows on demand */
+    int sub_num, sub_size, sub_free;  /* entries in use, entries allocated, first free entry */
+    struct MQTTSubArena *sub_arena;   /* blocks holding the topic filter strings */
+    struct MQTTTopicIndex *topic_index; /* subs filters, hashed and in a trie of levels */
+    rt_mutex_t sub_mutex;             /* subscription changes against message dispatch */
+    rt_uint32_t sub_digest;           /* digest of the filters and QoS in subs */
+    rt_uint32_t session_digest;       /* sub_digest of the table last subscribed at connect */
+    int session_subscribed;           /* the broker session acknowledged that table */
+    int sub_changed;                  /* subscriptions added or removed for the worker to send */
+    struct MQTTSubRequest *sub_requests; /* SUBSCRIBEs and UNSUBSCRIBEs sent and not acknowledged yet, worker thread only */
+    int suback_pending;               /* filters in those SUBSCRIBEs */
+    int session_resume;               /* the last CONNECT went without SUBSCRIBE, counting on that session */
+    int dispatch_threads;             /* message callback threads, 0 uses MQTT_DISPATCH_THREADS */
+    struct MQTTDispatchPool *dispatch_pool;
+    MQTTDispatchStat dispatch_stat;
 
     void (*defaultMessageHandler)(MQTTClient *, MessageData *);
 
     /* publish interface */
     rt_mutex_t pub_mutex;             /* publish data mutex for blocking */
+    unsigned char *pub_ring;          /* publish packets, serialized in place by the publishing threads */
+    rt_uint32_t pub_ring_size, pub_ring_wr, pub_ring_used;
+    struct MQTTPubSlot *pub_slots;    /* one slot per queued publish packet, in publish order */
+    rt_uint32_t pub_slot_num, pub_slot_head, pub_slot_send, pub_slot_tail, pub_slot_count;
+    int pub_signaled;                 /* the worker has been woken up for the committed packets */
+    unsigned int inflight_window, inflight_count;
+    rt_uint32_t *packetid_map;        /* one bit per packet id still in flight, 8KB */
+    rt_uint32_t *qos2_in_map;         /* one bit per inbound QoS2 id not released yet, 8KB on first use */
+#ifdef MQTT_USING_STORE
+    const char *store_path;           /* directory of the publishes kept while offline, RT_NULL keeps none */
+    struct MQTTStore *store;
+#endif
 #if defined(RT_USING_POSIX) && (defined(RT_USING_DFS_NET) || defined(SAL_USING_POSIX))
-    struct rt_pipe_device* pipe_device;
-    int pub_pipe[2];
+    MQTTReactor *reactor;             /* worker thread, shared with other clients when set before paho_mqtt_start */
+    MQTTClient *reactor_next;         /* next client served by the same worker */
+    int state;                        /* connection state, worker thread only */
+    int stop_requested;               /* paho_mqtt_stop called */
+    rt_sem_t stop_sem;                /* released once the worker is done with the stopped client, if set */
 #else
     int pub_sock;
     int pub_port;
@@ -101,6 +266,12 @@ struct MQTTClient
 
 #ifdef MQTT_USING_TLS
     MbedTLSSession *tls_session;      /* mbedtls session struct */
+    mbedtls_ssl_session *tls_resume;  /* session of the last handshake, offered on reconnect */
+    unsigned char *tls_out;           /* packets waiting to go out in one record */
+    int tls_out_len;
+    int tls_record_size;              /* size of tls_out, bounded by the negotiated fragment length */
+    rt_uint32_t tls_heap_peak;        /* most heap a TLS connect has been seen to take, in bytes */
+    int tls_corked;                   /* packets are coalesced until the worker uncorks */
 #endif
 	
 	void *user_data;                  /* user-specific data */
@@ -109,6 +280,9 @@ struct MQTTClient
 /* subscribe topic receive data callback */
 typedef void (*subscribe_cb)(MQTTClient *client, MessageData *data);
 
+/* fill buf with up to len payload bytes from offset on, return the bytes filled, <= 0 on error */
+typedef int (*publish_producer_cb)(MQTTClient *client, void *arg, size_t offset, unsigned char *buf, size_t len);
+
 /**
  * This function start a mqtt worker thread.
  *
@@ -142,24 +316,30 @@ int MQTTPublish(MQTTClient *client, const char *topic, MQTTMessage *message);
 int paho_mqtt_stop(MQTTClient *client);
 
 /**
- * This function send an MQTT subscribe packet and wait for suback before returning.
+ * This function subscribe a topic filter, the worker sends the SUBSCRIBE packet
+ * and nothing waits for its suback. A filter refused by the broker is removed
+ * from the subscriptions again, the refusal is only logged.
  *
  * @param client the pointer of MQTT context structure
  * @param qos MQTT Qos type, only support QOS1
  * @param topic topic filter name
  * @param callback the pointer of subscribe topic receive data function
  *
- * @return the error code, 0 on start successfully.
+ * @return the error code, 0 when the filter is queued for the worker, which
+ *         does not mean the broker accepted it.
  */
 int paho_mqtt_subscribe(MQTTClient *client, enum QoS qos, const char *topic, subscribe_cb callback);
 
 /**
- * This function send an MQTT unsubscribe packet and wait for unsuback before returning.
+ * This function unsubscribe a topic filter, the worker sends the UNSUBSCRIBE
+ * packet and nothing waits for its unsuback. No message is delivered to the
+ * filter anymore once this function returns.
  *
  * @param client the pointer of MQTT context structure
  * @param topic topic filter name
  *
- * @return the error code, 0 on start successfully.
+ * @return the error code, 0 when the filter is queued for the worker, which
+ *         removes it on the unsuback.
  */
 int paho_mqtt_unsubscribe(MQTTClient *client, const char *topic);
 
@@ -167,7 +347,7 @@ int paho_mqtt_unsubscribe(MQTTClient *client, const char *topic);
  * This function publish message to specified mqtt topic.
  *
  * @param c the pointer of MQTT context structure
- * @param qos MQTT QOS type, only support QOS1
+ * @param qos MQTT QOS type, QOS0, QOS1 or QOS2
  * @param topic topic filter name
  * @param msg_str the pointer of send message
  *
@@ -175,6 +355,25 @@ int paho_mqtt_unsubscribe(MQTTClient *client, const char *topic);
  */
 int paho_mqtt_publish(MQTTClient *client, enum QoS qos, const char *topic, const char *msg_str);
 
+/**
+ * This function publish a payload too large for the client buffers. The
+ * payload is pulled from the producer in chunks of buf_size bytes while the
+ * packet is sent, from offset 0 again whenever the publish is resent. The
+ * producer is called from the worker thread, never after this function returned.
+ *
+ * @param client the pointer of MQTT context structure
+ * @param qos MQTT QOS type, QOS0, QOS1 or QOS2
+ * @param topic topic name
+ * @param payloadlen the length of the payload
+ * @param producer the function filling in the payload
+ * @param arg the argument of producer
+ * @param timeout milliseconds to wait for the publish, MQTT_SOCKET_TIMEO if 0
+ *
+ * @return the error code, 0 once sent (QOS0) or acknowledged (QOS1, QOS2).
+ */
+int paho_mqtt_publish_stream(MQTTClient *client, enum QoS qos, const char *topic, size_t payloadlen,
+                             publish_producer_cb producer, void *arg, int timeout);
+
 /**
  * This function control MQTT client configure, such as connect timeout, reconnect interval.
  *
@@ -186,6 +385,113 @@ int paho_mqtt_publish(MQTTClient *client, enum QoS qos, const char *topic, const
  */
 int paho_mqtt_control(MQTTClient *client, int cmd, void *arg);
 
+/**
+ * This function create a worker thread serving any number of MQTT clients.
+ * Set the client reactor to it before paho_mqtt_start, instead of the client
+ * creating a thread of its own.
+ *
+ * @return the reactor, RT_NULL on failure.
+ */
+MQTTReactor *paho_mqtt_reactor_create(void);
+
+/**
+ * This function stop a reactor worker thread and free it, once every client
+ * started on it has been stopped.
+ *
+ * @param reactor the reactor created by paho_mqtt_reactor_create
+ *
+ * @return the error code, 0 on success.
+ */
+int paho_mqtt_reactor_delete(MQTTReactor *reactor);
+
+typedef struct MQTTGroupStat
+{
+    rt_uint32_t published;            /* publishes accepted by the shards */
+    rt_uint32_t refused;              /* publishes refused by an offline or full shard */
+    rt_uint32_t online;               /* shards connected */
+    rt_uint32_t queued;               /* publishes waiting in the publish rings, sent ones included */
+    rt_uint32_t inflight;             /* QoS1/QoS2 publishes sent and not completed yet */
+    MQTTDispatchStat dispatch;        /* summed over the shards, depth_max the largest */
+} MQTTGroupStat;
+
+/*
+ * A group of connections to one broker, seen as a single client. Publishes and
+ * subscriptions go to the shard picked by the hash of the topic, so the
+ * messages of a topic keep their order on one connection.
+ */
+typedef struct MQTTClientGroup
+{
+    MQTTClient config;                /* set up as a client, buf and readbuf are allocated per shard */
+    int shard_num;                    /* connections, set before paho_mqtt_group_start */
+    MQTTClient *shards;
+    int shard_started;                /* shards paho_mqtt_group_start got to, stop goes over these */
+    MQTTReactor *reactor;             /* worker thread of the shards, created by the group if not set */
+    int own_reactor;
+    char *names;                      /* client ids and store paths of the shards */
+    rt_sem_t stopped;                 /* released once for every shard the worker is done with */
+    rt_uint32_t published, refused;
+} MQTTClientGroup;
+
+/**
+ * This function start the shards of a client group, each a copy of the group
+ * config with the client id and store path suffixed by the shard number.
+ *
+ * @param group the pointer of MQTT client group structure
+ *
+ * @return the error code, 0 on start successfully.
+ */
+int paho_mqtt_group_start(MQTTClientGroup *group);
+
+/**
+ * This function stop the shards of a client group and wait for them to close.
+ *
+ * @param group the pointer of MQTT client group structure
+ *
+ * @return the error code, 0 on stop successfully.
+ */
+int paho_mqtt_group_stop(MQTTClientGroup *group);
+
+/**
+ * This function publish message on the shard of the topic.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param topic topic name
+ * @param message the pointer of MQTTMessage structure
+ *
+ * @return the error code, 0 on publish successfully.
+ */
+int paho_mqtt_group_publish(MQTTClientGroup *group, const char *topic, MQTTMessage *message);
+
+/**
+ * This function subscribe a topic filter on the shard of the filter.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param qos MQTT Qos type, only support QOS1
+ * @param topic topic filter name
+ * @param callback the pointer of subscribe topic receive data function
+ *
+ * @return the error code, 0 on subscribe successfully.
+ */
+int paho_mqtt_group_subscribe(MQTTClientGroup *group, enum QoS qos, const char *topic, subscribe_cb callback);
+
+/**
+ * This function unsubscribe a topic filter on the shard of the filter.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param topic topic filter name
+ *
+ * @return the error code, 0 on unsubscribe successfully.
+ */
+int paho_mqtt_group_unsubscribe(MQTTClientGroup *group, const char *topic);
+
+/**
+ * This function sum up the publish and dispatch statistics of the shards.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param stat the statistics filled in
+ */
+void paho_mqtt_group_stat(MQTTClientGroup *group, MQTTGroupStat *stat);
+
 #endif /* PAHOMQTT_UDP_MODE */
 
 #endif /* __PAHO_MQTT_H__ */
@@ -0,0 +1,266 @@
+#ifndef __PAHO_MQTT_INTERNAL_H__
+#define __PAHO_MQTT_INTERNAL_H__
+
+/*
+ * Internal definitions of the pipe mode client, shared by paho_mqtt_pipe.c and
+ * the unit tests in tests/. Not part of the API, they change without notice.
+ */
+
+#include <rtthread.h>
+
+#include "MQTTPacket.h"
+#include "paho_mqtt.h"
+
+enum pubSlotState
+{
+    PUB_SLOT_FREE = 0,                /* not in use, the worker stops here */
+    PUB_SLOT_RESERVED,                /* a publishing thread is serializing into it */
+    PUB_SLOT_COMMITTED,               /* ready to be sent */
+    PUB_SLOT_CANCELLED,               /* reserved but never completed, skipped */
+    PUB_SLOT_INFLIGHT,                /* sent, waiting for PUBACK (QoS1) or PUBREC (QoS2) */
+    PUB_SLOT_RELEASING,               /* QoS2 PUBREL sent, waiting for PUBCOMP */
+    PUB_SLOT_DONE,                    /* finished, the ring space can be reused */
+};
+
+/*
+ * Timer wheel. Every protocol deadline of the clients of a reactor is a timer
+ * hashed by its expiry tick into one of MQTT_TIMER_LEVELS wheels of 32 slots,
+ * each level 32 times coarser than the one below. Starting and stopping a timer
+ * is a list insert or remove, and the timers of a coarse slot are moved down a
+ * level when the wheel reaches them, so thousands of retry timers cost no
+ * scanning. The worker thread sleeps in select() until the next slot holding a
+ * timer.
+ */
+#define MQTT_TIMER_BITS     5
+#define MQTT_TIMER_SLOTS    (1 << MQTT_TIMER_BITS)
+#define MQTT_TIMER_MASK     (MQTT_TIMER_SLOTS - 1)
+#define MQTT_TIMER_LEVELS   4
+#define MQTT_TIMER_RANGE    (1UL << (MQTT_TIMER_BITS * MQTT_TIMER_LEVELS)) /* later timers wait at the last slot */
+
+struct MQTTTimer
+{
+    rt_list_t list;                   /* slot list, empty while the timer is stopped */
+    rt_tick_t expire;
+    MQTTClient *client;               /* set when started */
+    int (*timeout)(MQTTClient *c, struct MQTTTimer *timer);
+};
+
+struct MQTTTimerWheel
+{
+    rt_tick_t now;                    /* the next tick to process */
+    rt_uint32_t count;                /* timers running */
+    rt_uint32_t pending[MQTT_TIMER_LEVELS]; /* slots that may hold timers, cleared lazily */
+    rt_list_t slots[MQTT_TIMER_LEVELS][MQTT_TIMER_SLOTS];
+};
+
+/* the deadlines of a client, on the wheel of its reactor */
+struct MQTTClientTimers
+{
+    struct MQTTTimerWheel *wheel;
+    struct MQTTTimer keepalive;       /* nothing sent or received for a keepalive interval */
+    struct MQTTTimer ping;            /* PINGRESP deadline */
+    struct MQTTTimer reconnect;       /* end of the wait between connection attempts */
+    struct MQTTTimer request;         /* connect, TLS handshake and CONNACK deadline */
+    struct MQTTTimer attempt;         /* the next broker address is due */
+    struct MQTTTimer suback;          /* deadline of the SUBACKs for the subscriptions sent at connect */
+    int failed;                       /* a timeout ended the connection */
+    int suback_wait;                  /* online_callback is due once those SUBACKs are in */
+};
+
+struct MQTTPubStream;
+
+struct MQTTPubSlot
+{
+    volatile rt_uint8_t state;        /* enum pubSlotState */
+    rt_uint8_t qos;
+    rt_uint16_t id;
+    rt_uint32_t offset;               /* packet position in the ring */
+    rt_uint32_t len;                  /* packet length */
+    rt_uint32_t span;                 /* ring bytes taken, including the skipped end of the ring */
+    struct MQTTTimer retry;           /* resend while waiting for PUBACK, PUBREC or PUBCOMP */
+    struct MQTTPubStream *stream;     /* the payload follows from a producer, only the header is in the ring */
+#ifdef MQTT_USING_STORE
+    rt_uint32_t store_seq;            /* store file the packet was read from, 0 if published directly */
+    rt_uint32_t store_end;            /* end of its record in that file */
+#endif
+};
+
+#ifdef MQTT_USING_STORE
+/*
+ * Store. Publishes made while offline, or while earlier ones are still stored,
+ * are appended as records to a log of numbered files in store_path. The worker
+ * forwards the records into the publish ring in order once connected, and a
+ * file is deleted when all its records are completed. The position of the last
+ * completed record is kept in a cursor file, so after a restart at most
+ * MQTT_STORE_SYNC_BYTES of records are sent again.
+ */
+#define MQTT_STORE_MAGIC        0x4D51
+#define MQTT_STORE_READ_SIZE    1024 /* records read from the file at once */
+#define MQTT_STORE_SYNC_BYTES   4096 /* bytes appended, or completed, between two syncs */
+
+struct MQTTStoreRecord
+{
+    rt_uint16_t magic;                /* MQTT_STORE_MAGIC */
+    rt_uint8_t qos;
+    rt_uint8_t reserved;
+    rt_uint16_t id_pos;               /* packet id offset in the packet, set when it is forwarded */
+    rt_uint16_t reserved2;
+    rt_uint32_t len;                  /* serialized PUBLISH packet following the record */
+    rt_uint32_t crc;                  /* CRC-32 of the fields above and the packet */
+};
+
+/*
+ * Session journal. The QoS state of the session is kept next to the store as a
+ * journal of small records, one per change: a QoS1/QoS2 publish sent, past
+ * PUBREC or completed, an inbound QoS2 id received or released. paho_mqtt_start
+ * replays it, then replaces it with a snapshot of the outcome, as it does once
+ * the journal has grown by MQTT_SESSION_LOG_SIZE. A publish forwarded from the
+ * store is not copied, its record points at the store record, which stays on
+ * disk until the publish is completed.
+ */
+#define MQTT_SESSION_BUF_SIZE   512  /* records written out together */
+#define MQTT_SESSION_LOG_SIZE   16384 /* journal growth before it is compacted */
+
+enum sessionRecordType
+{
+    SESSION_REC_PUBLISH = 1,          /* QoS1/QoS2 publish sent, the packet follows */
+    SESSION_REC_PUBREL,               /* QoS2 publish past PUBREC */
+    SESSION_REC_DONE,                 /* publish completed */
+    SESSION_REC_QOS2_IN,              /* inbound QoS2 id received */
+    SESSION_REC_QOS2_REL,             /* inbound QoS2 id released */
+    SESSION_REC_QOS2_CLEAR,           /* new session, no inbound QoS2 id left */
+    SESSION_REC_NEXT_ID,              /* packet id counter */
+    SESSION_REC_STORED,               /* QoS1/QoS2 publish sent from the store, the packet stays there */
+};
+
+struct MQTTSessionRecord
+{
+    rt_uint8_t type;                  /* enum sessionRecordType */
+    rt_uint8_t qos;
+    rt_uint16_t id;                   /* packet id */
+    rt_uint32_t len;                  /* packet following the record, or in the store record */
+    rt_uint32_t store_seq, store_end; /* the store record a forwarded publish came from */
+    rt_uint32_t crc;                  /* CRC-32 of the fields above and the packet */
+};
+
+struct MQTTStoreCursor
+{
+    rt_uint32_t seq, off;             /* end of the last completed record */
+    rt_uint32_t crc;
+};
+
+struct MQTTStore
+{
+    rt_mutex_t lock;                  /* appending threads against the worker */
+    char *name;                       /* path of a store file, built under the lock */
+    rt_uint32_t head_seq;             /* oldest file still on disk */
+    rt_uint32_t rd_seq, rd_off;       /* next record to forward into the publish ring */
+    rt_uint32_t wr_seq, wr_off;       /* end of the log */
+    rt_uint32_t sync_off;             /* wr_off at the last fsync */
+    int rd_fd, wr_fd;                 /* rd_fd is only used for the files before wr_seq */
+    rt_uint32_t fwd_seq, fwd_off;     /* end of the last record forwarded into the ring */
+    rt_uint32_t ack_seq, ack_off;     /* end of the last record completed from the ring */
+    rt_uint32_t ack_bytes;            /* completed since the cursor was written */
+    unsigned char *rbuf;              /* records read ahead from rd_off */
+    rt_uint32_t rbuf_pos, rbuf_len;
+    unsigned char *wbuf;              /* the record being appended */
+    rt_uint32_t wbuf_size;
+
+    int ses_fd;                       /* session journal, written by the worker only */
+    char *ses_name, *ses_tmp;         /* the journal and the snapshot replacing it */
+    rt_uint32_t ses_off, ses_sync, ses_base; /* journal end, at the last fsync and after the snapshot */
+    unsigned char *jbuf;              /* records not written out yet */
+    rt_uint32_t jbuf_len;
+};
+#endif /* MQTT_USING_STORE */
+
+#define PACKET_ID_IN_USE(c, id)    ((c)->packetid_map[(id) / 32] & (1UL << ((id) % 32)))
+
+
+
+/*
+ * Subscription index. Filters without wildcards are hashed by their whole topic,
+ * the others are stored as a trie of topic levels. The children of a trie node are
+ * found through the same hash, keyed by the parent node and the level string, and
+ * the '+' and '#' children are linked from the node directly. Dispatching a topic
+ * costs one hash probe per level instead of a scan over every filter.
+ */
+struct MQTTTopicNode
+{
+    struct MQTTTopicNode *next;       /* hash bucket chain */
+    struct MQTTTopicNode *parent;     /* level above, the index exact node for exact filters */
+    struct MQTTTopicNode *plus;       /* '+' child */
+    struct MQTTTopicNode *wild;       /* '#' child */
+    rt_uint32_t hash;
+    rt_uint32_t refs;                 /* filters ending at or below this node */
+    int *handlers;                    /* subscription table indexes of the filters ending here */
+    rt_uint16_t handler_num;
+    rt_uint16_t len;
+    char level[1];
+};
+
+struct MQTTTopicIndex
+{
+    struct MQTTTopicNode **buckets;
+    rt_uint32_t bucket_num, node_num;
+    subscribe_cb *matches;            /* callbacks matching the last dispatched topic */
+    int match_num, match_size;
+    struct MQTTTopicNode root;        /* parent of the first level of the wildcard filters */
+    struct MQTTTopicNode exact;       /* parent of the exact filters */
+};
+
+/* receive ring and inbound packets */
+int recv_ring_getfn(void *sck, unsigned char *buf, int len);
+int MQTTPacket_readPacket(MQTTClient *c);
+int MQTT_handlePacket(MQTTClient *c, int packet_type);
+
+/* timer wheel */
+void mqtt_timer_wheel_init(struct MQTTTimerWheel *w);
+void mqtt_timer_init(struct MQTTTimer *timer, int (*timeout)(MQTTClient *, struct MQTTTimer *));
+void mqtt_timer_insert(struct MQTTTimerWheel *w, struct MQTTTimer *timer);
+void mqtt_timer_stop(MQTTClient *c, struct MQTTTimer *timer);
+void mqtt_timer_run(struct MQTTTimerWheel *w);
+rt_tick_t mqtt_timer_next(struct MQTTTimerWheel *w);
+struct MQTTClientTimers *mqtt_client_timers_create(struct MQTTTimerWheel *wheel);
+
+/* reconnect backoff */
+rt_uint32_t mqtt_reconnect_delay(MQTTClient *c);
+
+/* packet ids and the inbound QoS2 table */
+int getNextPacketId(MQTTClient *c);
+void packetid_take(MQTTClient *c, unsigned int id);
+void packetid_release(MQTTClient *c, unsigned int id);
+int qos2_in_receive(MQTTClient *c, unsigned int id);
+void qos2_in_release(MQTTClient *c, unsigned int id);
+
+/* publish ring */
+struct MQTTPubSlot *mqtt_pub_ring_reserve(MQTTClient *c, rt_uint32_t len, MQTTMessage *message);
+void mqtt_pub_ring_commit(MQTTClient *c, struct MQTTPubSlot *slot, int state);
+void mqtt_pub_ring_release(MQTTClient *c);
+int mqtt_pub_ring_send(MQTTClient *c);
+int mqtt_pub_ring_ack(MQTTClient *c, int type, unsigned short id);
+int mqtt_pub_retry_timeout(MQTTClient *c, struct MQTTTimer *timer);
+
+#ifdef MQTT_USING_STORE
+/* store and session journal */
+rt_uint32_t mqtt_store_crc32(rt_uint32_t crc, const unsigned char *buf, rt_uint32_t len);
+rt_uint32_t mqtt_store_record_crc(struct MQTTStoreRecord *rec, const unsigned char *packet);
+int mqtt_store_open(MQTTClient *c);
+int mqtt_store_append(MQTTClient *c, MQTTString *topic, MQTTMessage *message);
+int mqtt_store_forward(MQTTClient *c);
+void mqtt_store_close(MQTTClient *c);
+void mqtt_session_log(MQTTClient *c, int type, unsigned short id, struct MQTTPubSlot *slot);
+void mqtt_session_log_sent(MQTTClient *c, rt_uint32_t idx, rt_uint32_t count);
+void mqtt_session_flush(MQTTClient *c);
+int mqtt_session_restore(MQTTClient *c);
+#endif /* MQTT_USING_STORE */
+
+/* subscription table and index */
+int mqtt_topic_index_init(MQTTClient *c);
+int mqtt_sub_add(MQTTClient *c, const char *topic, enum QoS qos, subscribe_cb callback);
+int mqtt_sub_find(MQTTClient *c, const char *topic);
+void mqtt_sub_remove(MQTTClient *c, int i);
+void mqtt_sub_free_all(MQTTClient *c);
+int mqtt_topic_match(MQTTClient *c, const char *topic, int len);
+
+#endif /* __PAHO_MQTT_INTERNAL_H__ */
@@ -1,5 +1,7 @@
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
 
 #include <rtthread.h>
 #include <rtdevice.h>
@@ -12,6 +14,7 @@
 
 #include "MQTTPacket.h"
 #include "paho_mqtt.h"
+#include "paho_mqtt_internal.h"
 
 #define DBG_ENABLE
 #define DBG_SECTION_NAME    "mqtt"
@@ -41,12 +44,255 @@
 #endif
 #endif
 
+#define MQTT_SUB_BATCH_MAX  32 /* topic filters packed into one SUBSCRIBE at connect */
+
+enum mqttClientState
+{
+    MQTT_STATE_CONNECT = 0,           /* a connection attempt is due */
+    MQTT_STATE_CONNECTING,            /* connecting to the broker addresses */
+    MQTT_STATE_HANDSHAKE,             /* TLS handshake on the connected socket */
+    MQTT_STATE_CONNACK,               /* CONNECT sent, waiting for CONNACK */
+    MQTT_STATE_ONLINE,
+    MQTT_STATE_RECONNECT,             /* waiting for the next connection attempt */
+    MQTT_STATE_STOPPED,               /* left the reactor, its resources freed */
+};
+
+/*
+ * Reactor. One worker thread serves every client started on it. A client is a
+ * state machine driven by the readiness of its socket, by its timers on the
+ * wheel of the reactor and by the wakeups written to the pipe of the reactor
+ * by the publishing threads and paho_mqtt_stop. A client started without a
+ * reactor gets one of its own, ending with the client.
+ */
+struct MQTTReactor
+{
+    struct MQTTTimerWheel wheel;      /* the timers of all the clients */
+    MQTTClient *clients;              /* served, worker thread only */
+    MQTTClient *joining;              /* started, taken over on the next turn */
+    struct rt_pipe_device *pipe_device;
+    int pipe[2];                      /* wakeups from the other threads */
+    int standalone;                   /* serves a single client, ends with it */
+    int closing;                      /* paho_mqtt_reactor_delete called */
+};
+
+/*
+ * A publish with its payload pulled from a producer. Shared by the publishing
+ * thread and the slot, freed by whichever lets go of it last. The flags and the
+ * count are changed with interrupts disabled.
+ */
+struct MQTTPubStream
+{
+    publish_producer_cb producer;
+    void *arg;
+    rt_uint32_t payloadlen;
+    rt_sem_t done;                    /* released once the worker is done with the producer */
+    int rc;
+    rt_uint8_t refs;                  /* the publishing thread and the slot */
+    rt_uint8_t finished;              /* rc is set, the producer is not called anymore */
+    rt_uint8_t orphan;                /* the publishing thread stopped waiting, drop the publish */
+    rt_uint8_t busy;                  /* the worker is in the producer */
+};
+
+void mqtt_timer_init(struct MQTTTimer *timer, int (*timeout)(MQTTClient *, struct MQTTTimer *))
+{
+    rt_list_init(&timer->list);
+    timer->expire = 0;
+    timer->timeout = timeout;
+}
+
+void mqtt_timer_insert(struct MQTTTimerWheel *w, struct MQTTTimer *timer)
+{
+    rt_tick_t delta = timer->expire - w->now, slot_tick = timer->expire;
+    rt_uint32_t idx;
+    int level;
+
+    if ((rt_int32_t)delta < 0)
+    {
+        delta = 0;
+        slot_tick = w->now;
+    }
+    else if (delta >= MQTT_TIMER_RANGE)
+    {
+        /* put back on the lowest level once this slot is reached */
+        delta = MQTT_TIMER_RANGE - 1;
+        slot_tick = w->now + delta;
+    }
+
+    for (level = 0; level < MQTT_TIMER_LEVELS - 1; level++)
+    {
+        if (delta < (1UL << (MQTT_TIMER_BITS * (level + 1))))
+            break;
+    }
+
+    idx = (slot_tick >> (MQTT_TIMER_BITS * level)) & MQTT_TIMER_MASK;
+    rt_list_insert_before(&w->slots[level][idx], &timer->list);
+    w->pending[level] |= 1UL << idx;
+    w->count++;
+}
+
+/* (re)start a timer expiring after the given ticks, worker thread only */
+static void mqtt_timer_start(MQTTClient *c, struct MQTTTimer *timer, rt_tick_t ticks)
+{
+    struct MQTTTimerWheel *w = c->timers->wheel;
+
+    if (!rt_list_isempty(&timer->list))
+    {
+        rt_list_remove(&timer->list);
+        w->count--;
+    }
+
+    timer->expire = rt_tick_get() + ticks;
+    timer->client = c;
+    mqtt_timer_insert(w, timer);
+}
+
+void mqtt_timer_stop(MQTTClient *c, struct MQTTTimer *timer)
+{
+    if (!rt_list_isempty(&timer->list))
+    {
+        rt_list_remove(&timer->list);
+        c->timers->wheel->count--;
+    }
+}
+
+/* move the timers of the slots just reached down to the finer levels */
+static void mqtt_timer_cascade(struct MQTTTimerWheel *w)
+{
+    struct MQTTTimer *timer;
+    rt_uint32_t idx;
+    rt_list_t *list;
+    int level;
+
+    for (level = 1; level < MQTT_TIMER_LEVELS; level++)
+    {
+        idx = (w->now >> (MQTT_TIMER_BITS * level)) & MQTT_TIMER_MASK;
+        list = &w->slots[level][idx];
+        while (!rt_list_isempty(list))
+        {
+            timer = rt_list_entry(list->next, struct MQTTTimer, list);
+            rt_list_remove(&timer->list);
+            w->count--;
+            mqtt_timer_insert(w, timer);
+        }
+        w->pending[level] &= ~(1UL << idx);
+
+        if (idx != 0)
+            break;
+    }
+}
+
+/*
+ * Call the timers expired up to now. A timer may be started again from its own
+ * callback, the client of a callback failing is marked to be disconnected.
+ */
+void mqtt_timer_run(struct MQTTTimerWheel *w)
+{
+    struct MQTTTimer *timer;
+    rt_tick_t tick_now = rt_tick_get(), skip;
+    rt_uint32_t idx;
+    rt_list_t *list;
+
+    while ((rt_int32_t)(tick_now - w->now) >= 0)
+    {
+        if (w->count == 0)
+        {
+            w->now = tick_now + 1;
+            break;
+        }
+
+        idx = w->now & MQTT_TIMER_MASK;
+        if (idx == 0)
+            mqtt_timer_cascade(w);
+
+        if (w->pending[0] == 0)
+        {
+            /* nothing on the lowest level, go straight to the next cascade */
+            skip = MQTT_TIMER_SLOTS - idx;
+            if (skip > tick_now - w->now + 1)
+                skip = tick_now - w->now + 1;
+            w->now += skip;
+            continue;
+        }
+
+        list = &w->slots[0][idx];
+        while (!rt_list_isempty(list))
+        {
+            timer = rt_list_entry(list->next, struct MQTTTimer, list);
+            rt_list_remove(&timer->list);
+            w->count--;
+
+            if ((rt_int32_t)(timer->expire - w->now) > 0)
+            {
+                /* too far out when started, it has been waiting at the last slot */
+                mqtt_timer_insert(w, timer);
+                continue;
+            }
+
+            if (timer->timeout(timer->client, timer) != PAHO_SUCCESS)
+                timer->client->timers->failed = 1;
+        }
+        w->pending[0] &= ~(1UL << idx);
+        w->now++;
+    }
+}
+
+/* distance from start to the next slot marked in map, -1 if none */
+static int mqtt_timer_find(rt_uint32_t map, rt_uint32_t start)
+{
+    rt_uint32_t rot = start ? ((map >> start) | (map << (MQTT_TIMER_SLOTS - start))) : map;
+
+    return rot ? __rt_ffs((int)rot) - 1 : -1;
+}
+
+/*
+ * The select() timeout of the worker thread: the ticks until the next timer
+ * expires, or until a coarse slot holding timers has to be cascaded.
+ *
+ * @return the ticks to wait, RT_WAITING_FOREVER if no timer is running.
+ */
+rt_tick_t mqtt_timer_next(struct MQTTTimerWheel *w)
+{
+    rt_tick_t next = 0, tick, left;
+    rt_uint32_t first, start;
+    int level, found = 0, dist;
+
+    if (w->count == 0)
+        return (rt_tick_t)RT_WAITING_FOREVER;
+
+    for (level = 0; level < MQTT_TIMER_LEVELS; level++)
+    {
+        /* the current slot of a coarse level is cascaded already, unless the wheel stands at its start */
+        first = w->now >> (MQTT_TIMER_BITS * level);
+        if (level > 0 && (w->now & ((1UL << (MQTT_TIMER_BITS * level)) - 1)) != 0)
+            first++;
+        start = first & MQTT_TIMER_MASK;
+
+        while ((dist = mqtt_timer_find(w->pending[level], start)) >= 0)
+        {
+            rt_uint32_t idx = (start + dist) & MQTT_TIMER_MASK;
+
+            if (!rt_list_isempty(&w->slots[level][idx]))
+                break;
+            w->pending[level] &= ~(1UL << idx);
+        }
+        if (dist < 0)
+            continue;
+
+        tick = (first + dist) << (MQTT_TIMER_BITS * level);
+
+        if (!found || (rt_int32_t)(tick - next) < 0)
+            next = tick;
+        found = 1;
+    }
+
+    left = next - rt_tick_get();
+    return (found && (rt_int32_t)left > 0) ? left : 0;
+}
+
 /*
- * resolve server address
- * @param server the server sockaddress
- * @param url the input URL address.
- * @param host_addr the buffer pointer to save server host address
- * @param request the pointer to point the request url, for example, /index.html
+ * Parse the host and port of the uri and look the host up.
+ *
+ * @param res the addresses found, RT_NULL to only parse the uri
  *
  * @return 0 on resolve server address OK, others failed
  *
@@ -165,12 +411,19 @@ static int mqtt_resolve_uri(MQTTClient *c, struct addrinfo **res)
 #ifdef MQTT_USING_TLS
         if (c->tls_session)
         {
+            /* the session lives across reconnects */
+            rt_free(c->tls_session->host);
+            rt_free(c->tls_session->port);
             c->tls_session->host = rt_strdup(host_addr_new);
             c->tls_session->port = rt_strdup(port_str);
         }
 #endif
 
+        if (res == RT_NULL)
+            goto _exit;
+
         memset(&hint, 0, sizeof(hint));
+        hint.ai_socktype = SOCK_STREAM;
 
         ret = getaddrinfo(host_addr_new, port_str, &hint, res);
         if (ret != 0)
@@ -191,6 +444,18 @@ _exit:
 }
 
 #ifdef MQTT_USING_TLS
+#if MQTT_TLS_MAX_FRAG_LEN == 512
+#define MQTT_TLS_MFL_CODE       MBEDTLS_SSL_MAX_FRAG_LEN_512
+#elif MQTT_TLS_MAX_FRAG_LEN == 1024
+#define MQTT_TLS_MFL_CODE       MBEDTLS_SSL_MAX_FRAG_LEN_1024
+#elif MQTT_TLS_MAX_FRAG_LEN == 2048
+#define MQTT_TLS_MFL_CODE       MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#elif MQTT_TLS_MAX_FRAG_LEN == 4096
+#define MQTT_TLS_MFL_CODE       MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#elif MQTT_TLS_MAX_FRAG_LEN != 0
+#error "MQTT_TLS_MAX_FRAG_LEN must be 512, 1024, 2048, 4096 or 0."
+#endif
+
 static int mqtt_open_tls(MQTTClient *c)
 {
     int tls_ret = 0;
@@ -207,15 +472,9 @@ static int mqtt_open_tls(MQTTClient *c)
     }
     memset(c->tls_session, 0x0, sizeof(MbedTLSSession));
 
-    c->tls_session->buffer_len = MQTT_TLS_READ_BUFFER;
-    c->tls_session->buffer = rt_malloc(c->tls_session->buffer_len);
-    if (c->tls_session->buffer == RT_NULL)
-    {
-        LOG_E("open tls failed, no memory for tls_session buffer malloc");
-        rt_free(c->tls_session);
-        c->tls_session = RT_NULL;
-        return -RT_ENOMEM;
-    }
+    /* records are read straight into the receive ring, the read buffer of the client serves the session */
+    c->tls_session->buffer_len = c->readbuf_size;
+    c->tls_session->buffer = c->readbuf;
 
     if ((tls_ret = mbedtls_client_init(c->tls_session, (void *)pers, strlen(pers))) < 0)
     {
@@ -223,586 +482,3944 @@ static int mqtt_open_tls(MQTTClient *c)
         return -RT_ERROR;
     }
 
+    /* allocated once the handshake has settled the record size */
+    c->tls_out = RT_NULL;
+    c->tls_out_len = c->tls_record_size = 0;
+    c->tls_corked = 0;
+
     return RT_EOK;
 }
-#endif
 
-static int net_connect(MQTTClient *c)
+static void mqtt_close_tls(MQTTClient *c)
 {
-    int rc = -1;
-    struct addrinfo *addr_res = RT_NULL;
-
-    c->sock = -1;
-    c->next_packetid = 0;
-
-#ifdef MQTT_USING_TLS
-    if (strncmp(c->uri, "ssl://", 6) == 0)
-    {
-        if (mqtt_open_tls(c) < 0)
-        {
-            LOG_E("mqtt_open_tls err!");
-            return -RT_ERROR;
-        }
-    }
-    else
+    if (c->tls_session)
     {
+        /* the read buffer belongs to the client */
+        c->tls_session->buffer = RT_NULL;
+        mbedtls_client_close(c->tls_session);
         c->tls_session = RT_NULL;
     }
-#endif
 
-    rc = mqtt_resolve_uri(c, &addr_res);
-    if (rc < 0 || addr_res == RT_NULL)
+    if (c->tls_resume)
     {
-        LOG_E("resolve uri err");
-        goto _exit;
+        mbedtls_ssl_session_free(c->tls_resume);
+        rt_free(c->tls_resume);
+        c->tls_resume = RT_NULL;
     }
 
-#ifdef MQTT_USING_TLS
-    if (c->tls_session)
+    if (c->tls_out)
     {
-        int tls_ret = 0;
-        int timeout = MQTT_SOCKET_TIMEO;
-
-        if ((tls_ret = mbedtls_client_context(c->tls_session)) < 0)
-        {
-            LOG_E("mbedtls_client_context err return : -0x%x", -tls_ret);
-            return -RT_ERROR;
-        }
+        rt_free(c->tls_out);
+        c->tls_out = RT_NULL;
+    }
+    c->tls_record_size = 0;
+}
 
-        if ((tls_ret = mbedtls_client_connect(c->tls_session)) < 0)
-        {
-            LOG_E("mbedtls_client_connect err return : -0x%x", -tls_ret);
-            rc = -RT_ERROR;
-            goto _exit;
-        }
-        LOG_D("tls connect success...");
+/* coalesce into records no larger than the peer accepts, without it every packet goes out alone */
+static void mqtt_tls_record_alloc(MQTTClient *c)
+{
+    int size = mbedtls_ssl_get_max_out_record_payload(&c->tls_session->ssl);
 
-        c->sock = c->tls_session->server_fd.fd;
+    if (size <= 0 || size > MQTT_TLS_RECORD_SIZE)
+        size = MQTT_TLS_RECORD_SIZE;
 
-        /* set recv timeout option */
-        setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &timeout,
-                   sizeof(timeout));
-        setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &timeout,
-                   sizeof(timeout));
+    if (c->tls_out && c->tls_record_size == size)
+        return;
 
-        rc = 0;
-        goto _exit;
-    }
-#endif
+    rt_free(c->tls_out);
+    c->tls_out = rt_malloc(size);
+    c->tls_record_size = c->tls_out ? size : 0;
+}
 
-    if ((c->sock = socket(addr_res->ai_family, SOCK_STREAM, 0)) == -1)
+/* keep the session of the handshake just made for an abbreviated one next time */
+static void mqtt_tls_save_session(MQTTClient *c)
+{
+    if (c->tls_resume == RT_NULL)
     {
-        LOG_E("create socket error!");
-        goto _exit;
+        c->tls_resume = rt_malloc(sizeof(mbedtls_ssl_session));
+        if (c->tls_resume == RT_NULL)
+            return;
     }
-
-    if ((rc = connect(c->sock, addr_res->ai_addr, addr_res->ai_addrlen)) == -1)
+    else
     {
-        LOG_E("connect err!");
-        closesocket(c->sock);
-        c->sock = -1;
-
-        rc = -2;
-        goto _exit;
+        mbedtls_ssl_session_free(c->tls_resume);
     }
 
-_exit:
-    if (addr_res)
+    mbedtls_ssl_session_init(c->tls_resume);
+    if (mbedtls_ssl_get_session(&c->tls_session->ssl, c->tls_resume) != 0)
     {
-        freeaddrinfo(addr_res);
-        addr_res = RT_NULL;
+        mbedtls_ssl_session_free(c->tls_resume);
+        rt_free(c->tls_resume);
+        c->tls_resume = RT_NULL;
     }
-    return rc;
 }
 
-static int net_disconnect(MQTTClient *c)
+/*
+ * Go on with the TLS handshake on the non-blocking socket, called again once
+ * the socket is ready for what mbedtls waits for.
+ *
+ * @return 0 once done, MBEDTLS_ERR_SSL_WANT_READ or MBEDTLS_ERR_SSL_WANT_WRITE
+ * while in progress, the mbedtls error or the failed verify flags otherwise.
+ */
+static int mqtt_tls_handshake(MQTTClient *c)
 {
-#ifdef MQTT_USING_TLS
-    if (c->tls_session)
-    {
-        mbedtls_client_close(c->tls_session);
-        c->sock = -1;
-        return 0;
-    }
-#endif
+    MbedTLSSession *session = c->tls_session;
+    int ret;
 
-    if (c->sock >= 0)
+    ret = mbedtls_ssl_handshake(&session->ssl);
+    if (ret != 0)
+        return ret;
+
+    ret = mbedtls_ssl_get_verify_result(&session->ssl);
+    if (ret != 0)
     {
-        closesocket(c->sock);
-        c->sock = -1;
+        LOG_E("verify peer certificate fail, flags 0x%x.", ret);
+        return ret;
     }
 
     return 0;
 }
 
-static int net_disconnect_exit(MQTTClient *c)
+/* do not offer the session that may have caused the failure again */
+static void mqtt_tls_drop_session(MQTTClient *c)
 {
-    int i;
-
-    net_disconnect(c);
-
-    if (c->buf && c->readbuf)
+    if (c->tls_resume)
     {
-        rt_free(c->buf);
-        rt_free(c->readbuf);
+        mbedtls_ssl_session_free(c->tls_resume);
+        rt_free(c->tls_resume);
+        c->tls_resume = RT_NULL;
     }
+}
+#endif
 
-    if (c->pub_mutex)
-    {
-        rt_mutex_delete(c->pub_mutex);
-    }
+/*
+ * Broker address cache. A reconnect within MQTT_DNS_CACHE_TTL of the lookup
+ * connects to the cached address without resolving the uri again, and an
+ * expired address is still used while the lookup fails.
+ */
+struct MQTTAddrCache
+{
+    rt_tick_t expire;                 /* looked up again from then on */
+    int family;
+    socklen_t len;
+    rt_uint32_t addr[1];              /* struct sockaddr of len bytes */
+};
+
+static int mqtt_addr_cache_update(MQTTClient *c, struct addrinfo *res)
+{
+    struct MQTTAddrCache *cache = c->addr_cache;
 
-    if (c->pipe_device)
+    if (cache == RT_NULL || cache->len < res->ai_addrlen)
     {
-        close(c->pub_pipe[0]);
-        close(c->pub_pipe[1]);
-        rt_pipe_delete((const char *)c->pipe_device->parent.parent.name);
+        rt_free(cache);
+        cache = rt_malloc(sizeof(struct MQTTAddrCache) + res->ai_addrlen);
+        c->addr_cache = cache;
+        if (cache == RT_NULL)
+            return PAHO_FAILURE;
     }
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    cache->expire = rt_tick_get() + rt_tick_from_millisecond(MQTT_DNS_CACHE_TTL);
+    cache->family = res->ai_family;
+    cache->len = res->ai_addrlen;
+    rt_memcpy(cache->addr, res->ai_addr, res->ai_addrlen);
+
+    return PAHO_SUCCESS;
+}
+
+/* most broker addresses connected to in parallel */
+#define MQTT_CONNECT_ADDRS      4
+
+/* alternate the address families, starting with the resolver's first choice */
+static int mqtt_addr_sort(struct addrinfo *res, struct addrinfo **addrs, int max)
+{
+    struct addrinfo *p = res, *q = res;
+    int num = 0, family = res->ai_family;
+
+    while (num < max)
     {
-        if (c->messageHandlers[i].topicFilter)
+        while (p && p->ai_family != family)
+            p = p->ai_next;
+        while (q && q->ai_family == family)
+            q = q->ai_next;
+        if (p == RT_NULL && q == RT_NULL)
+            break;
+
+        if (p && (num % 2 == 0 || q == RT_NULL))
         {
-            rt_free(c->messageHandlers[i].topicFilter);
-            c->messageHandlers[i].topicFilter = RT_NULL;
-            c->messageHandlers[i].callback = RT_NULL;
+            addrs[num++] = p;
+            p = p->ai_next;
+        }
+        else
+        {
+            addrs[num++] = q;
+            q = q->ai_next;
         }
     }
-    
-    c->isconnected = 0;
 
-    return 0;
+    return num;
 }
 
-static int sendPacket(MQTTClient *c, int length)
+static int mqtt_connect_start(struct addrinfo *addr)
 {
-    int rc;
-    struct timeval tv;
+    int sock;
 
-    tv.tv_sec = 2000;
-    tv.tv_usec = 0;
-
-    setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(struct timeval));
+    if ((sock = socket(addr->ai_family, SOCK_STREAM, 0)) < 0)
+        return -1;
 
-#ifdef MQTT_USING_TLS
-    if (c->tls_session)
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS)
     {
-        rc = mbedtls_client_write(c->tls_session, c->buf, length);
-        goto _continue;
+        closesocket(sock);
+        return -1;
     }
-#endif
 
-    rc = send(c->sock, c->buf, length, 0);
+    return sock;
+}
 
+/*
+ * A connection being made. The worker connects to the broker addresses without
+ * blocking and resumes the attempt whenever one of the sockets turns writable,
+ * the other clients of the reactor are served meanwhile.
+ */
+struct MQTTConnectAttempt
+{
+    struct addrinfo *res;             /* lookup result the addresses point into */
+    struct addrinfo *addrs[MQTT_CONNECT_ADDRS];
+    struct addrinfo cached;           /* the cached address, when it was not looked up again */
+    int fds[MQTT_CONNECT_ADDRS];      /* -1 once failed or taken */
+    int num, started, pending;
 #ifdef MQTT_USING_TLS
-_continue:
+    int tls_fresh;                    /* the TLS session was just opened, its context is set up on the socket */
+    int want_write;                   /* the handshake waits for the socket to take more data */
+#ifdef RT_USING_HEAP
+    rt_uint32_t heap_used, heap_max;  /* before the TLS session was opened */
 #endif
-    if (rc == length)
-    {
-        rc = 0;
-    }
-    else
+#endif
+};
+
+static void mqtt_connect_free(MQTTClient *c)
+{
+    struct MQTTConnectAttempt *a = c->attempt;
+    int i;
+
+    if (a == RT_NULL)
+        return;
+
+    for (i = 0; i < a->started; i++)
     {
-        rc = -1;
+        if (a->fds[i] >= 0)
+            closesocket(a->fds[i]);
     }
+    if (a->res)
+        freeaddrinfo(a->res);
+    mqtt_timer_stop(c, &c->timers->attempt);
 
-    return rc;
+    rt_free(a);
+    c->attempt = RT_NULL;
 }
 
-static int net_read(MQTTClient *c, unsigned char *buf,  int len, int timeout)
+/*
+ * Happy eyeballs: connect to the next address without waiting for the
+ * previous ones, MQTT_CONNECT_DELAY after the last one or as soon as it fails.
+ *
+ * @return PAHO_FAILURE once every address has failed
+ */
+static int mqtt_connect_next(MQTTClient *c)
 {
-    int bytes = 0;
-    int rc;
+    struct MQTTConnectAttempt *a = c->attempt;
 
-    while (bytes < len)
+    while (a->started < a->num)
     {
-
-#ifdef MQTT_USING_TLS
-        if (c->tls_session)
+        a->fds[a->started] = mqtt_connect_start(a->addrs[a->started]);
+        if (a->fds[a->started++] >= 0)
         {
-            rc = mbedtls_client_read(c->tls_session, &buf[bytes], (size_t)(len - bytes));
-            if (rc <= 0)
-            {
-                bytes = -1;
-                break;
-            }
-            else
-            {
-                bytes += rc;
-            }
-            goto _continue;
+            a->pending++;
+            break;
         }
-#endif
+    }
 
-        rc = recv(c->sock, &buf[bytes], (size_t)(len - bytes), MSG_DONTWAIT);
+    if (a->started < a->num)
+        mqtt_timer_start(c, &c->timers->attempt, rt_tick_from_millisecond(MQTT_CONNECT_DELAY));
+    else
+        mqtt_timer_stop(c, &c->timers->attempt);
 
-        if (rc == -1)
-        {
-            if (errno != ENOTCONN && errno != ECONNRESET)
+    return a->pending > 0 ? PAHO_SUCCESS : PAHO_FAILURE;
+}
+
+
+/*
+ * Check the sockets of the attempt found writable.
+ *
+ * @return the index of the address connected to, -1 while none is, -2 once all have failed
+ */
+static int mqtt_connect_check(MQTTClient *c, fd_set *writeset)
+{
+    struct MQTTConnectAttempt *a = c->attempt;
+    int i, err, started = a->started;
+    socklen_t len;
+
+    /* only the sockets selected on, a new one may reuse the number of one closed here */
+    for (i = 0; i < started; i++)
+    {
+        if (a->fds[i] < 0 || !FD_ISSET(a->fds[i], writeset))
+            continue;
+
+        err = 0;
+        len = sizeof(err);
+        if (getsockopt(a->fds[i], SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+            return i;
+
+        LOG_D("connect to address #%d err: %d", i, err);
+        closesocket(a->fds[i]);
+        a->fds[i] = -1;
+        a->pending--;
+
+        /* the next address need not wait for its turn */
+        if (mqtt_connect_next(c) != PAHO_SUCCESS)
+            return -2;
+    }
+
+    return -1;
+}
+
+/* the sockets still connecting, for the select of the worker */
+static int mqtt_connect_fdset(MQTTClient *c, fd_set *writeset, int maxfd)
+{
+    struct MQTTConnectAttempt *a = c->attempt;
+    int i;
+
+    for (i = 0; i < a->started; i++)
+    {
+        if (a->fds[i] < 0)
+            continue;
+        FD_SET(a->fds[i], writeset);
+        if (a->fds[i] > maxfd)
+            maxfd = a->fds[i];
+    }
+
+    return maxfd;
+}
+
+/* no address connected, the broker may have moved, look it up again next time */
+static void mqtt_connect_fail(MQTTClient *c)
+{
+    LOG_E("connect err!");
+    if (c->addr_cache)
+        c->addr_cache->expire = rt_tick_get();
+}
+
+static int mqtt_connect_delay_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    if (mqtt_connect_next(c) != PAHO_SUCCESS)
+    {
+        mqtt_connect_fail(c);
+        return PAHO_FAILURE;
+    }
+
+    return PAHO_SUCCESS;
+}
+
+/*
+ * Look the broker up and start connecting to its addresses, the worker carries
+ * on with mqtt_client_connecting once a socket is writable.
+ *
+ * @return 0 once connecting, -1 on error.
+ */
+static int net_connect(MQTTClient *c)
+{
+    int rc = -1;
+    struct MQTTConnectAttempt *a;
+    struct MQTTAddrCache *cache;
+
+    c->sock = -1;
+    c->recv_ring_pos = c->recv_ring_len = 0;
+    c->transport.state = 0;
+
+    a = rt_calloc(1, sizeof(struct MQTTConnectAttempt));
+    if (a == RT_NULL)
+    {
+        LOG_E("no memory for connect attempt.");
+        return -1;
+    }
+    c->attempt = a;
+
+#if defined(MQTT_USING_TLS) && defined(RT_USING_HEAP)
+    {
+        rt_uint32_t heap_total;
+
+        rt_memory_info(&heap_total, &a->heap_used, &a->heap_max);
+    }
+#endif
+
+#ifdef MQTT_USING_TLS
+    /* a reconnect reuses the session set up by the first connect */
+    if (c->tls_session == RT_NULL && strncmp(c->uri, "ssl://", 6) == 0)
+    {
+        if (mqtt_open_tls(c) < 0)
+        {
+            LOG_E("mqtt_open_tls err!");
+            mqtt_close_tls(c);
+            goto _exit;
+        }
+        a->tls_fresh = 1;
+    }
+#endif
+
+    /* look the broker up only once the cached address has expired */
+    cache = c->addr_cache;
+    if (cache && (rt_int32_t)(rt_tick_get() - cache->expire) < 0)
+    {
+        rc = mqtt_resolve_uri(c, RT_NULL);
+    }
+    else
+    {
+        rc = mqtt_resolve_uri(c, &a->res);
+        if (rc == 0 && a->res)
+        {
+            a->num = mqtt_addr_sort(a->res, a->addrs, MQTT_CONNECT_ADDRS);
+        }
+        else if (cache)
+        {
+            LOG_W("resolve uri err, connecting to the last address.");
+            rc = 0;
+        }
+    }
+
+    if (rc == 0 && a->num == 0 && cache)
+    {
+        a->cached.ai_family = cache->family;
+        a->cached.ai_addrlen = cache->len;
+        a->cached.ai_addr = (struct sockaddr *)cache->addr;
+        a->addrs[a->num++] = &a->cached;
+    }
+
+    if (rc < 0 || a->num == 0)
+    {
+        LOG_E("resolve uri err");
+        rc = -1;
+        goto _exit;
+    }
+
+    /* ssl:// too, the handshake then runs on the socket that won */
+    if (mqtt_connect_next(c) != PAHO_SUCCESS)
+    {
+        mqtt_connect_fail(c);
+        rc = -1;
+        goto _exit;
+    }
+    rc = 0;
+
+_exit:
+    if (rc != 0)
+        mqtt_connect_free(c);
+    return rc;
+}
+
+/*
+ * The socket of address idx is connected, take it and set TLS up on it.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int net_connected(MQTTClient *c, int idx)
+{
+    struct MQTTConnectAttempt *a = c->attempt;
+    struct timeval tv;
+
+    c->sock = a->fds[idx];
+    a->fds[idx] = -1;
+
+    if (a->addrs[idx] != &a->cached)
+        mqtt_addr_cache_update(c, a->addrs[idx]);
+
+#ifdef MQTT_USING_TLS
+    if (c->tls_session)
+    {
+        int tls_ret = 0;
+
+        if (a->tls_fresh)
+        {
+            if ((tls_ret = mbedtls_client_context(c->tls_session)) < 0)
             {
-                bytes = -1;
-                break;
+                LOG_E("mbedtls_client_context err return : -0x%x", -tls_ret);
+                closesocket(c->sock);
+                c->sock = -1;
+                mqtt_close_tls(c);
+                return -1;
             }
+#if MQTT_TLS_MAX_FRAG_LEN > 0
+            /* ask the server for records small enough for the buffers of a small part */
+            mbedtls_ssl_conf_max_frag_len(&c->tls_session->conf, MQTT_TLS_MFL_CODE);
+#endif
+        }
+
+        /* offer the last session, the server falls back to a full handshake if it has dropped it */
+        if (c->tls_resume)
+            mbedtls_ssl_set_session(&c->tls_session->ssl, c->tls_resume);
+
+        /* the socket stays non-blocking, mbedtls reports WANT_READ or WANT_WRITE instead of waiting */
+        c->tls_session->server_fd.fd = c->sock;
+        mbedtls_net_set_nonblock(&c->tls_session->server_fd);
+        mbedtls_ssl_set_bio(&c->tls_session->ssl, &c->tls_session->server_fd, mbedtls_net_send, mbedtls_net_recv, RT_NULL);
+
+        /* the attempt is kept until the handshake is done */
+        return 0;
+    }
+#endif
+
+    /* sends rely on SO_SNDTIMEO, reads pass MSG_DONTWAIT themselves */
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL, 0) & ~O_NONBLOCK);
+
+    /* set once here rather than before every send */
+    tv.tv_sec = 2000;
+    tv.tv_usec = 0;
+    setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(struct timeval));
+
+    mqtt_connect_free(c);
+    return 0;
+}
+
+#ifdef MQTT_USING_TLS
+/*
+ * One step of the TLS handshake on the socket taken by net_connected.
+ *
+ * @return 1 once done, 0 while in progress, -1 on error.
+ */
+static int net_handshake(MQTTClient *c)
+{
+    struct MQTTConnectAttempt *a = c->attempt;
+    struct timeval tv;
+    int tls_ret;
+
+    tls_ret = mqtt_tls_handshake(c);
+    if (tls_ret == MBEDTLS_ERR_SSL_WANT_READ || tls_ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        a->want_write = (tls_ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+        return 0;
+    }
+    if (tls_ret != 0)
+    {
+        LOG_E("mbedtls handshake err return : -0x%x", -tls_ret);
+        mqtt_tls_drop_session(c);
+        return -1;
+    }
+
+    LOG_D("tls connect success...");
+    mqtt_tls_save_session(c);
+    mqtt_tls_record_alloc(c);
+
+#ifdef RT_USING_HEAP
+    {
+        rt_uint32_t heap_total, heap_used, heap_max, peak;
+
+        /* a new heap high-water mark was set by the handshake, otherwise only what is held counts */
+        rt_memory_info(&heap_total, &heap_used, &heap_max);
+        peak = (heap_max > a->heap_max) ? heap_max - a->heap_used : heap_used - a->heap_used;
+        if (heap_used < a->heap_used)
+            peak = 0;
+        if (peak > c->tls_heap_peak)
+            c->tls_heap_peak = peak;
+        LOG_I("TLS record %d bytes, heap %d bytes, peak %d bytes.", c->tls_record_size,
+              heap_used - a->heap_used, c->tls_heap_peak);
+    }
+#endif
+
+    /* set recv and send timeout option */
+    tv.tv_sec = MQTT_SOCKET_TIMEO / 1000;
+    tv.tv_usec = (MQTT_SOCKET_TIMEO % 1000) * 1000;
+    setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+    setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(struct timeval));
+
+    mqtt_connect_free(c);
+    return 1;
+}
+#endif
+
+static int net_disconnect(MQTTClient *c)
+{
+    mqtt_connect_free(c);
+
+#ifdef MQTT_USING_TLS
+    /* only the connection is closed, the session is kept for the reconnect */
+    if (c->tls_session)
+    {
+        c->tls_out_len = 0;
+        c->tls_corked = 0;
+        if (c->sock >= 0)
+            mbedtls_ssl_close_notify(&c->tls_session->ssl);
+        mbedtls_net_free(&c->tls_session->server_fd);
+        mbedtls_ssl_session_reset(&c->tls_session->ssl);
+        c->sock = -1;
+        return 0;
+    }
+#endif
+
+    if (c->sock >= 0)
+    {
+        closesocket(c->sock);
+        c->sock = -1;
+    }
+
+    return 0;
+}
+
+#ifdef MQTT_USING_TLS
+/* mbedtls writes at most one record per call and may have to be called again */
+static int mqtt_tls_write(MQTTClient *c, const unsigned char *buf, int length)
+{
+    int rc, sent = 0;
+    rt_tick_t start = rt_tick_get();
+
+    while (sent < length)
+    {
+        rc = mbedtls_client_write(c->tls_session, buf + sent, length - sent);
+        if (rc > 0)
+        {
+            sent += rc;
+        }
+        else if ((rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ) &&
+                 rt_tick_get() - start < rt_tick_from_millisecond(MQTT_SOCKET_TIMEO))
+        {
+            rt_thread_delay(1);
         }
         else
-            bytes += rc;
+        {
+            return rc;
+        }
+    }
+
+    return sent;
+}
+
+static int mqtt_tls_flush(MQTTClient *c)
+{
+    int len = c->tls_out_len;
+
+    if (len == 0)
+        return PAHO_SUCCESS;
+
+    c->tls_out_len = 0;
+    if (mqtt_tls_write(c, c->tls_out, len) != len)
+        return PAHO_FAILURE;
+
+    return PAHO_SUCCESS;
+}
+
+/* hold back the packets of this turn of the worker so they share TLS records */
+static void mqtt_tls_cork(MQTTClient *c)
+{
+    if (c->tls_session && c->tls_out)
+        c->tls_corked = 1;
+}
+
+static int mqtt_tls_uncork(MQTTClient *c)
+{
+    c->tls_corked = 0;
+
+    return c->tls_session ? mqtt_tls_flush(c) : PAHO_SUCCESS;
+}
+#endif
+
+static int net_write(MQTTClient *c, const unsigned char *buf, int length)
+{
+    int rc;
+
+#ifdef MQTT_USING_TLS
+    if (c->tls_session)
+    {
+        if (c->tls_corked)
+        {
+            if (length > c->tls_record_size - c->tls_out_len && mqtt_tls_flush(c) != PAHO_SUCCESS)
+            {
+                rc = -1;
+                goto _continue;
+            }
+
+            if (length <= c->tls_record_size)
+            {
+                rt_memcpy(c->tls_out + c->tls_out_len, buf, length);
+                c->tls_out_len += length;
+                rc = length;
+                goto _continue;
+            }
+        }
+
+        rc = mqtt_tls_write(c, buf, length);
+        goto _continue;
+    }
+#endif
+
+    rc = send(c->sock, buf, length, 0);
+
+#ifdef MQTT_USING_TLS
+_continue:
+#endif
+    if (rc == length)
+    {
+        c->tick_sent = rt_tick_get();
+        rc = 0;
+    }
+    else
+    {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+static int sendPacket(MQTTClient *c, int length)
+{
+    return net_write(c, c->buf, length);
+}
+
+/*
+ * Any packet sent keeps the connection alive for the broker, a ping is only due
+ * once nothing has been sent for a whole keepalive interval.
+ *
+ * @return the ticks left until a ping is due, 0 if it is due now.
+ */
+static rt_tick_t keepalive_left(MQTTClient *c)
+{
+    rt_tick_t keepalive, idle;
+
+    keepalive = rt_tick_from_millisecond(c->keepAliveInterval * 1000);
+    idle = rt_tick_get() - c->tick_sent;
+
+    return (idle >= keepalive) ? 0 : keepalive - idle;
+}
+
+/* the keepalive timer checks again when it fires, traffic meanwhile does not restart it */
+static int mqtt_keepalive_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    rt_tick_t left = keepalive_left(c);
+    int len;
+
+    if (left == 0)
+    {
+        if (!c->ping_outstanding)
+        {
+            len = MQTTSerialize_pingreq(c->buf, c->buf_size);
+            if (sendPacket(c, len) != 0)
+            {
+                LOG_E("[%d] send ping fail", rt_tick_get());
+                return PAHO_FAILURE;
+            }
+            c->tick_ping = rt_tick_get();
+            c->ping_outstanding = 1;
+            mqtt_timer_start(c, &c->timers->ping, rt_tick_from_millisecond(MQTT_PING_TIMEOUT));
+        }
+        left = rt_tick_from_millisecond(c->keepAliveInterval * 1000);
+    }
+
+    mqtt_timer_start(c, timer, left);
+    return PAHO_SUCCESS;
+}
+
+/*
+ * PINGRESP stops the ping timer. Data received since the PINGREQ may be queued
+ * ahead of the PINGRESP and extends the wait once by MQTT_PING_TIMEOUT, a peer
+ * still not answering after that is taken for dead whatever else it sends.
+ */
+static int mqtt_ping_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    if (c->ping_outstanding == 1 && (rt_int32_t)(c->tick_recv - c->tick_ping) > 0)
+    {
+        c->ping_outstanding = 2;
+        mqtt_timer_start(c, timer, rt_tick_from_millisecond(MQTT_PING_TIMEOUT));
+        return PAHO_SUCCESS;
+    }
+
+    LOG_E("[%d] wait Ping Response timeout", rt_tick_get());
+    return PAHO_FAILURE;
+}
+
+static int mqtt_reconnect_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    c->state = MQTT_STATE_CONNECT;
+    return PAHO_SUCCESS;
+}
+
+/* xorshift32, seeded per client so devices restarted together spread apart */
+static rt_uint32_t mqtt_random(MQTTClient *c)
+{
+    rt_uint32_t x = c->reconnect_rand;
+
+    if (x == 0)
+    {
+        const char *id = c->condata.clientID.cstring;
+
+        x = rt_tick_get() ^ (rt_uint32_t)(rt_ubase_t)c;
+        while (id && *id)
+            x = (x ^ (rt_uint8_t)*id++) * 16777619u;
+        if (x == 0)
+            x = 0x9E3779B9u;
+    }
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c->reconnect_rand = x;
+
+    return x;
+}
+
+/*
+ * Decorrelated jitter: the first retry waits a random time below the
+ * reconnect interval, each further one a random time between the interval
+ * and three times the previous delay, capped at the maximum interval.
+ */
+rt_uint32_t mqtt_reconnect_delay(MQTTClient *c)
+{
+    rt_uint32_t floor, ceiling, hi, delay;
+
+    floor = c->reconnect_interval > 0 ? c->reconnect_interval : MQTT_RECONNECT_MIN;
+    ceiling = c->reconnect_max > 0 ? c->reconnect_max : MQTT_RECONNECT_MAX;
+    if (ceiling < floor)
+        ceiling = floor;
+
+    if (c->reconnect_delay == 0)
+    {
+        delay = mqtt_random(c) % (floor + 1);
+    }
+    else
+    {
+        hi = (c->reconnect_delay > ceiling / 3) ? ceiling : c->reconnect_delay * 3;
+        delay = (hi > floor) ? floor + mqtt_random(c) % (hi - floor + 1) : floor;
+    }
+
+    c->reconnect_delay = delay ? delay : 1;
+
+    return delay;
+}
+
+static int mqtt_request_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    if (c->state == MQTT_STATE_CONNECTING)
+    {
+        LOG_E("[%d] connect timeout", rt_tick_get());
+        mqtt_connect_fail(c);
+        return PAHO_FAILURE;
+    }
+
+#ifdef MQTT_USING_TLS
+    if (c->state == MQTT_STATE_HANDSHAKE)
+    {
+        LOG_E("[%d] TLS handshake timeout", rt_tick_get());
+        mqtt_tls_drop_session(c);
+        return PAHO_FAILURE;
+    }
+#endif
+
+    LOG_E("[%d] wait CONNACK timeout", rt_tick_get());
+    return PAHO_FAILURE;
+}
+
+static int mqtt_suback_timeout(MQTTClient *c, struct MQTTTimer *timer);
+
+void mqtt_timer_wheel_init(struct MQTTTimerWheel *w)
+{
+    int level, i;
+
+    rt_memset(w, 0, sizeof(struct MQTTTimerWheel));
+    for (level = 0; level < MQTT_TIMER_LEVELS; level++)
+    {
+        for (i = 0; i < MQTT_TIMER_SLOTS; i++)
+            rt_list_init(&w->slots[level][i]);
+    }
+    w->now = rt_tick_get();
+}
+
+struct MQTTClientTimers *mqtt_client_timers_create(struct MQTTTimerWheel *wheel)
+{
+    struct MQTTClientTimers *t;
+
+    t = rt_calloc(1, sizeof(struct MQTTClientTimers));
+    if (t == RT_NULL)
+        return RT_NULL;
+
+    t->wheel = wheel;
+    mqtt_timer_init(&t->keepalive, mqtt_keepalive_timeout);
+    mqtt_timer_init(&t->ping, mqtt_ping_timeout);
+    mqtt_timer_init(&t->reconnect, mqtt_reconnect_timeout);
+    mqtt_timer_init(&t->request, mqtt_request_timeout);
+    mqtt_timer_init(&t->attempt, mqtt_connect_delay_timeout);
+    mqtt_timer_init(&t->suback, mqtt_suback_timeout);
+
+    return t;
+}
+
+/* timers of a connection, stopped when it is lost */
+static void mqtt_timer_stop_session(MQTTClient *c)
+{
+    rt_uint32_t i, idx;
+
+    mqtt_timer_stop(c, &c->timers->keepalive);
+    mqtt_timer_stop(c, &c->timers->ping);
+    mqtt_timer_stop(c, &c->timers->suback);
+    c->ping_outstanding = 0;
+    c->timers->suback_wait = 0;
+
+    for (i = 0, idx = c->pub_slot_tail; i < c->pub_slot_count; i++, idx = (idx + 1) % c->pub_slot_num)
+    {
+        mqtt_timer_stop(c, &c->pub_slots[idx].retry);
+    }
+}
+
+/*
+ * Fill the receive ring with a single read from the network.
+ *
+ * @return the number of bytes buffered, 0 if no data is pending, -1 on error or closed connection.
+ */
+static int net_read(MQTTClient *c)
+{
+    int rc;
+    size_t tail, space;
+
+    if (c->recv_ring_len >= c->recv_ring_size)
+        return 0;
+
+    /* only the contiguous free space, the next call picks up the wrapped part */
+    tail = (c->recv_ring_pos + c->recv_ring_len) % c->recv_ring_size;
+    space = (tail >= c->recv_ring_pos) ? c->recv_ring_size - tail : c->recv_ring_pos - tail;
+    if (c->recv_ring_len == 0)
+    {
+        c->recv_ring_pos = tail = 0;
+        space = c->recv_ring_size;
+    }
+
+#ifdef MQTT_USING_TLS
+    if (c->tls_session)
+    {
+        rc = mbedtls_client_read(c->tls_session, c->recv_ring + tail, space);
+        if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+            return 0;
+        if (rc <= 0)
+            return -1;
+        goto _continue;
+    }
+#endif
+
+    rc = recv(c->sock, c->recv_ring + tail, space, MSG_DONTWAIT);
+    if (rc == 0)
+    {
+        LOG_D("net_read connection closed by peer");
+        return -1;
+    }
+    else if (rc < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        return -1;
+    }
+
+#ifdef MQTT_USING_TLS
+_continue:
+#endif
+    c->recv_ring_len += rc;
+    c->tick_recv = rt_tick_get();
+
+    return rc;
+}
+
+/*
+ * MQTTTransport getfn, hand out the bytes buffered in the receive ring.
+ *
+ * @return the number of bytes copied, 0 to call again after the next net_read.
+ */
+int recv_ring_getfn(void *sck, unsigned char *buf, int len)
+{
+    MQTTClient *c = (MQTTClient *)sck;
+    size_t first, count = (size_t)len;
+
+    if (count > c->recv_ring_len)
+        count = c->recv_ring_len;
+
+    /* the bytes may wrap around the end of the ring */
+    first = c->recv_ring_size - c->recv_ring_pos;
+    if (first > count)
+        first = count;
+    memcpy(buf, c->recv_ring + c->recv_ring_pos, first);
+    memcpy(buf + first, c->recv_ring, count - first);
+
+    c->recv_ring_pos = (c->recv_ring_pos + count) % c->recv_ring_size;
+    c->recv_ring_len -= count;
+
+    return (int)count;
+}
+
+/*
+ * Advance the resumable parse of the packet being received into readbuf.
+ *
+ * @return the MQTT packet type, 0 if the packet is not complete yet, -1 on error.
+ */
+int MQTTPacket_readPacket(MQTTClient *c)
+{
+    return MQTTPacket_readnb(c->readbuf, c->readbuf_size, &c->transport);
+}
+
+/*
+ * Get the next packet id, skipping the ids of the publishes still in flight.
+ * At most the in-flight window of bits is set, so the search stops after a few steps.
+ */
+int getNextPacketId(MQTTClient *c)
+{
+    rt_base_t level;
+    unsigned int id;
+
+    level = rt_hw_interrupt_disable();
+    do
+    {
+        id = c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    }
+    while (c->packetid_map && PACKET_ID_IN_USE(c, id));
+    rt_hw_interrupt_enable(level);
+
+    return id;
+}
+
+void packetid_take(MQTTClient *c, unsigned int id)
+{
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    c->packetid_map[id / 32] |= 1UL << (id % 32);
+    rt_hw_interrupt_enable(level);
+}
+
+void packetid_release(MQTTClient *c, unsigned int id)
+{
+    rt_base_t level;
+
+    level = rt_hw_interrupt_disable();
+    c->packetid_map[id / 32] &= ~(1UL << (id % 32));
+    rt_hw_interrupt_enable(level);
+}
+
+/*
+ * Record an inbound QoS2 publish until its PUBREL, worker thread only.
+ * The table is allocated on the first QoS2 publish, clients that never
+ * receive one do not pay for it. The journal record is written out before
+ * the message is delivered and its PUBREC sent.
+ *
+ * @return 1 if the message is new and must be delivered, 0 for a duplicate,
+ *         -1 if there is no memory for the table.
+ */
+int qos2_in_receive(MQTTClient *c, unsigned int id)
+{
+    rt_uint32_t bit = 1UL << (id % 32);
+
+    if (c->qos2_in_map == RT_NULL)
+    {
+        c->qos2_in_map = rt_calloc((MAX_PACKET_ID + 1) / 32, sizeof(rt_uint32_t));
+        if (c->qos2_in_map == RT_NULL)
+        {
+            LOG_E("QoS2 receive table malloc failed.");
+            return -1;
+        }
+    }
+
+    if (c->qos2_in_map[id / 32] & bit)
+        return 0;
+
+    c->qos2_in_map[id / 32] |= bit;
+#ifdef MQTT_USING_STORE
+    mqtt_session_log(c, SESSION_REC_QOS2_IN, id, RT_NULL);
+    mqtt_session_flush(c);
+#endif
+    return 1;
+}
+
+void qos2_in_release(MQTTClient *c, unsigned int id)
+{
+    if (c->qos2_in_map)
+        c->qos2_in_map[id / 32] &= ~(1UL << (id % 32));
+#ifdef MQTT_USING_STORE
+    mqtt_session_log(c, SESSION_REC_QOS2_REL, id, RT_NULL);
+#endif
+}
+
+static int mqtt_subscribe_all(MQTTClient *c);
+
+/*
+ * Send CONNECT and, without waiting for CONNACK, the SUBSCRIBE packets of every
+ * subscription. The SUBACKs are matched by the main loop, so bringing a session
+ * up costs one round trip whatever the number of subscriptions.
+ *
+ * @return 0 once sent, -1 on error.
+ */
+static int MQTTConnect(MQTTClient *c)
+{
+    int rc = -1, len, resume;
+    MQTTPacket_connectData *options = &c->condata;
+
+    if (c->isconnected) /* don't send connect packet again if we are already connected */
+        goto _exit;
+
+    c->keepAliveInterval = options->keepAliveInterval;
+
+    /* serialized on the first connect, the same packet is sent on every reconnect */
+    if (c->connect_pkt == RT_NULL)
+    {
+        if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
+            goto _exit;
+
+        c->connect_pkt = rt_malloc(len);
+        if (c->connect_pkt == RT_NULL)
+        {
+            LOG_E("no memory for connect packet.");
+            goto _exit;
+        }
+        rt_memcpy(c->connect_pkt, c->buf, len);
+        c->connect_len = len;
+    }
+
+    /* a persistent session that already holds the subscription table needs no SUBSCRIBE */
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    resume = !options->cleansession && c->session_subscribed && c->session_digest == c->sub_digest;
+    rt_mutex_release(c->sub_mutex);
+    c->session_resume = resume;
+
+#ifdef MQTT_USING_TLS
+    /* CONNECT and the SUBSCRIBEs share as few records as possible */
+    mqtt_tls_cork(c);
+#endif
+
+    if ((rc = net_write(c, c->connect_pkt, c->connect_len)) != 0)  // send the connect packet
+        goto _exit; // there was a problem
+
+    if (!resume && (rc = mqtt_subscribe_all(c)) != PAHO_SUCCESS)
+        goto _exit;
+
+#ifdef MQTT_USING_TLS
+    if ((rc = mqtt_tls_uncork(c)) != PAHO_SUCCESS)
+        goto _exit;
+#endif
+
+_exit:
+    return rc;
+}
+
+/*
+ * Handle the CONNACK answering MQTTConnect.
+ *
+ * @return the CONNACK return code, 0 on connect successfully, -1 on error.
+ */
+static int MQTTConnack(MQTTClient *c, int packet_type)
+{
+    int rc = -1, resume = c->session_resume;
+
+    if (packet_type == CONNACK)
+    {
+        unsigned char sessionPresent, connack_rc;
+
+        if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+        {
+            rc = connack_rc;
+
+            /* a new session, the server will not resend any of the unreleased ids */
+            if (rc == 0 && !sessionPresent && c->qos2_in_map)
+            {
+                rt_memset(c->qos2_in_map, 0, (MAX_PACKET_ID + 1) / 8);
+#ifdef MQTT_USING_STORE
+                mqtt_session_log(c, SESSION_REC_QOS2_CLEAR, 0, RT_NULL);
+#endif
+            }
+
+            if (rc == 0 && resume)
+            {
+                if (sessionPresent)
+                    LOG_I("Session present, %d subscriptions kept.", c->sub_num);
+                else if (mqtt_subscribe_all(c) != PAHO_SUCCESS) /* the broker lost the session */
+                    rc = -1;
+            }
+        }
+        else
+        {
+            rc = -1;
+        }
+    }
+    else
+        rc = -1;
+
+    if (rc == 0)
+        c->isconnected = 1;
+
+    return rc;
+}
+
+static int MQTTDisconnect(MQTTClient *c)
+{
+    int rc = PAHO_FAILURE;
+    int len = 0;
+
+    len = MQTTSerialize_disconnect(c->buf, c->buf_size);
+    if (len > 0)
+        rc = sendPacket(c, len);            // send the disconnect packet
+
+    c->isconnected = 0;
+
+    return rc;
+}
+
+static int MQTT_local_send(MQTTClient *c, const void *data, int len)
+{
+    int send_len;
+
+    send_len = write(c->reactor->pipe[1], data, len);
+
+    return send_len;
+}
+
+/*
+ * Reserve ring space for one serialized publish packet, called by the publishing threads.
+ * Only the index update runs with interrupts disabled, the packet is serialized afterwards
+ * without holding any lock.
+ *
+ * @return the reserved slot, RT_NULL if the ring is full.
+ */
+struct MQTTPubSlot *mqtt_pub_ring_reserve(MQTTClient *c, rt_uint32_t len, MQTTMessage *message)
+{
+    rt_base_t level;
+    rt_uint32_t offset, span;
+    struct MQTTPubSlot *slot = RT_NULL;
+
+    level = rt_hw_interrupt_disable();
+
+    if (c->pub_slot_count == 0)
+        c->pub_ring_wr = 0;
+
+    /* a packet never wraps, the end of the ring is skipped instead */
+    offset = c->pub_ring_wr;
+    span = len;
+    if (offset + len > c->pub_ring_size)
+    {
+        span += c->pub_ring_size - offset;
+        offset = 0;
+    }
+
+    if (c->pub_slot_count < c->pub_slot_num && c->pub_ring_used + span <= c->pub_ring_size)
+    {
+        slot = &c->pub_slots[c->pub_slot_head];
+        slot->state = PUB_SLOT_RESERVED;
+        slot->qos = message->qos;
+        slot->offset = offset;
+        slot->len = len;
+        slot->span = span;
+        if (message->qos != QOS0)
+        {
+            message->id = getNextPacketId(c);
+            packetid_take(c, message->id);
+        }
+        slot->id = message->id;
+        slot->stream = RT_NULL;
+#ifdef MQTT_USING_STORE
+        slot->store_seq = 0;
+#endif
+
+        c->pub_slot_head = (c->pub_slot_head + 1) % c->pub_slot_num;
+        c->pub_slot_count++;
+        c->pub_ring_used += span;
+        c->pub_ring_wr = offset + len;
+    }
+
+    rt_hw_interrupt_enable(level);
+
+    return slot;
+}
+
+/* wake the worker up for new packets, unless that is already pending */
+static void mqtt_pub_ring_signal(MQTTClient *c)
+{
+    rt_base_t level;
+    int signal;
+
+    level = rt_hw_interrupt_disable();
+    signal = !c->pub_signaled;
+    c->pub_signaled = 1;
+    rt_hw_interrupt_enable(level);
+
+    if (signal && c->reactor)
+    {
+        MQTT_local_send(c, "", 1);
+    }
+}
+
+/* hand a reserved slot to the worker */
+void mqtt_pub_ring_commit(MQTTClient *c, struct MQTTPubSlot *slot, int state)
+{
+    slot->state = state;
+    mqtt_pub_ring_signal(c);
+}
+
+/* give the space of the finished packets at the tail back to the publishing threads */
+void mqtt_pub_ring_release(MQTTClient *c)
+{
+    rt_base_t level;
+    struct MQTTPubSlot *slot;
+
+    level = rt_hw_interrupt_disable();
+    while (c->pub_slot_count > 0)
+    {
+        slot = &c->pub_slots[c->pub_slot_tail];
+        if (slot->state != PUB_SLOT_DONE)
+            break;
+
+        slot->state = PUB_SLOT_FREE;
+#ifdef MQTT_USING_STORE
+        if (slot->store_seq != 0 && c->store)
+        {
+            /* completed in order, the store cursor may move past its record */
+            c->store->ack_seq = slot->store_seq;
+            c->store->ack_off = slot->store_end;
+            c->store->ack_bytes += slot->len;
+        }
+#endif
+        c->pub_ring_used -= slot->span;
+        c->pub_slot_tail = (c->pub_slot_tail + 1) % c->pub_slot_num;
+        c->pub_slot_count--;
+    }
+    rt_hw_interrupt_enable(level);
+}
+
+static void mqtt_pub_stream_put(struct MQTTPubStream *stream)
+{
+    rt_base_t level;
+    int last;
+
+    level = rt_hw_interrupt_disable();
+    last = (--stream->refs == 0);
+    rt_hw_interrupt_enable(level);
+
+    if (last)
+    {
+        rt_sem_delete(stream->done);
+        rt_free(stream);
+    }
+}
+
+/* the publishing thread waiting for a stream goes on, the producer is not called anymore */
+static void mqtt_pub_stream_done(struct MQTTPubSlot *slot, int rc)
+{
+    struct MQTTPubStream *stream = slot->stream;
+    rt_base_t level;
+
+    if (stream)
+    {
+        slot->stream = RT_NULL;
+        level = rt_hw_interrupt_disable();
+        stream->rc = rc;
+        stream->finished = 1;
+        rt_hw_interrupt_enable(level);
+        rt_sem_release(stream->done);
+        mqtt_pub_stream_put(stream);
+    }
+}
+
+/*
+ * Drop a stream publish without a complete packet on the connection. One not
+ * sent yet is cancelled, the send index has to move past it before it is freed.
+ */
+static void mqtt_pub_stream_drop(MQTTClient *c, struct MQTTPubSlot *slot)
+{
+    if (slot->state == PUB_SLOT_INFLIGHT || slot->state == PUB_SLOT_RELEASING)
+        c->inflight_count--;
+    if (slot->qos != QOS0)
+        packetid_release(c, slot->id);
+    mqtt_timer_stop(c, &slot->retry);
+    slot->state = (slot->state == PUB_SLOT_COMMITTED) ? PUB_SLOT_CANCELLED : PUB_SLOT_DONE;
+    mqtt_pub_stream_done(slot, PAHO_FAILURE);
+}
+
+/* call the producer, unless the publishing thread gave up waiting */
+static int mqtt_pub_stream_produce(MQTTClient *c, struct MQTTPubStream *stream, rt_uint32_t offset, int len)
+{
+    rt_base_t level;
+    int orphan;
+
+    level = rt_hw_interrupt_disable();
+    orphan = stream->orphan;
+    stream->busy = !orphan;
+    rt_hw_interrupt_enable(level);
+    if (orphan)
+        return -1;
+
+    len = stream->producer(c, stream->arg, offset, c->buf, len);
+
+    level = rt_hw_interrupt_disable();
+    stream->busy = 0;
+    orphan = stream->orphan;
+    rt_hw_interrupt_enable(level);
+    if (orphan)
+    {
+        /* the publishing thread waits for this call to return */
+        rt_sem_release(stream->done);
+    }
+
+    return len;
+}
+
+/*
+ * Send a publish packet of the ring, pulling the payload of a stream through
+ * buf. A producer error leaves a partial packet on the connection, the publish
+ * is dropped and the connection has to be made again.
+ */
+static int mqtt_pub_slot_write(MQTTClient *c, struct MQTTPubSlot *slot)
+{
+    struct MQTTPubStream *stream = slot->stream;
+    rt_uint32_t offset;
+    int len;
+
+    if (net_write(c, c->pub_ring + slot->offset, slot->len) != 0)
+        return PAHO_FAILURE;
+
+    for (offset = 0; stream && offset < stream->payloadlen; offset += len)
+    {
+        len = stream->payloadlen - offset;
+        if (len > c->buf_size)
+            len = c->buf_size;
+
+        len = mqtt_pub_stream_produce(c, stream, offset, len);
+        if (len <= 0 || len > c->buf_size)
+        {
+            LOG_E("publish producer error(%d) at offset %d.", len, offset);
+            mqtt_pub_stream_drop(c, slot);
+            return PAHO_FAILURE;
+        }
+
+        if (net_write(c, c->buf, len) != 0)
+            return PAHO_FAILURE;
+    }
+
+    return PAHO_SUCCESS;
+}
+
+/*
+ * Send the committed packets straight from the ring, worker thread only.
+ * Packets lying back to back in the ring go out with a single write, so a burst
+ * costs one send per contiguous run instead of one per packet. QoS1 and QoS2 packets
+ * stay in the ring until their PUBACK or PUBCOMP, at most inflight_window of them
+ * at a time.
+ */
+int mqtt_pub_ring_send(MQTTClient *c)
+{
+    struct MQTTPubSlot *slot;
+    rt_uint32_t idx, count, inflight, scanned, start = 0, end = 0;
+
+    for (;;)
+    {
+        /* gather the run of committed packets starting at the send index */
+        idx = c->pub_slot_send;
+        count = inflight = scanned = 0;
+        /* once around at most, a ring full of sent packets has nothing to send */
+        while (scanned++ < c->pub_slot_num)
+        {
+            slot = &c->pub_slots[idx];
+
+            if ((slot->state == PUB_SLOT_CANCELLED || slot->state == PUB_SLOT_DONE) && count == 0)
+            {
+                /* never completed, or acknowledged before a retransmission */
+                slot->state = PUB_SLOT_DONE;
+                c->pub_slot_send = idx = (idx + 1) % c->pub_slot_num;
+                mqtt_pub_ring_release(c);
+                continue;
+            }
+            else if (slot->state == PUB_SLOT_RELEASING && count == 0)
+            {
+                /* past PUBREC, only its PUBREL is resent after a reconnect */
+                c->pub_slot_send = idx = (idx + 1) % c->pub_slot_num;
+                continue;
+            }
+            else if (slot->state == PUB_SLOT_COMMITTED && count == 0 && slot->stream && slot->stream->orphan)
+            {
+                /* nobody waits for it anymore, the producer may be gone; skipped as cancelled */
+                mqtt_pub_stream_drop(c, slot);
+                continue;
+            }
+            else if (slot->state == PUB_SLOT_COMMITTED && (count == 0 || (slot->offset == end && !slot->stream)))
+            {
+                if (slot->qos != QOS0)
+                {
+                    if (c->inflight_count + inflight >= c->inflight_window)
+                        break;
+                    inflight++;
+                }
+
+                if (count++ == 0)
+                    start = slot->offset;
+                end = slot->offset + slot->len;
+
+                /* the payload of a stream follows its header, nothing else joins the write */
+                if (slot->stream)
+                    break;
+            }
+            else
+            {
+                /* free, still being serialized, cancelled or wrapped: the run ends here */
+                break;
+            }
+
+            idx = (idx + 1) % c->pub_slot_num;
+        }
+
+        if (count == 0)
+            break;
+
+#ifdef MQTT_USING_STORE
+        mqtt_session_log_sent(c, c->pub_slot_send, count);
+#endif
+        slot = &c->pub_slots[c->pub_slot_send];
+        if (slot->stream ? mqtt_pub_slot_write(c, slot) != PAHO_SUCCESS : net_write(c, c->pub_ring + start, end - start) != 0)
+        {
+            LOG_D("publish ring send failed, %d packets", count);
+            return PAHO_FAILURE;
+        }
+
+        c->inflight_count += inflight;
+        while (count--)
+        {
+            slot = &c->pub_slots[c->pub_slot_send];
+            slot->state = (slot->qos == QOS0) ? PUB_SLOT_DONE : PUB_SLOT_INFLIGHT;
+            if (slot->qos != QOS0 && MQTT_RETRY_INTERVAL > 0)
+            {
+                mqtt_timer_start(c, &slot->retry, rt_tick_from_millisecond(MQTT_RETRY_INTERVAL));
+            }
+            c->pub_slot_send = (c->pub_slot_send + 1) % c->pub_slot_num;
+
+            if (slot->stream)
+            {
+                /* a QoS1/QoS2 stream is waited for until its acknowledgement */
+                if (slot->qos == QOS0)
+                    mqtt_pub_stream_done(slot, PAHO_SUCCESS);
+            }
+            else if (c->isblocking && c->pub_mutex)
+            {
+                rt_mutex_release(c->pub_mutex);
+            }
+        }
+        mqtt_pub_ring_release(c);
+    }
+
+    return PAHO_SUCCESS;
+}
+
+/* the in-flight publish with this packet id and state, RT_NULL if there is none */
+static struct MQTTPubSlot *mqtt_pub_ring_find(MQTTClient *c, unsigned short id, int state)
+{
+    rt_uint32_t i, idx;
+
+    /* the send index equals the tail both when nothing and when everything was sent */
+    for (i = 0, idx = c->pub_slot_tail; i < c->pub_slot_count; i++, idx = (idx + 1) % c->pub_slot_num)
+    {
+        if (c->pub_slots[idx].state == state && c->pub_slots[idx].id == id)
+            return &c->pub_slots[idx];
+    }
+
+    return RT_NULL;
+}
+
+/* finish an in-flight publish and report it to the application */
+static void mqtt_pub_ring_complete(MQTTClient *c, struct MQTTPubSlot *slot, int rc)
+{
+    unsigned short id = slot->id;
+
+#ifdef MQTT_USING_STORE
+    if (rc == PAHO_SUCCESS)
+        mqtt_session_log(c, SESSION_REC_DONE, id, RT_NULL);
+#endif
+    mqtt_timer_stop(c, &slot->retry);
+    slot->state = PUB_SLOT_DONE;
+    c->inflight_count--;
+    packetid_release(c, id);
+    mqtt_pub_stream_done(slot, rc);
+    mqtt_pub_ring_release(c);
+
+    if (c->delivery_callback)
+    {
+        c->delivery_callback(c, id, rc);
+    }
+}
+
+static int mqtt_pub_ring_flush(MQTTClient *c);
+
+/* PUBACK or PUBCOMP received, the window has room for the next queued packets */
+int mqtt_pub_ring_ack(MQTTClient *c, int type, unsigned short id)
+{
+    struct MQTTPubSlot *slot;
+
+    slot = mqtt_pub_ring_find(c, id, (type == PUBACK) ? PUB_SLOT_INFLIGHT : PUB_SLOT_RELEASING);
+    if (slot == RT_NULL || slot->qos != ((type == PUBACK) ? QOS1 : QOS2))
+    {
+        LOG_D("%s for unknown packet id %d", (type == PUBACK) ? "PUBACK" : "PUBCOMP", id);
+        return PAHO_SUCCESS;
+    }
+
+    mqtt_pub_ring_complete(c, slot, PAHO_SUCCESS);
+
+    return mqtt_pub_ring_flush(c);
+}
+
+static int mqtt_pub_ring_pubrel(MQTTClient *c, unsigned short id)
+{
+    int len;
+
+    len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, id);
+    if (len <= 0)
+        return PAHO_FAILURE;
+
+    return sendPacket(c, len);
+}
+
+/*
+ * PUBREC received, the QoS2 publish is released and stays in the window until
+ * its PUBCOMP. A PUBREC for an id already released is answered again, the broker
+ * resends it when our PUBREL got lost with the connection.
+ */
+static int mqtt_pub_ring_rec(MQTTClient *c, unsigned short id)
+{
+    struct MQTTPubSlot *slot;
+
+    slot = mqtt_pub_ring_find(c, id, PUB_SLOT_INFLIGHT);
+    if (slot && slot->qos == QOS2)
+    {
+        slot->state = PUB_SLOT_RELEASING;
+#ifdef MQTT_USING_STORE
+        mqtt_session_log(c, SESSION_REC_PUBREL, id, RT_NULL);
+#endif
+        if (MQTT_RETRY_INTERVAL > 0)
+        {
+            mqtt_timer_start(c, &slot->retry, rt_tick_from_millisecond(MQTT_RETRY_INTERVAL));
+        }
+    }
+    else if (mqtt_pub_ring_find(c, id, PUB_SLOT_RELEASING) == RT_NULL)
+    {
+        LOG_D("PUBREC for unknown packet id %d", id);
+    }
+
+    return mqtt_pub_ring_pubrel(c, id);
+}
+
+/*
+ * After a reconnect the unacknowledged publishes are sent again from the ring,
+ * in their original order and with the DUP flag set. QoS2 publishes already past
+ * PUBREC only get their PUBREL again and keep their place in the window.
+ */
+static int mqtt_pub_ring_rewind(MQTTClient *c)
+{
+    rt_uint32_t i, idx;
+    MQTTHeader header;
+
+    c->inflight_count = 0;
+    for (i = 0, idx = c->pub_slot_tail; i < c->pub_slot_count; i++, idx = (idx + 1) % c->pub_slot_num)
+    {
+        struct MQTTPubSlot *slot = &c->pub_slots[idx];
+
+        if (slot->state == PUB_SLOT_RELEASING)
+        {
+            c->inflight_count++;
+            if (mqtt_pub_ring_pubrel(c, slot->id) != PAHO_SUCCESS)
+                return PAHO_FAILURE;
+            if (MQTT_RETRY_INTERVAL > 0)
+            {
+                mqtt_timer_start(c, &slot->retry, rt_tick_from_millisecond(MQTT_RETRY_INTERVAL));
+            }
+            continue;
+        }
+
+        if (slot->state != PUB_SLOT_INFLIGHT)
+            continue;
+
+        header.byte = c->pub_ring[slot->offset];
+        header.bits.dup = 1;
+        c->pub_ring[slot->offset] = header.byte;
+        slot->state = PUB_SLOT_COMMITTED;
+    }
+
+    c->pub_slot_send = c->pub_slot_tail;
+
+    return PAHO_SUCCESS;
+}
+
+/*
+ * No acknowledgement within MQTT_RETRY_INTERVAL, the publish is sent again with
+ * the DUP flag set, or its PUBREL once past PUBREC. It keeps its place in the
+ * window and in the ring.
+ */
+int mqtt_pub_retry_timeout(MQTTClient *c, struct MQTTTimer *timer)
+{
+    struct MQTTPubSlot *slot = rt_container_of(timer, struct MQTTPubSlot, retry);
+    MQTTHeader header;
+
+    if (slot->state == PUB_SLOT_RELEASING)
+    {
+        LOG_D("resend PUBREL, packet id %d", slot->id);
+        if (mqtt_pub_ring_pubrel(c, slot->id) != PAHO_SUCCESS)
+            return PAHO_FAILURE;
+    }
+    else if (slot->state == PUB_SLOT_INFLIGHT && slot->stream && slot->stream->orphan)
+    {
+        mqtt_pub_stream_drop(c, slot);
+        mqtt_pub_ring_release(c);
+        return PAHO_SUCCESS;
+    }
+    else if (slot->state == PUB_SLOT_INFLIGHT)
+    {
+        LOG_D("resend PUBLISH, packet id %d", slot->id);
+        header.byte = c->pub_ring[slot->offset];
+        header.bits.dup = 1;
+        c->pub_ring[slot->offset] = header.byte;
+        if (mqtt_pub_slot_write(c, slot) != PAHO_SUCCESS)
+            return PAHO_FAILURE;
+    }
+    else
+    {
+        return PAHO_SUCCESS;
+    }
+
+    mqtt_timer_start(c, timer, rt_tick_from_millisecond(MQTT_RETRY_INTERVAL));
+    return PAHO_SUCCESS;
+}
+
+#ifdef MQTT_USING_STORE
+rt_uint32_t mqtt_store_crc32(rt_uint32_t crc, const unsigned char *buf, rt_uint32_t len)
+{
+    static const rt_uint32_t table[16] =
+    {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+
+    return ~crc;
+}
+
+rt_uint32_t mqtt_store_record_crc(struct MQTTStoreRecord *rec, const unsigned char *packet)
+{
+    return mqtt_store_crc32(mqtt_store_crc32(0, (unsigned char *)rec, offsetof(struct MQTTStoreRecord, crc)),
+                            packet, rec->len);
+}
+
+/* path of a store file, seq 0 names the cursor file; store lock held */
+static const char *mqtt_store_name(MQTTClient *c, rt_uint32_t seq)
+{
+    if (seq == 0)
+        rt_snprintf(c->store->name, strlen(c->store_path) + 16, "%s/cursor", c->store_path);
+    else
+        rt_snprintf(c->store->name, strlen(c->store_path) + 16, "%s/%08x.log", c->store_path, seq);
+
+    return c->store->name;
+}
+
+/* nothing left to forward, store lock held */
+static int mqtt_store_empty(struct MQTTStore *s)
+{
+    return s->rd_seq == s->wr_seq && s->rd_off == s->wr_off;
+}
+
+/* the worker is done with the file being read, it moves on to the next one; store lock held */
+static void mqtt_store_next(struct MQTTStore *s)
+{
+    if (s->rd_fd >= 0)
+    {
+        close(s->rd_fd);
+        s->rd_fd = -1;
+    }
+    s->rd_seq++;
+    s->rd_off = 0;
+    s->rbuf_pos = s->rbuf_len = 0;
+}
+
+/* a damaged record, the rest of its file is given up; store lock held */
+static void mqtt_store_skip(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+
+    LOG_E("store file %08x damaged at %d, skipped.", s->rd_seq, s->rd_off);
+    if (s->rd_seq == s->wr_seq)
+    {
+        /* further records go to a new file */
+        if (s->wr_fd >= 0)
+            close(s->wr_fd);
+        s->wr_fd = -1;
+        s->wr_seq++;
+        s->wr_off = s->sync_off = 0;
+    }
+    mqtt_store_next(s);
+}
+
+/* write the position of the last completed record, store lock held */
+static void mqtt_store_mark(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+    struct MQTTStoreCursor cursor;
+    int fd;
+
+    cursor.seq = s->ack_seq;
+    cursor.off = s->ack_off;
+    cursor.crc = mqtt_store_crc32(0, (unsigned char *)&cursor, offsetof(struct MQTTStoreCursor, crc));
+
+    fd = open(mqtt_store_name(c, 0), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || write(fd, &cursor, sizeof(cursor)) != sizeof(cursor))
+    {
+        LOG_E("store cursor write failed.");
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    s->ack_bytes = 0;
+}
+
+/*
+ * Append a publish to the store, called by the publishing threads while offline
+ * or while earlier publishes are still stored. The packet is serialized with
+ * packet id 0, its id is assigned when it is forwarded into the ring.
+ */
+int mqtt_store_append(MQTTClient *c, MQTTString *topic, MQTTMessage *message)
+{
+    struct MQTTStore *s = c->store;
+    struct MQTTStoreRecord rec;
+    int rc = PAHO_FAILURE;
+    int rem, len, size;
+
+    rem = MQTTSerialize_publishLength(message->qos, *topic, message->payloadlen);
+    len = MQTTPacket_len(rem);
+    if (len > c->pub_ring_size)
+    {
+        LOG_E("publish of %d bytes does not fit the publish ring.", len);
+        return PAHO_FAILURE;
+    }
+    size = sizeof(rec) + len;
+
+    rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+
+    if (s->wbuf_size < size)
+    {
+        unsigned char *wbuf = rt_realloc(s->wbuf, size);
+
+        if (wbuf == RT_NULL)
+            goto _exit;
+        s->wbuf = wbuf;
+        s->wbuf_size = size;
+    }
+
+    if (MQTTSerialize_publish(s->wbuf + sizeof(rec), len, 0, message->qos, message->retained, 0, *topic,
+                              (unsigned char *)message->payload, message->payloadlen) != len)
+        goto _exit;
+
+    rt_memset(&rec, 0x00, sizeof(rec));
+    rec.magic = MQTT_STORE_MAGIC;
+    rec.qos = message->qos;
+    rec.id_pos = len - rem + 2 + MQTTstrlen(*topic);
+    rec.len = len;
+    rec.crc = mqtt_store_record_crc(&rec, s->wbuf + sizeof(rec));
+    rt_memcpy(s->wbuf, &rec, sizeof(rec));
+
+    /* a new file once this one is full */
+    if (s->wr_off > 0 && s->wr_off + size > MQTT_STORE_SEGMENT_SIZE)
+    {
+        if (s->wr_seq + 1 - s->head_seq >= MQTT_STORE_SEGMENTS)
+        {
+            LOG_D("store is full, %d bytes dropped.", len);
+            goto _exit;
+        }
+
+        fsync(s->wr_fd);
+        close(s->wr_fd);
+        s->wr_fd = -1;
+        s->wr_seq++;
+        s->wr_off = s->sync_off = 0;
+    }
+
+    if (s->wr_fd < 0)
+    {
+        s->wr_fd = open(mqtt_store_name(c, s->wr_seq), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (s->wr_fd < 0)
+        {
+            LOG_E("store file %08x open failed.", s->wr_seq);
+            goto _exit;
+        }
+    }
+
+    /* a record cut short is overwritten by the next one */
+    if (lseek(s->wr_fd, s->wr_off, SEEK_SET) != s->wr_off || write(s->wr_fd, s->wbuf, size) != size)
+    {
+        LOG_E("store file %08x write failed.", s->wr_seq);
+        goto _exit;
+    }
+    s->wr_off += size;
+
+    if (s->wr_off - s->sync_off >= MQTT_STORE_SYNC_BYTES)
+    {
+        fsync(s->wr_fd);
+        s->sync_off = s->wr_off;
+    }
+    rc = PAHO_SUCCESS;
+
+_exit:
+    rt_mutex_release(s->lock);
+
+    if (rc == PAHO_SUCCESS && c->isconnected)
+    {
+        mqtt_pub_ring_signal(c);
+    }
+
+    return rc;
+}
+
+/*
+ * Read the file being forwarded at pos, worker thread only. The file still
+ * appended to is read through the writer's descriptor and only up to its
+ * last whole record.
+ *
+ * @return the bytes read, 0 at the end of the file, -1 on error.
+ */
+static int mqtt_store_read(MQTTClient *c, rt_uint32_t pos, unsigned char *buf, rt_uint32_t len)
+{
+    struct MQTTStore *s = c->store;
+    int fd, rc = 0;
+
+    rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+    if (s->rd_seq == s->wr_seq)
+    {
+        fd = s->wr_fd;
+        if (len > s->wr_off - pos)
+            len = s->wr_off - pos;
+    }
+    else
+    {
+        if (s->rd_fd < 0)
+            s->rd_fd = open(mqtt_store_name(c, s->rd_seq), O_RDONLY, 0);
+        fd = s->rd_fd;
+    }
+
+    if (fd < 0 || lseek(fd, pos, SEEK_SET) != pos)
+        rc = -1;
+    else if (len > 0)
+        rc = read(fd, buf, len);
+    rt_mutex_release(s->lock);
+
+    return rc;
+}
+
+/*
+ * Move stored records into the free space of the publish ring, worker thread only.
+ * Records are read MQTT_STORE_READ_SIZE bytes at a time, a larger one is read
+ * straight into its ring slot.
+ *
+ * @return the number of records moved.
+ */
+int mqtt_store_forward(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+    struct MQTTStoreRecord rec;
+    struct MQTTPubSlot *slot;
+    MQTTMessage message;
+    unsigned char *packet;
+    rt_uint32_t got;
+    int n, empty, tail, moved = 0;
+
+    for (;;)
+    {
+        rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+        empty = mqtt_store_empty(s);
+        rt_mutex_release(s->lock);
+        if (empty)
+            break;
+
+        if (s->rbuf_len < sizeof(rec))
+        {
+            rt_memmove(s->rbuf, s->rbuf + s->rbuf_pos, s->rbuf_len);
+            s->rbuf_pos = 0;
+            n = mqtt_store_read(c, s->rd_off + s->rbuf_len, s->rbuf + s->rbuf_len,
+                                MQTT_STORE_READ_SIZE - s->rbuf_len);
+            if (n > 0)
+            {
+                s->rbuf_len += n;
+                continue;
+            }
+
+            /* the end of a file before the last one, or a record cut short there */
+            rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+            tail = (s->rd_seq == s->wr_seq);
+            if (!tail)
+                mqtt_store_next(s);
+            rt_mutex_release(s->lock);
+            if (tail)
+                break;
+            continue;
+        }
+
+        rt_memcpy(&rec, s->rbuf + s->rbuf_pos, sizeof(rec));
+        if (rec.magic != MQTT_STORE_MAGIC || rec.qos > QOS2 || rec.len == 0 || rec.len > c->pub_ring_size)
+        {
+            rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+            mqtt_store_skip(c);
+            rt_mutex_release(s->lock);
+            continue;
+        }
+
+        rt_memset(&message, 0x00, sizeof(message));
+        message.qos = (enum QoS)rec.qos;
+        slot = mqtt_pub_ring_reserve(c, rec.len, &message);
+        if (slot == RT_NULL)
+            break;
+        packet = c->pub_ring + slot->offset;
+
+        got = s->rbuf_len - sizeof(rec);
+        if (got > rec.len)
+            got = rec.len;
+        rt_memcpy(packet, s->rbuf + s->rbuf_pos + sizeof(rec), got);
+        while (got < rec.len &&
+               (n = mqtt_store_read(c, s->rd_off + sizeof(rec) + got, packet + got, rec.len - got)) > 0)
+        {
+            got += n;
+        }
+
+        if (got < rec.len || mqtt_store_record_crc(&rec, packet) != rec.crc)
+        {
+            if (slot->qos != QOS0)
+                packetid_release(c, slot->id);
+            slot->state = PUB_SLOT_CANCELLED;
+
+            rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+            mqtt_store_skip(c);
+            rt_mutex_release(s->lock);
+            continue;
+        }
+
+        if (slot->qos != QOS0)
+        {
+            packet[rec.id_pos] = (unsigned char)(slot->id >> 8);
+            packet[rec.id_pos + 1] = (unsigned char)(slot->id & 0xFF);
+        }
+        slot->store_seq = s->rd_seq;
+        slot->store_end = s->rd_off + sizeof(rec) + rec.len;
+        slot->state = PUB_SLOT_COMMITTED;
+        moved++;
+
+        if (s->rbuf_len > sizeof(rec) + rec.len)
+        {
+            s->rbuf_pos += sizeof(rec) + rec.len;
+            s->rbuf_len -= sizeof(rec) + rec.len;
+        }
+        else
+        {
+            s->rbuf_pos = s->rbuf_len = 0;
+        }
+
+        s->fwd_seq = slot->store_seq;
+        s->fwd_off = slot->store_end;
+        rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+        s->rd_off = slot->store_end;
+        rt_mutex_release(s->lock);
+    }
+
+    return moved;
+}
+
+/* delete the files whose records are all completed and save the cursor, worker thread only */
+static void mqtt_store_sync(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+    int mark = 0;
+
+    if (s->ack_seq == 0)
+        return;
+
+    rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+    while (s->head_seq < s->ack_seq)
+    {
+        unlink(mqtt_store_name(c, s->head_seq));
+        s->head_seq++;
+        mark = 1;
+    }
+
+    /* every stored record is completed, start over with an empty file */
+    if (mqtt_store_empty(s) && s->ack_seq == s->fwd_seq && s->ack_off == s->fwd_off &&
+        (s->head_seq < s->wr_seq || s->wr_off > 0))
+    {
+        if (s->wr_fd >= 0)
+        {
+            close(s->wr_fd);
+            s->wr_fd = -1;
+        }
+        for (; s->head_seq <= s->wr_seq; s->head_seq++)
+        {
+            unlink(mqtt_store_name(c, s->head_seq));
+        }
+        s->rd_seq = s->fwd_seq = s->ack_seq = ++s->wr_seq;
+        s->wr_off = s->sync_off = s->rd_off = s->fwd_off = s->ack_off = 0;
+        s->rbuf_pos = s->rbuf_len = 0;
+        mark = 1;
+    }
+
+    if (mark || s->ack_bytes >= MQTT_STORE_SYNC_BYTES)
+        mqtt_store_mark(c);
+    rt_mutex_release(s->lock);
+}
+
+/*
+ * Open the store of store_path, called by paho_mqtt_start. Forwarding resumes
+ * at the cursor, new records go to a file after the last one found since that
+ * one may end with a record cut short.
+ */
+int mqtt_store_open(MQTTClient *c)
+{
+    struct MQTTStore *s;
+    struct MQTTStoreCursor cursor;
+    struct dirent *ent;
+    DIR *dir;
+    char *end;
+    rt_uint32_t seq, min_seq = 0, max_seq = 0;
+    int fd;
+
+    s = rt_calloc(1, sizeof(struct MQTTStore));
+    if (s == RT_NULL)
+        return PAHO_FAILURE;
+    c->store = s;
+    s->rd_fd = s->wr_fd = s->ses_fd = -1;
+    s->name = rt_malloc(strlen(c->store_path) + 16);
+    s->rbuf = rt_malloc(MQTT_STORE_READ_SIZE);
+    s->lock = rt_mutex_create("mstore", RT_IPC_FLAG_FIFO);
+    if (s->name == RT_NULL || s->rbuf == RT_NULL || s->lock == RT_NULL)
+        goto _exit;
+
+    mkdir(c->store_path, 0777);
+    dir = opendir(c->store_path);
+    if (dir == RT_NULL)
+    {
+        LOG_E("store directory %s open failed.", c->store_path);
+        goto _exit;
+    }
+    while ((ent = readdir(dir)) != RT_NULL)
+    {
+        seq = strtoul(ent->d_name, &end, 16);
+        if (seq == 0 || end != ent->d_name + 8 || (strcmp(end, ".log") != 0 && strcmp(end, ".LOG") != 0))
+            continue;
+
+        if (min_seq == 0 || seq < min_seq)
+            min_seq = seq;
+        if (seq > max_seq)
+            max_seq = seq;
+    }
+    closedir(dir);
+
+    /* resume at the cursor when it lies within the files found */
+    s->rd_seq = min_seq;
+    fd = open(mqtt_store_name(c, 0), O_RDONLY, 0);
+    if (fd >= 0)
+    {
+        if (read(fd, &cursor, sizeof(cursor)) == sizeof(cursor) &&
+            cursor.crc == mqtt_store_crc32(0, (unsigned char *)&cursor, offsetof(struct MQTTStoreCursor, crc)) &&
+            cursor.seq >= min_seq && cursor.seq <= max_seq)
+        {
+            s->rd_seq = cursor.seq;
+            s->rd_off = cursor.off;
+        }
+        close(fd);
+    }
+
+    s->head_seq = min_seq;
+    s->wr_seq = max_seq + 1;
+    if (min_seq == 0)
+        s->head_seq = s->rd_seq = s->wr_seq;
+    s->fwd_seq = s->ack_seq = s->rd_seq;
+    s->fwd_off = s->ack_off = s->rd_off;
+
+    if (!mqtt_store_empty(s))
+    {
+        LOG_I("store %s: files %08x-%08x to forward.", c->store_path, s->rd_seq, max_seq);
+    }
+
+    return PAHO_SUCCESS;
+
+_exit:
+    if (s->lock)
+        rt_mutex_delete(s->lock);
+    rt_free(s->name);
+    rt_free(s->rbuf);
+    rt_free(s);
+    c->store = RT_NULL;
+    return PAHO_FAILURE;
+}
+
+/* write out the buffered journal records */
+static void mqtt_session_write(MQTTClient *c, const void *data, rt_uint32_t len)
+{
+    struct MQTTStore *s = c->store;
+
+    if (len == 0)
+        return;
+
+    if (lseek(s->ses_fd, s->ses_off, SEEK_SET) != s->ses_off || write(s->ses_fd, data, len) != len)
+    {
+        LOG_E("session journal write failed.");
+        return;
+    }
+    s->ses_off += len;
+}
+
+/*
+ * Append a record to the session journal, worker thread only. Records are
+ * buffered and written out together by mqtt_session_flush, a PUBLISH record
+ * carries its packet unless the packet was forwarded from the store.
+ */
+void mqtt_session_log(MQTTClient *c, int type, unsigned short id, struct MQTTPubSlot *slot)
+{
+    struct MQTTStore *s = c->store;
+    struct MQTTSessionRecord rec;
+    const unsigned char *packet = RT_NULL;
+    rt_uint32_t len = 0;
+
+    if (s == RT_NULL || s->ses_fd < 0)
+        return;
+
+    rt_memset(&rec, 0x00, sizeof(rec));
+    rec.type = type;
+    rec.id = id;
+    if (type == SESSION_REC_PUBLISH)
+    {
+        rec.qos = slot->qos;
+        rec.len = slot->len;
+        rec.store_seq = slot->store_seq;
+        rec.store_end = slot->store_end;
+        if (slot->store_seq != 0)
+        {
+            rec.type = SESSION_REC_STORED;
+        }
+        else
+        {
+            packet = c->pub_ring + slot->offset;
+            len = slot->len;
+        }
+    }
+    rec.crc = mqtt_store_crc32(0, (unsigned char *)&rec, offsetof(struct MQTTSessionRecord, crc));
+    if (packet)
+        rec.crc = mqtt_store_crc32(rec.crc, packet, len);
+
+    if (s->jbuf_len + sizeof(rec) + len > MQTT_SESSION_BUF_SIZE)
+    {
+        mqtt_session_write(c, s->jbuf, s->jbuf_len);
+        s->jbuf_len = 0;
+    }
+
+    if (sizeof(rec) + len > MQTT_SESSION_BUF_SIZE)
+    {
+        mqtt_session_write(c, &rec, sizeof(rec));
+        mqtt_session_write(c, packet, len);
+        return;
+    }
+
+    rt_memcpy(s->jbuf + s->jbuf_len, &rec, sizeof(rec));
+    if (packet)
+        rt_memcpy(s->jbuf + s->jbuf_len + sizeof(rec), packet, len);
+    s->jbuf_len += sizeof(rec) + len;
+}
+
+/* the QoS1/QoS2 packets of a run about to be sent, written out before they go */
+void mqtt_session_log_sent(MQTTClient *c, rt_uint32_t idx, rt_uint32_t count)
+{
+    if (c->store == RT_NULL || c->store->ses_fd < 0)
+        return;
+
+    for (; count > 0; count--, idx = (idx + 1) % c->pub_slot_num)
+    {
+        /* the payload of a stream is not at hand after a restart */
+        if (c->pub_slots[idx].qos != QOS0 && !c->pub_slots[idx].stream)
+            mqtt_session_log(c, SESSION_REC_PUBLISH, c->pub_slots[idx].id, &c->pub_slots[idx]);
+    }
+    mqtt_session_flush(c);
+}
+
+/*
+ * Rewrite the journal as a snapshot of the current session state: the packet id
+ * counter, the publishes waiting for their acknowledgement and the inbound QoS2
+ * ids not released yet. Written to a new file that replaces the journal.
+ */
+static void mqtt_session_compact(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+    rt_uint32_t i, idx;
+
+    if (s->ses_fd >= 0)
+        close(s->ses_fd);
+    s->jbuf_len = 0;
+    s->ses_off = s->ses_sync = 0;
+    s->ses_fd = open(s->ses_tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (s->ses_fd < 0)
+    {
+        LOG_E("session journal open failed.");
+        return;
+    }
+
+    mqtt_session_log(c, SESSION_REC_NEXT_ID, c->next_packetid, RT_NULL);
+    for (i = 0, idx = c->pub_slot_tail; i < c->pub_slot_count; i++, idx = (idx + 1) % c->pub_slot_num)
+    {
+        struct MQTTPubSlot *slot = &c->pub_slots[idx];
+
+        if (slot->stream)
+            continue;
+
+        /* a committed packet with DUP set was sent before the connection was lost */
+        if (slot->state == PUB_SLOT_INFLIGHT ||
+            (slot->state == PUB_SLOT_COMMITTED && slot->qos != QOS0 && (c->pub_ring[slot->offset] & 0x08)))
+            mqtt_session_log(c, SESSION_REC_PUBLISH, slot->id, slot);
+        else if (slot->state == PUB_SLOT_RELEASING)
+            mqtt_session_log(c, SESSION_REC_PUBREL, slot->id, RT_NULL);
+    }
+    for (i = 0; c->qos2_in_map && i <= MAX_PACKET_ID; i++)
+    {
+        if (c->qos2_in_map[i / 32] == 0)
+        {
+            i |= 31;
+            continue;
+        }
+        if (c->qos2_in_map[i / 32] & (1UL << (i % 32)))
+            mqtt_session_log(c, SESSION_REC_QOS2_IN, i, RT_NULL);
+    }
+    mqtt_session_write(c, s->jbuf, s->jbuf_len);
+    s->jbuf_len = 0;
+    fsync(s->ses_fd);
+    close(s->ses_fd);
+
+    unlink(s->ses_name);
+    if (rename(s->ses_tmp, s->ses_name) != 0)
+        LOG_E("session journal rename failed.");
+
+    s->ses_fd = open(s->ses_name, O_RDWR, 0);
+    s->ses_sync = s->ses_off;
+    s->ses_base = s->ses_off;
+}
+
+/* write the buffered records out, the journal is compacted once it has grown enough */
+void mqtt_session_flush(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+
+    if (s == RT_NULL || s->ses_fd < 0 || s->jbuf_len == 0)
+        return;
+
+    mqtt_session_write(c, s->jbuf, s->jbuf_len);
+    s->jbuf_len = 0;
+
+    if (s->ses_off - s->ses_base >= MQTT_SESSION_LOG_SIZE)
+    {
+        mqtt_session_compact(c);
+    }
+    else if (s->ses_off - s->ses_sync >= MQTT_STORE_SYNC_BYTES)
+    {
+        fsync(s->ses_fd);
+        s->ses_sync = s->ses_off;
+    }
+}
+
+/*
+ * Read the packet of a store record back into the publish ring for the session
+ * restore, the record ends at end of file seq.
+ *
+ * @return the packet id offset in the packet, -1 if the record is gone or damaged.
+ */
+static int mqtt_store_load(MQTTClient *c, rt_uint32_t seq, rt_uint32_t end, unsigned char *packet, rt_uint32_t len)
+{
+    struct MQTTStoreRecord rec;
+    rt_uint32_t pos = end - len - sizeof(rec);
+    int fd, rc = -1;
+
+    if (end < len + sizeof(rec))
+        return -1;
+
+    fd = open(mqtt_store_name(c, seq), O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    if (lseek(fd, pos, SEEK_SET) == pos && read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+        rec.magic == MQTT_STORE_MAGIC && rec.len == len && rec.id_pos + 2 <= len &&
+        read(fd, packet, len) == len && mqtt_store_record_crc(&rec, packet) == rec.crc)
+        rc = rec.id_pos;
+    close(fd);
+
+    return rc;
+}
+
+/*
+ * Restore the session state of the journal before the worker starts, called by
+ * paho_mqtt_start after the store is opened. The publishes waiting for their
+ * acknowledgement are put back into the publish ring as sent, so the reconnect
+ * resends them with their packet ids, and the packet id counter and the inbound
+ * QoS2 ids continue where they were.
+ */
+int mqtt_session_restore(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+    struct MQTTSessionRecord rec;
+    struct MQTTSessionEntry
+    {
+        rt_uint16_t id;
+        rt_uint8_t qos, state, stored;
+        rt_uint32_t pos, len, store_seq, store_end;
+    } *ent;
+    struct MQTTPubSlot *slot;
+    MQTTMessage message;
+    rt_uint32_t pos = 0, crc, body, seq = 0, end = 0;
+    int fd, i, len, id_pos, num = 0;
+
+    len = strlen(c->store_path) + 16;
+    s->ses_name = rt_malloc(len * 2);
+    s->jbuf = rt_malloc(MQTT_SESSION_BUF_SIZE);
+    ent = rt_calloc(c->pub_slot_num, sizeof(struct MQTTSessionEntry));
+    if (s->ses_name == RT_NULL || s->jbuf == RT_NULL || ent == RT_NULL)
+    {
+        rt_free(ent);
+        return PAHO_FAILURE;
+    }
+    s->ses_tmp = s->ses_name + len;
+    rt_snprintf(s->ses_name, len, "%s/session", c->store_path);
+    rt_snprintf(s->ses_tmp, len, "%s/session.tmp", c->store_path);
+
+    /* the snapshot is still in the new file if the restart came while it was replacing the journal */
+    fd = open(s->ses_name, O_RDONLY, 0);
+    if (fd < 0)
+        fd = open(s->ses_tmp, O_RDONLY, 0);
+
+    /* the first pass replays the records up to the first damaged one, using the empty ring to check them */
+    while (fd >= 0 && read(fd, &rec, sizeof(rec)) == sizeof(rec))
+    {
+        body = (rec.type == SESSION_REC_STORED) ? 0 : rec.len;
+        if (rec.len > c->pub_ring_size || read(fd, c->pub_ring, body) != body)
+            break;
+        crc = mqtt_store_crc32(0, (unsigned char *)&rec, offsetof(struct MQTTSessionRecord, crc));
+        if (mqtt_store_crc32(crc, c->pub_ring, body) != rec.crc)
+            break;
+
+        for (i = 0; i < num; i++)
+        {
+            if (ent[i].id == rec.id)
+                break;
+        }
+
+        switch (rec.type)
+        {
+        case SESSION_REC_PUBLISH:
+        case SESSION_REC_STORED:
+            c->next_packetid = rec.id;
+            if (i == num && num == c->pub_slot_num)
+            {
+                LOG_E("session journal holds more publishes than the ring, id %d dropped.", rec.id);
+                break;
+            }
+            if (i == num)
+                num++;
+            ent[i].id = rec.id;
+            ent[i].qos = rec.qos;
+            ent[i].state = PUB_SLOT_INFLIGHT;
+            ent[i].stored = (rec.type == SESSION_REC_STORED);
+            ent[i].pos = pos + sizeof(rec);
+            ent[i].len = rec.len;
+            ent[i].store_seq = rec.store_seq;
+            ent[i].store_end = rec.store_end;
+            break;
+
+        case SESSION_REC_PUBREL:
+            if (i == num && num < c->pub_slot_num)
+            {
+                rt_memset(&ent[num++], 0x00, sizeof(struct MQTTSessionEntry));
+                ent[i].id = rec.id;
+                ent[i].qos = QOS2;
+            }
+            if (i < num)
+                ent[i].state = PUB_SLOT_RELEASING;
+            break;
+
+        case SESSION_REC_DONE:
+            if (i < num)
+            {
+                rt_memmove(&ent[i], &ent[i + 1], (num - i - 1) * sizeof(struct MQTTSessionEntry));
+                num--;
+            }
+            break;
+
+        case SESSION_REC_QOS2_IN:
+            if (qos2_in_receive(c, rec.id) < 0)
+            {
+                close(fd);
+                rt_free(ent);
+                return PAHO_FAILURE;
+            }
+            break;
+
+        case SESSION_REC_QOS2_REL:
+            qos2_in_release(c, rec.id);
+            break;
+
+        case SESSION_REC_QOS2_CLEAR:
+            if (c->qos2_in_map)
+                rt_memset(c->qos2_in_map, 0, (MAX_PACKET_ID + 1) / 8);
+            break;
+
+        case SESSION_REC_NEXT_ID:
+            c->next_packetid = rec.id;
+            break;
+        }
+        pos += sizeof(rec) + body;
+    }
+
+    /* the second pass puts the publishes back into the ring, in their order */
+    for (i = 0; i < num; i++)
+    {
+        rt_memset(&message, 0x00, sizeof(message));
+        slot = mqtt_pub_ring_reserve(c, ent[i].len, &message);
+        id_pos = 0;
+        if (slot && ent[i].stored)
+            id_pos = mqtt_store_load(c, ent[i].store_seq, ent[i].store_end, c->pub_ring + slot->offset, ent[i].len);
+        if (slot == RT_NULL || id_pos < 0 ||
+            (!ent[i].stored && (lseek(fd, ent[i].pos, SEEK_SET) != ent[i].pos ||
+                                read(fd, c->pub_ring + slot->offset, ent[i].len) != ent[i].len)))
+        {
+            LOG_E("session publish id %d restore failed.", ent[i].id);
+            if (slot)
+                slot->state = PUB_SLOT_DONE;
+            continue;
+        }
+
+        if (ent[i].stored)
+        {
+            c->pub_ring[slot->offset + id_pos] = (unsigned char)(ent[i].id >> 8);
+            c->pub_ring[slot->offset + id_pos + 1] = (unsigned char)(ent[i].id & 0xFF);
+        }
+        slot->qos = ent[i].qos;
+        slot->id = ent[i].id;
+        slot->store_seq = ent[i].store_seq;
+        slot->store_end = ent[i].store_end;
+        slot->state = ent[i].state;
+        packetid_take(c, slot->id);
+
+        if (slot->store_seq > seq || (slot->store_seq == seq && slot->store_end > end))
+        {
+            seq = slot->store_seq;
+            end = slot->store_end;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    rt_free(ent);
+
+    /* the stored records up to the last one restored were forwarded already */
+    if (seq > s->rd_seq || (seq == s->rd_seq && end > s->rd_off))
+    {
+        s->rd_seq = s->fwd_seq = seq;
+        s->rd_off = s->fwd_off = end;
+    }
+
+    if (num > 0)
+    {
+        LOG_I("session restored, %d publishes to resend.", num);
+    }
+
+    /* start over from a snapshot of what was restored */
+    mqtt_session_compact(c);
+
+    return PAHO_SUCCESS;
+}
+
+/* save the cursor and close the store, the records not completed are forwarded on the next start */
+void mqtt_store_close(MQTTClient *c)
+{
+    struct MQTTStore *s = c->store;
+
+    if (s == RT_NULL)
+        return;
+
+    mqtt_store_sync(c);
+    if (s->ses_fd >= 0)
+    {
+        mqtt_session_write(c, s->jbuf, s->jbuf_len);
+        fsync(s->ses_fd);
+        close(s->ses_fd);
+    }
+
+    rt_mutex_take(s->lock, RT_WAITING_FOREVER);
+    if (s->ack_bytes > 0)
+        mqtt_store_mark(c);
+    if (s->wr_fd >= 0)
+    {
+        fsync(s->wr_fd);
+        close(s->wr_fd);
+    }
+    if (s->rd_fd >= 0)
+        close(s->rd_fd);
+    c->store = RT_NULL;
+    rt_mutex_release(s->lock);
+
+    rt_mutex_delete(s->lock);
+    rt_free(s->name);
+    rt_free(s->rbuf);
+    rt_free(s->wbuf);
+    rt_free(s->ses_name);
+    rt_free(s->jbuf);
+    rt_free(s);
+}
+#endif /* MQTT_USING_STORE */
+
+/*
+ * Send what the publish ring holds, refilled from the store as long as the
+ * ring has room, worker thread only.
+ */
+static int mqtt_pub_ring_flush(MQTTClient *c)
+{
+#ifdef MQTT_USING_STORE
+    int moved;
+
+    if (c->store)
+    {
+        do
+        {
+            moved = mqtt_store_forward(c);
+            if (mqtt_pub_ring_send(c) != PAHO_SUCCESS)
+                return PAHO_FAILURE;
+        } while (moved > 0);
+
+        mqtt_store_sync(c);
+        return PAHO_SUCCESS;
+    }
+#endif
+
+    return mqtt_pub_ring_send(c);
+}
+
+/*
+ * Subscription table. Entries live in one array that doubles when full, freed
+ * entries are chained for reuse, so adding and removing a subscription does not
+ * scan the table. The filter strings are packed into arena blocks; a block is
+ * given back once none of its strings is used anymore.
+ */
+struct MQTTSubscription
+{
+    char *topicFilter;                /* in the arena, RT_NULL while the entry is free */
+    void (*callback)(MQTTClient *, MessageData *);
+    enum QoS qos;
+    struct MQTTSubArena *block;       /* arena block holding topicFilter */
+    int next_free;                    /* next free entry, -1 at the end */
+    rt_uint16_t suback_id;            /* SUBSCRIBE sent and not acknowledged yet, 0 if none */
+    rt_uint16_t unsub_id;             /* UNSUBSCRIBE sent and not acknowledged yet, 0 if none */
+    rt_uint8_t runtime;               /* added by paho_mqtt_subscribe, dropped if the broker refuses it */
+    rt_uint8_t unsub;                 /* paho_mqtt_unsubscribe asked for it, removed on its UNSUBACK */
+};
+
+/* a SUBSCRIBE or UNSUBSCRIBE waiting for its acknowledgement, an ack only visits its own filters */
+struct MQTTSubRequest
+{
+    struct MQTTSubRequest *next;
+    rt_uint16_t id;
+    rt_uint8_t unsub;
+    rt_uint8_t num;
+    int handlers[1];                  /* table entries of the filters, in packet order */
+};
+
+struct MQTTSubArena
+{
+    struct MQTTSubArena *prev, *next;
+    rt_uint32_t size, used, live;     /* bytes in data, bytes handed out, strings still in use */
+    char data[1];
+};
+
+#define MQTT_TOPIC_BUCKETS_MIN    16
+
+static rt_uint32_t topic_hash(struct MQTTTopicNode *parent, const char *level, int len)
+{
+    rt_uint32_t hash = 2166136261UL ^ (rt_uint32_t)(rt_ubase_t)parent;
+
+    while (len--)
+    {
+        hash = (hash ^ (unsigned char)*level++) * 16777619UL;
+    }
+
+    return hash;
+}
+
+static struct MQTTTopicNode *topic_node_find(struct MQTTTopicIndex *idx, struct MQTTTopicNode *parent,
+                                             const char *level, int len)
+{
+    struct MQTTTopicNode *node;
+    rt_uint32_t hash = topic_hash(parent, level, len);
+
+    for (node = idx->buckets[hash & (idx->bucket_num - 1)]; node; node = node->next)
+    {
+        if (node->hash == hash && node->parent == parent && node->len == len && rt_memcmp(node->level, level, len) == 0)
+            return node;
+    }
+
+    return RT_NULL;
+}
+
+static struct MQTTTopicNode *topic_node_new(struct MQTTTopicNode *parent, const char *level, int len)
+{
+    struct MQTTTopicNode *node;
+
+    node = rt_calloc(1, sizeof(struct MQTTTopicNode) + len);
+    if (node == RT_NULL)
+        return RT_NULL;
+
+    node->parent = parent;
+    node->len = len;
+    rt_memcpy(node->level, level, len);
+
+    return node;
+}
+
+/* double the buckets when there are more nodes than buckets */
+static void topic_index_grow(struct MQTTTopicIndex *idx)
+{
+    struct MQTTTopicNode **buckets, *node;
+    rt_uint32_t i, num = idx->bucket_num * 2;
+
+    buckets = rt_calloc(num, sizeof(struct MQTTTopicNode *));
+    if (buckets == RT_NULL)
+        return;
+
+    for (i = 0; i < idx->bucket_num; i++)
+    {
+        while ((node = idx->buckets[i]) != RT_NULL)
+        {
+            idx->buckets[i] = node->next;
+            node->next = buckets[node->hash & (num - 1)];
+            buckets[node->hash & (num - 1)] = node;
+        }
+    }
+
+    rt_free(idx->buckets);
+    idx->buckets = buckets;
+    idx->bucket_num = num;
+}
+
+/* the child of parent for one filter level, created when missing */
+static struct MQTTTopicNode *topic_node_get(struct MQTTTopicIndex *idx, struct MQTTTopicNode *parent,
+                                            const char *level, int len)
+{
+    struct MQTTTopicNode *node, **link = RT_NULL;
+
+    if (parent != &idx->exact && len == 1 && (level[0] == '+' || level[0] == '#'))
+        link = (level[0] == '+') ? &parent->plus : &parent->wild;
+
+    node = link ? *link : topic_node_find(idx, parent, level, len);
+    if (node)
+        return node;
+
+    node = topic_node_new(parent, level, len);
+    if (node == RT_NULL)
+        return RT_NULL;
+
+    if (link)
+    {
+        *link = node;
+        return node;
+    }
+
+    if (idx->node_num >= idx->bucket_num)
+        topic_index_grow(idx);
+
+    node->hash = topic_hash(parent, level, len);
+    node->next = idx->buckets[node->hash & (idx->bucket_num - 1)];
+    idx->buckets[node->hash & (idx->bucket_num - 1)] = node;
+    idx->node_num++;
+
+    return node;
+}
+
+/* drop one filter reference from node and its parents, freeing the unused nodes */
+static void topic_node_put(struct MQTTTopicIndex *idx, struct MQTTTopicNode *node)
+{
+    struct MQTTTopicNode *parent, **link;
+
+    for (; node != &idx->root && node != &idx->exact; node = parent)
+    {
+        parent = node->parent;
+        if (--node->refs > 0)
+            continue;
+
+        if (parent->plus == node)
+            parent->plus = RT_NULL;
+        else if (parent->wild == node)
+            parent->wild = RT_NULL;
+        else
+        {
+            for (link = &idx->buckets[node->hash & (idx->bucket_num - 1)]; *link != node; link = &(*link)->next);
+            *link = node->next;
+            idx->node_num--;
+        }
+
+        rt_free(node->handlers);
+        rt_free(node);
+    }
+}
+
+/* walk the levels of a filter, creating the missing nodes when create is set */
+static struct MQTTTopicNode *topic_node_walk(struct MQTTTopicIndex *idx, const char *filter, int create)
+{
+    struct MQTTTopicNode *node;
+    const char *level, *sep;
+    int len = rt_strlen(filter);
+
+    if (strpbrk(filter, "+#") == RT_NULL)
+        return create ? topic_node_get(idx, &idx->exact, filter, len) : topic_node_find(idx, &idx->exact, filter, len);
+
+    for (node = &idx->root, level = filter; node; level = sep + 1)
+    {
+        sep = strchr(level, '/');
+        len = sep ? sep - level : rt_strlen(level);
+
+        if (create)
+            node = topic_node_get(idx, node, level, len);
+        else if (len == 1 && (level[0] == '+' || level[0] == '#'))
+            node = (level[0] == '+') ? node->plus : node->wild;
+        else
+            node = topic_node_find(idx, node, level, len);
+
+        if (sep == RT_NULL)
+            break;
+    }
+
+    return node;
+}
+
+/* index the filter of subscription table entry handler */
+static int mqtt_topic_index_add(MQTTClient *c, int handler)
+{
+    struct MQTTTopicIndex *idx = c->topic_index;
+    struct MQTTTopicNode *node, *leaf;
+    int *handlers;
+
+    leaf = topic_node_walk(idx, c->subs[handler].topicFilter, 1);
+    if (leaf == RT_NULL)
+        goto _nomem;
+
+    handlers = rt_realloc(leaf->handlers, (leaf->handler_num + 1) * sizeof(int));
+    if (handlers == RT_NULL)
+        goto _nomem;
+
+    leaf->handlers = handlers;
+    leaf->handlers[leaf->handler_num++] = handler;
+    for (node = leaf; node != &idx->root && node != &idx->exact; node = node->parent)
+    {
+        node->refs++;
+    }
+
+    return PAHO_SUCCESS;
+
+_nomem:
+    /* nodes created on the way stay until the index is rebuilt */
+    LOG_E("no memory for topic index, %s", c->subs[handler].topicFilter);
+    return PAHO_FAILURE;
+}
+
+static void mqtt_topic_index_remove(MQTTClient *c, int handler)
+{
+    struct MQTTTopicIndex *idx = c->topic_index;
+    struct MQTTTopicNode *leaf;
+    int i;
+
+    leaf = topic_node_walk(idx, c->subs[handler].topicFilter, 0);
+    if (leaf == RT_NULL)
+        return;
+
+    for (i = 0; i < leaf->handler_num; i++)
+    {
+        if (leaf->handlers[i] != handler)
+            continue;
+
+        rt_memmove(&leaf->handlers[i], &leaf->handlers[i + 1], (leaf->handler_num - i - 1) * sizeof(int));
+        leaf->handler_num--;
+        topic_node_put(idx, leaf);
+        break;
+    }
+}
+
+static void mqtt_topic_index_free(MQTTClient *c)
+{
+    struct MQTTTopicIndex *idx = c->topic_index;
+    struct MQTTTopicNode *stack, *node;
+    rt_uint32_t i;
+
+    if (idx == RT_NULL)
+        return;
+
+    /* the hashed nodes are freed from the buckets, the '+' and '#' ones from their parent */
+    stack = RT_NULL;
+    for (i = 0; i < idx->bucket_num; i++)
+    {
+        while ((node = idx->buckets[i]) != RT_NULL)
+        {
+            idx->buckets[i] = node->next;
+            node->next = stack;
+            stack = node;
+        }
+    }
+    idx->root.next = stack;
+    stack = &idx->root;
+
+    while (stack)
+    {
+        node = stack;
+        stack = node->next;
+
+        if (node->plus)
+        {
+            node->plus->next = stack;
+            stack = node->plus;
+        }
+        if (node->wild)
+        {
+            node->wild->next = stack;
+            stack = node->wild;
+        }
+
+        if (node != &idx->root)
+        {
+            rt_free(node->handlers);
+            rt_free(node);
+        }
+    }
+
+    rt_free(idx->matches);
+    rt_free(idx->buckets);
+    rt_free(idx);
+    c->topic_index = RT_NULL;
+}
+
+int mqtt_topic_index_init(MQTTClient *c)
+{
+    struct MQTTTopicIndex *idx;
+
+    idx = rt_calloc(1, sizeof(struct MQTTTopicIndex));
+    if (idx == RT_NULL)
+        return PAHO_FAILURE;
+
+    idx->bucket_num = MQTT_TOPIC_BUCKETS_MIN;
+    idx->buckets = rt_calloc(idx->bucket_num, sizeof(struct MQTTTopicNode *));
+    if (idx->buckets == RT_NULL)
+    {
+        rt_free(idx);
+        return PAHO_FAILURE;
+    }
+    c->topic_index = idx;
+
+    return PAHO_SUCCESS;
+}
+
+#define MQTT_SUB_TABLE_MIN    4
+
+static char *sub_arena_strdup(MQTTClient *c, const char *str, struct MQTTSubArena **block)
+{
+    struct MQTTSubArena *b = c->sub_arena;
+    rt_uint32_t len = rt_strlen(str) + 1;
+    char *p;
+
+    if (b == RT_NULL || b->size - b->used < len)
+    {
+        rt_uint32_t size = (len > MQTT_SUB_ARENA_SIZE) ? len : MQTT_SUB_ARENA_SIZE;
+
+        b = rt_malloc(sizeof(struct MQTTSubArena) + size);
+        if (b == RT_NULL)
+            return RT_NULL;
+
+        b->size = size;
+        b->used = b->live = 0;
+        b->prev = RT_NULL;
+        b->next = c->sub_arena;
+        if (c->sub_arena)
+            c->sub_arena->prev = b;
+        c->sub_arena = b;
+    }
+
+    p = b->data + b->used;
+    rt_memcpy(p, str, len);
+    b->used += len;
+    b->live++;
+    *block = b;
+
+    return p;
+}
+
+static void sub_arena_release(MQTTClient *c, struct MQTTSubArena *b)
+{
+    if (--b->live > 0)
+        return;
+
+    /* the block still being filled is reused, the older ones are freed */
+    if (b == c->sub_arena)
+    {
+        b->used = 0;
+        return;
+    }
+
+    b->prev->next = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    rt_free(b);
+}
+
+/* the table entry subscribed to this filter, -1 if there is none */
+int mqtt_sub_find(MQTTClient *c, const char *topic)
+{
+    struct MQTTTopicNode *leaf;
+
+    if (c->topic_index == RT_NULL)
+        return -1;
+
+    /* every entry indexed on a leaf has the same filter */
+    leaf = topic_node_walk(c->topic_index, topic, 0);
+    if (leaf == RT_NULL || leaf->handler_num == 0)
+        return -1;
+
+    return leaf->handlers[0];
+}
+
+/*
+ * Digest of one subscription. The table digest is the sum over its entries, so
+ * it does not depend on their order and is updated on every add and remove.
+ */
+static rt_uint32_t sub_digest_hash(const char *topic, enum QoS qos)
+{
+    return (topic_hash(RT_NULL, topic, strlen(topic)) ^ (rt_uint32_t)qos) * 16777619UL;
+}
+
+/* add a subscription to the table and the index, return its entry or -1 */
+int mqtt_sub_add(MQTTClient *c, const char *topic, enum QoS qos, subscribe_cb callback)
+{
+    struct MQTTSubscription *sub;
+    int i;
+
+    /* a filter whose SUBSCRIBE does not fit the send buffer would fail every connect */
+    if (MQTTPacket_len(2 + 2 + strlen(topic) + 1) > (int)c->buf_size)
+    {
+        LOG_E("subscription %s too long for the send buffer.", topic);
+        return -1;
+    }
+
+    if (c->sub_free < 0)
+    {
+        int size = c->sub_size ? c->sub_size * 2 : MQTT_SUB_TABLE_MIN;
+
+        sub = rt_realloc(c->subs, size * sizeof(struct MQTTSubscription));
+        if (sub == RT_NULL)
+            goto _nomem;
+
+        c->subs = sub;
+        for (i = size - 1; i >= c->sub_size; i--)
+        {
+            c->subs[i].topicFilter = RT_NULL;
+            c->subs[i].next_free = c->sub_free;
+            c->sub_free = i;
+        }
+        c->sub_size = size;
+    }
+
+    i = c->sub_free;
+    sub = &c->subs[i];
+    sub->topicFilter = sub_arena_strdup(c, topic, &sub->block);
+    if (sub->topicFilter == RT_NULL)
+        goto _nomem;
+
+    c->sub_free = sub->next_free;
+    sub->callback = callback;
+    sub->qos = qos;
+    sub->suback_id = 0;
+    sub->unsub_id = 0;
+    sub->runtime = 0;
+    sub->unsub = 0;
+    c->sub_num++;
+    c->sub_digest += sub_digest_hash(sub->topicFilter, qos);
+
+    if (mqtt_topic_index_add(c, i) != PAHO_SUCCESS)
+    {
+        mqtt_sub_remove(c, i);
+        return -1;
+    }
+
+    return i;
+
+_nomem:
+    LOG_E("no memory for subscription %s", topic);
+    return -1;
+}
+
+void mqtt_sub_remove(MQTTClient *c, int i)
+{
+    struct MQTTSubscription *sub = &c->subs[i];
+
+    c->sub_digest -= sub_digest_hash(sub->topicFilter, sub->qos);
+    mqtt_topic_index_remove(c, i);
+    sub_arena_release(c, sub->block);
+
+    sub->topicFilter = RT_NULL;
+    sub->callback = RT_NULL;
+    sub->next_free = c->sub_free;
+    c->sub_free = i;
+    c->sub_num--;
+}
+
+void mqtt_sub_free_all(MQTTClient *c)
+{
+    struct MQTTSubRequest *req;
+    struct MQTTSubArena *b;
+
+    /* their packet ids go with the packet id map */
+    while ((req = c->sub_requests) != RT_NULL)
+    {
+        c->sub_requests = req->next;
+        rt_free(req);
+    }
+    c->suback_pending = 0;
+
+    mqtt_topic_index_free(c);
+
+    while ((b = c->sub_arena) != RT_NULL)
+    {
+        c->sub_arena = b->next;
+        rt_free(b);
+    }
+
+    rt_free(c->subs);
+    c->subs = RT_NULL;
+    c->sub_num = c->sub_size = 0;
+    c->sub_free = -1;
+    c->sub_digest = 0;
+}
+
+#define MQTT_SUB_SEND_ALL       0 /* every filter, at connect */
+#define MQTT_SUB_SEND_NEW       1 /* the filters paho_mqtt_subscribe added meanwhile */
+#define MQTT_SUB_SEND_UNSUB     2 /* the filters paho_mqtt_unsubscribe asked to remove */
+
+static int mqtt_sub_wanted(struct MQTTSubscription *sub, int mode)
+{
+    if (sub->topicFilter == RT_NULL)
+        return 0;
+    if (mode == MQTT_SUB_SEND_ALL)
+        return !sub->unsub;
+    if (mode == MQTT_SUB_SEND_NEW)
+        return sub->runtime && !sub->unsub && sub->suback_id == 0;
+    return sub->unsub && sub->unsub_id == 0;
+}
+
+/*
+ * Send the filters of the table selected by mode, packing as many filters into
+ * each SUBSCRIBE or UNSUBSCRIBE as fit the send buffer. Nothing is waited for,
+ * the filters remember their packet until its acknowledgement arrives.
+ * Called by the worker only, the packets are built in the send buffer. The
+ * table is locked while a packet is built, not while it is sent: its filters
+ * are marked in flight by then, paho_mqtt_unsubscribe leaves those in the table.
+ */
+static int mqtt_sub_send(MQTTClient *c, int mode)
+{
+    MQTTString topics[MQTT_SUB_BATCH_MAX];
+    int qoss[MQTT_SUB_BATCH_MAX], handlers[MQTT_SUB_BATCH_MAX];
+    int i = 0, k, num, rem, len, flen;
+    int qos_len = (mode == MQTT_SUB_SEND_UNSUB) ? 0 : 1;
+    struct MQTTSubRequest *req;
+    unsigned short id;
+
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    if (mode == MQTT_SUB_SEND_ALL)
+    {
+        /* the broker session holds this table once every SUBACK is in */
+        c->session_subscribed = 0;
+        c->session_digest = c->sub_digest;
+    }
+    while (1)
+    {
+        /* the next filters, as many as fit one packet */
+        for (num = 0, rem = 2; i < c->sub_size && num < MQTT_SUB_BATCH_MAX; i++)
+        {
+            if (!mqtt_sub_wanted(&c->subs[i], mode))
+                continue;
+
+            flen = strlen(c->subs[i].topicFilter);
+            if (num > 0 && MQTTPacket_len(rem + 2 + flen + qos_len) > (int)c->buf_size)
+                break;
+
+            topics[num].cstring = c->subs[i].topicFilter;
+            topics[num].lenstring.len = 0;
+            topics[num].lenstring.data = RT_NULL;
+            qoss[num] = c->subs[i].qos;
+            handlers[num++] = i;
+            rem += 2 + flen + qos_len;
+        }
+        if (num == 0)
+            break;
+
+        req = rt_malloc(sizeof(struct MQTTSubRequest) + (num - 1) * sizeof(int));
+        if (req == RT_NULL)
+        {
+            LOG_E("no memory for subscribe request.");
+            goto _fail;
+        }
+
+        id = getNextPacketId(c);
+        packetid_take(c, id);
+        if (mode == MQTT_SUB_SEND_UNSUB)
+            len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, id, num, topics);
+        else
+            len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, id, num, topics, qoss);
+        if (len <= 0)
+        {
+            packetid_release(c, id);
+            rt_free(req);
+            goto _fail;
+        }
+
+        req->id = id;
+        req->unsub = (mode == MQTT_SUB_SEND_UNSUB);
+        req->num = num;
+        for (k = 0; k < num; k++)
+        {
+            req->handlers[k] = handlers[k];
+            if (req->unsub)
+                c->subs[handlers[k]].unsub_id = id;
+            else
+                c->subs[handlers[k]].suback_id = id;
+        }
+        req->next = c->sub_requests;
+        c->sub_requests = req;
+        if (!req->unsub)
+            c->suback_pending += num;
+        rt_mutex_release(c->sub_mutex);
+
+        /* a failed send restarts the connection, mqtt_suback_reset forgets the request */
+        if (sendPacket(c, len) != PAHO_SUCCESS)
+            return PAHO_FAILURE;
+
+        rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    }
+    rt_mutex_release(c->sub_mutex);
+
+    return PAHO_SUCCESS;
+
+_fail:
+    rt_mutex_release(c->sub_mutex);
+    return PAHO_FAILURE;
+}
+
+static int mqtt_subscribe_all(MQTTClient *c)
+{
+    return mqtt_sub_send(c, MQTT_SUB_SEND_ALL);
+}
+
+/* send what paho_mqtt_subscribe and paho_mqtt_unsubscribe left in the table */
+static int mqtt_sub_flush(MQTTClient *c)
+{
+    int changed;
+
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    changed = c->sub_changed;
+    c->sub_changed = 0;
+    rt_mutex_release(c->sub_mutex);
+
+    if (!changed)
+        return PAHO_SUCCESS;
+
+    if (mqtt_sub_send(c, MQTT_SUB_SEND_NEW) != PAHO_SUCCESS)
+        return PAHO_FAILURE;
+
+    return mqtt_sub_send(c, MQTT_SUB_SEND_UNSUB);
+}
+
+/* forget the SUBSCRIBEs and UNSUBSCRIBEs of a lost connection, they are sent again on reconnect */
+static void mqtt_suback_reset(MQTTClient *c)
+{
+    struct MQTTSubscription *sub;
+    struct MQTTSubRequest *req;
+    int k;
+
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    while ((req = c->sub_requests) != RT_NULL)
+    {
+        c->sub_requests = req->next;
+        for (k = 0; k < req->num; k++)
+        {
+            sub = &c->subs[req->handlers[k]];
+            if (sub->topicFilter == RT_NULL)
+                continue;
+
+            if (req->unsub && sub->unsub_id == req->id)
+                sub->unsub_id = 0;
+            else if (!req->unsub && sub->suback_id == req->id)
+                sub->suback_id = 0;
+        }
+        packetid_release(c, req->id);
+        rt_free(req);
+    }
+    c->suback_pending = 0;
+    c->sub_changed = 1;
+    rt_mutex_release(c->sub_mutex);
+}
 
-#ifdef MQTT_USING_TLS
-_continue:
-#endif
-        if (bytes >= len)
+/* take the request of an acknowledgement off the pending list, RT_NULL if it is unknown */
+static struct MQTTSubRequest *mqtt_sub_request_take(MQTTClient *c, unsigned short id, int unsub)
+{
+    struct MQTTSubRequest *req, **link;
+
+    for (link = &c->sub_requests; (req = *link) != RT_NULL; link = &req->next)
+    {
+        if (req->id == id && req->unsub == unsub)
         {
-            break;
+            *link = req->next;
+            if (!unsub)
+                c->suback_pending -= req->num;
+            return req;
         }
+    }
 
-        if (timeout > 0)
-        {
-            fd_set readset;
-            struct timeval interval;
+    return RT_NULL;
+}
 
-            LOG_D("net_read %d:%d, timeout:%d", bytes, len, timeout);
-            timeout  = 0;
+/*
+ * Match a SUBACK against the filters of its SUBSCRIBE. A filter added by
+ * paho_mqtt_subscribe is kept once granted and removed from the table if refused.
+ *
+ * @return the number of filters still waiting for their SUBACK, -1 if one subscribed at connect was refused.
+ */
+static int mqtt_suback(MQTTClient *c, unsigned short id, int count, int *granted)
+{
+    struct MQTTSubscription *sub;
+    struct MQTTSubRequest *req;
+    int i, k, pending, refused = 0;
 
-            interval.tv_sec = 1;
-            interval.tv_usec = 0;
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    req = mqtt_sub_request_take(c, id, 0);
+    for (k = 0; req && k < req->num; k++)
+    {
+        i = req->handlers[k];
+        sub = &c->subs[i];
 
-            FD_ZERO(&readset);
-            FD_SET(c->sock, &readset);
+        /* removed by an UNSUBACK meanwhile */
+        if (sub->topicFilter == RT_NULL || sub->suback_id != id)
+            continue;
 
-            select(c->sock + 1, &readset, RT_NULL, RT_NULL, &interval);
+        sub->suback_id = 0;
+        if (k >= count || (unsigned char)granted[k] == 0x80)
+        {
+            LOG_E("Subscribe #%d %s fail!", i, sub->topicFilter);
+            LOG_E("QoS(%d) config err!", sub->qos);
+            if (sub->runtime)
+                mqtt_sub_remove(c, i);
+            else
+                refused = 1;
         }
         else
         {
-            LOG_D("net_read %d:%d, break!", bytes, len);
-            break;
+            LOG_I("Subscribe #%d %s OK!", i, sub->topicFilter);
+            if (sub->unsub_id && !sub->unsub)
+            {
+                /* subscribed again after an UNSUBSCRIBE that followed this SUBSCRIBE */
+                c->sub_changed = 1;
+            }
+            else
+            {
+                sub->runtime = 0;
+            }
         }
     }
+    pending = c->suback_pending;
+    rt_mutex_release(c->sub_mutex);
+
+    if (req)
+    {
+        packetid_release(c, id);
+        rt_free(req);
+    }
 
-    return bytes;
+    return refused ? -1 : pending;
 }
 
-static int decodePacket(MQTTClient *c, int *value, int timeout)
+/* remove the filters of an UNSUBSCRIBE, unless they were subscribed again meanwhile */
+static void mqtt_unsuback(MQTTClient *c, unsigned short id)
 {
-    unsigned char i;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    struct MQTTSubscription *sub;
+    struct MQTTSubRequest *req;
+    int i, k;
 
-    *value = 0;
-    do
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    req = mqtt_sub_request_take(c, id, 1);
+    for (k = 0; req && k < req->num; k++)
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        i = req->handlers[k];
+        sub = &c->subs[i];
+        if (sub->topicFilter == RT_NULL || sub->unsub_id != id)
+            continue;
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        sub->unsub_id = 0;
+        if (sub->unsub)
         {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
+            LOG_I("Unsubscribe #%d %s OK!", i, sub->topicFilter);
+            mqtt_sub_remove(c, i);
         }
-        rc = net_read(c, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
     }
-    while ((i & 128) != 0);
-exit:
-    return len;
+    rt_mutex_release(c->sub_mutex);
+
+    if (req)
+    {
+        packetid_release(c, id);
+        rt_free(req);
+    }
 }
 
-static int MQTTPacket_readPacket(MQTTClient *c)
+/* every subscription of the connect is in place, the client is online */
+static int mqtt_session_online(MQTTClient *c)
 {
-    int rc = PAHO_FAILURE;
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
+    mqtt_timer_stop(c, &c->timers->suback);
+    c->timers->suback_wait = 0;
+    c->session_subscribed = 1;
+    c->reconnect_delay = 0;
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if (net_read(c, c->readbuf, 1, 0) != 1)
-        goto exit;
-
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, 50);
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
-
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (net_read(c, c->readbuf + len, rem_len, 300) != rem_len))
-        goto exit;
-
-    header.byte = c->readbuf[0];
-    rc = header.bits.type;
+    if (c->online_callback)
+    {
+        c->online_callback(c);
+    }
 
-exit:
-    return rc;
+    return PAHO_SUCCESS;
 }
 
-static int getNextPacketId(MQTTClient *c)
+static int mqtt_suback_timeout(MQTTClient *c, struct MQTTTimer *timer)
 {
-    return c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    /* the filters still waiting may have been unsubscribed meanwhile */
+    if (mqtt_suback(c, 0, 0, RT_NULL) == 0)
+        return mqtt_session_online(c);
+
+    LOG_E("[%d] wait SUBACK timeout", rt_tick_get());
+    return PAHO_FAILURE;
 }
 
-static int MQTTConnect(MQTTClient *c)
+static void mqtt_dispatch_stop(MQTTClient *c);
+
+static int net_disconnect_exit(MQTTClient *c)
 {
-    int rc = -1, len;
-    MQTTPacket_connectData *options = &c->condata;
+    int i;
 
-    if (c->isconnected) /* don't send connect packet again if we are already connected */
-        goto _exit;
+    net_disconnect(c);
 
-    c->keepAliveInterval = options->keepAliveInterval;
+    /* the wheel goes on serving the other clients of the reactor */
+    if (c->timers)
+    {
+        mqtt_timer_stop_session(c);
+        mqtt_timer_stop(c, &c->timers->reconnect);
+        mqtt_timer_stop(c, &c->timers->request);
+    }
 
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
-        goto _exit;
+    /* the callbacks still queued run first, they may publish */
+    mqtt_dispatch_stop(c);
 
-    if ((rc = sendPacket(c, len)) != 0)  // send the connect packet
-        goto _exit; // there was a problem
+    if (c->buf && c->readbuf)
+    {
+        rt_free(c->buf);
+        rt_free(c->readbuf);
+    }
 
+    if (c->recv_ring)
     {
-        int res;
-        fd_set readset;
-        struct timeval timeout;
+        rt_free(c->recv_ring);
+        c->recv_ring = RT_NULL;
+    }
 
-        timeout.tv_sec = c->connect_timeout ? c->connect_timeout / RT_TICK_PER_SECOND : 5;
-        timeout.tv_usec = c->connect_timeout ? (c->connect_timeout % RT_TICK_PER_SECOND) * 1000 : 0;
+    if (c->pub_mutex)
+    {
+        rt_mutex_delete(c->pub_mutex);
+    }
 
-        FD_ZERO(&readset);
-        FD_SET(c->sock, &readset);
+#ifdef MQTT_USING_STORE
+    /* before the ring, the stored publishes left unacknowledged are kept for the next start */
+    mqtt_store_close(c);
+#endif
 
-        res = select(c->sock + 1, &readset, RT_NULL, RT_NULL, &timeout);
+    if (c->pub_ring)
+    {
+        rt_uint32_t i, num, idx;
 
-        if (res <= 0)
+        /* report the publishes that will never be acknowledged now */
+        num = c->pub_slot_count;
+        for (i = 0, idx = c->pub_slot_tail; i < num; i++, idx = (idx + 1) % c->pub_slot_num)
         {
-            LOG_E("%s wait resp fail, res:%d errno:%d", __FUNCTION__, res, errno);
-            rc = -1;
-            goto _exit;
+            if (c->pub_slots[idx].state == PUB_SLOT_INFLIGHT || c->pub_slots[idx].state == PUB_SLOT_RELEASING)
+                mqtt_pub_ring_complete(c, &c->pub_slots[idx], PAHO_FAILURE);
+        }
+        /* streams not sent yet have their publishing threads waiting too */
+        for (i = 0; i < c->pub_slot_num; i++)
+        {
+            mqtt_pub_stream_done(&c->pub_slots[i], PAHO_FAILURE);
         }
+
+        rt_free(c->pub_ring);
+        rt_free(c->pub_slots);
+        rt_free(c->packetid_map);
+        c->pub_ring = RT_NULL;
+        c->pub_slots = RT_NULL;
+        c->packetid_map = RT_NULL;
     }
 
-    rc = MQTTPacket_readPacket(c);
-    if (rc < 0)
+    if (c->timers)
     {
-        LOG_E("%s MQTTPacket_readPacket fail", __FUNCTION__);
-        goto _exit;
+        rt_free(c->timers);
+        c->timers = RT_NULL;
     }
 
-    if (rc == CONNACK)
+    if (c->addr_cache)
     {
-        unsigned char sessionPresent, connack_rc;
+        rt_free(c->addr_cache);
+        c->addr_cache = RT_NULL;
+    }
 
-        if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+#ifdef MQTT_USING_TLS
+    mqtt_close_tls(c);
+#endif
+
+    if (c->connect_pkt)
+    {
+        rt_free(c->connect_pkt);
+        c->connect_pkt = RT_NULL;
+    }
+
+    if (c->qos2_in_map)
+    {
+        rt_free(c->qos2_in_map);
+        c->qos2_in_map = RT_NULL;
+    }
+
+    if (c->sub_mutex)
+    {
+        rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    }
+
+    mqtt_sub_free_all(c);
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (c->messageHandlers[i].topicFilter)
         {
-            rc = connack_rc;
+            rt_free(c->messageHandlers[i].topicFilter);
+            c->messageHandlers[i].topicFilter = RT_NULL;
+            c->messageHandlers[i].callback = RT_NULL;
         }
-        else
+    }
+
+    if (c->sub_mutex)
+    {
+        rt_mutex_release(c->sub_mutex);
+        rt_mutex_delete(c->sub_mutex);
+        c->sub_mutex = RT_NULL;
+    }
+    
+    c->isconnected = 0;
+
+    return 0;
+}
+
+static void NewMessageData(MessageData *md, MQTTString *aTopicName, MQTTMessage *aMessage)
+{
+    md->topicName = aTopicName;
+    md->message = aMessage;
+}
+
+/* add the callbacks of the filters ending at node to the match list */
+static void topic_node_collect(MQTTClient *c, struct MQTTTopicNode *node)
+{
+    struct MQTTTopicIndex *idx = c->topic_index;
+    int i;
+
+    for (i = 0; i < node->handler_num; i++)
+    {
+        subscribe_cb callback = c->subs[node->handlers[i]].callback;
+
+        if (callback == RT_NULL)
+            continue;
+
+        if (idx->match_num == idx->match_size)
         {
-            rc = -1;
+            int size = idx->match_size ? idx->match_size * 2 : 4;
+            subscribe_cb *matches = rt_realloc(idx->matches, size * sizeof(subscribe_cb));
+
+            if (matches == RT_NULL)
+            {
+                LOG_E("no memory for matched subscriptions, %d delivered", idx->match_num);
+                return;
+            }
+            idx->matches = matches;
+            idx->match_size = size;
         }
+        idx->matches[idx->match_num++] = callback;
     }
-    else
-        rc = -1;
+}
 
-_exit:
-    if (rc == 0)
-        c->isconnected = 1;
+/*
+ * Collect the filters matching the topic levels from level to end,
+ * level is RT_NULL once every level has been matched.
+ */
+static void topic_node_match(MQTTClient *c, struct MQTTTopicNode *node, const char *level, const char *end)
+{
+    struct MQTTTopicNode *child;
+    const char *sep;
 
-    return rc;
+    /* '#' also matches the parent level */
+    if (node->wild)
+        topic_node_collect(c, node->wild);
+
+    if (level == RT_NULL)
+    {
+        topic_node_collect(c, node);
+        return;
+    }
+
+    sep = memchr(level, '/', end - level);
+    if (sep == RT_NULL)
+        sep = end;
+
+    child = topic_node_find(c->topic_index, node, level, sep - level);
+    if (child)
+        topic_node_match(c, child, (sep == end) ? RT_NULL : sep + 1, end);
+    if (node->plus)
+        topic_node_match(c, node->plus, (sep == end) ? RT_NULL : sep + 1, end);
 }
 
-static int MQTTDisconnect(MQTTClient *c)
+/*
+ * The callbacks subscribed to a topic, MQTT thread only. They are collected with
+ * sub_mutex held and called after it is released, so a callback may change the
+ * subscriptions.
+ *
+ * @return the number of callbacks in c->topic_index->matches.
+ */
+int mqtt_topic_match(MQTTClient *c, const char *topic, int len)
 {
-    int rc = PAHO_FAILURE;
-    int len = 0;
+    struct MQTTTopicIndex *idx = c->topic_index;
+    struct MQTTTopicNode *node;
 
-    len = MQTTSerialize_disconnect(c->buf, c->buf_size);
-    if (len > 0)
-        rc = sendPacket(c, len);            // send the disconnect packet
+    if (idx == RT_NULL || len <= 0)
+        return 0;
 
-    c->isconnected = 0;
+    rt_mutex_take(c->sub_mutex, RT_WAITING_FOREVER);
+    idx->match_num = 0;
+    node = topic_node_find(idx, &idx->exact, topic, len);
+    if (node)
+        topic_node_collect(c, node);
+    topic_node_match(c, &idx->root, topic, topic + len);
+    rt_mutex_release(c->sub_mutex);
 
-    return rc;
+    return idx->match_num;
 }
 
-/**
- * This function subscribe specified mqtt topic.
- *
- * @param c the pointer of MQTT context structure
- * @param topicFilter topic filter name
- * @param qos requested QoS
- *
- * @return the error code, 0 on subscribe successfully.
+/*
+ * Callback threads. A message is copied together with its matched callbacks and
+ * queued to the thread selected by the topic hash, so the messages of one topic
+ * keep their order while different topics run in parallel, and the MQTT thread
+ * never waits for application code.
  */
-static int MQTTSubscribe(MQTTClient *c, const char *topicFilter, enum QoS qos)
+struct MQTTDispatchMsg
 {
-    int rc = PAHO_FAILURE;
-    int len = 0;
-    int qos_sub = qos;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
+    MQTTString topicName;
+    MQTTMessage message;
+    int cb_num;
+    subscribe_cb cbs[1];              /* cb_num callbacks, followed by the topic and the payload */
+};
 
-    if (!c->isconnected)
-        goto _exit;
+struct MQTTDispatchWorker
+{
+    struct MQTTDispatchPool *pool;
+    rt_mailbox_t mb;
+    rt_thread_t tid;
+};
 
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, &qos_sub);
-    if (len <= 0)
-        goto _exit;
-    if ((rc = sendPacket(c, len)) != PAHO_SUCCESS) // send the subscribe packet
-        goto _exit;             // there was a problem
+struct MQTTDispatchPool
+{
+    MQTTClient *client;
+    rt_sem_t exit_sem;                /* released by every callback thread when it stops */
+    int num;
+    int live;                         /* callback threads running, changed with interrupts disabled */
+    int detached;                     /* the stop gave up waiting, the last thread frees the pool */
+    struct MQTTDispatchWorker workers[1];
+};
+
+static void mqtt_dispatch_free(struct MQTTDispatchPool *pool)
+{
+    int i;
 
+    for (i = 0; i < pool->num; i++)
     {
-        int res;
-        fd_set readset;
-        struct timeval timeout;
+        if (pool->workers[i].mb)
+            rt_mb_delete(pool->workers[i].mb);
+    }
+    if (pool->exit_sem)
+        rt_sem_delete(pool->exit_sem);
 
-        timeout.tv_sec = 5;
-        timeout.tv_usec = 0;
+    rt_free(pool);
+}
 
-        FD_ZERO(&readset);
-        FD_SET(c->sock, &readset);
+static void mqtt_dispatch_thread(void *param)
+{
+    struct MQTTDispatchWorker *worker = (struct MQTTDispatchWorker *)param;
+    struct MQTTDispatchPool *pool = worker->pool;
+    MQTTClient *c = pool->client;
+    struct MQTTDispatchMsg *msg;
+    rt_ubase_t value;
+    rt_base_t level;
+    MessageData md;
+    int i, last;
+
+    /* an empty message stops the thread, after the ones queued before it */
+    while (rt_mb_recv(worker->mb, &value, RT_WAITING_FOREVER) == RT_EOK && value != 0)
+    {
+        msg = (struct MQTTDispatchMsg *)value;
+        if (pool->detached)
+        {
+            /* the client is closed already, no more callbacks */
+            rt_free(msg);
+            continue;
+        }
+        NewMessageData(&md, &msg->topicName, &msg->message);
+
+        if (msg->cb_num == 0)
+            c->defaultMessageHandler(c, &md);
+        for (i = 0; i < msg->cb_num; i++)
+            msg->cbs[i](c, &md);
+
+        rt_free(msg);
+    }
+
+    level = rt_hw_interrupt_disable();
+    last = (--pool->live == 0 && pool->detached);
+    rt_hw_interrupt_enable(level);
+
+    if (last)
+        mqtt_dispatch_free(pool);
+    else
+        rt_sem_release(pool->exit_sem);
+}
+
+/*
+ * Stop the callback threads once they are through their queues, called on the
+ * MQTT thread. A callback may be blocked in a publish waiting for this very
+ * thread, so the wait is bounded by MQTT_DISPATCH_TIMEOUT: a full queue is then
+ * dropped to make room for the stop, and threads still busy are left behind to
+ * skip what remains queued and free the pool when the last one ends.
+ */
+static void mqtt_dispatch_stop(MQTTClient *c)
+{
+    struct MQTTDispatchPool *pool = c->dispatch_pool;
+    struct MQTTDispatchWorker *worker;
+    rt_tick_t deadline;
+    rt_int32_t left;
+    rt_ubase_t value;
+    rt_base_t level;
+    int i;
 
-        res = select(c->sock + 1, &readset, RT_NULL, RT_NULL, &timeout);
+    if (pool == RT_NULL)
+        return;
+    c->dispatch_pool = RT_NULL;
+
+    deadline = rt_tick_get() + rt_tick_from_millisecond(MQTT_DISPATCH_TIMEOUT);
+    for (i = 0; i < pool->num; i++)
+    {
+        worker = &pool->workers[i];
+        if (worker->tid == RT_NULL)
+            continue;
 
-        if (res <= 0)
+        left = (rt_int32_t)(deadline - rt_tick_get());
+        if (rt_mb_send_wait(worker->mb, 0, left > 0 ? left : 0) != RT_EOK)
         {
-            LOG_E("%s wait resp fail, res:%d errno:%d", __FUNCTION__, res, errno);
-            rc = -1;
-            goto _exit;
+            while (rt_mb_recv(worker->mb, &value, 0) == RT_EOK)
+            {
+                rt_free((void *)value);
+                c->dispatch_stat.dropped++;
+            }
+            LOG_W("callback thread %d is stuck, its queue is dropped.", i);
+            rt_mb_send(worker->mb, 0);
         }
     }
 
-    rc = MQTTPacket_readPacket(c);
-    if (rc < 0)
+    while (pool->live > 0)
     {
-        LOG_E("MQTTSubscribe MQTTPacket_readPacket MQTTConnect fail");
-        goto _exit;
+        left = (rt_int32_t)(deadline - rt_tick_get());
+        if (left <= 0 || rt_sem_take(pool->exit_sem, left) != RT_EOK)
+            break;
     }
 
-    if (rc == SUBACK)      // wait for suback
+    level = rt_hw_interrupt_disable();
+    pool->detached = (pool->live > 0);
+    rt_hw_interrupt_enable(level);
+
+    if (pool->detached)
     {
-        int count = 0, grantedQoS = -1;
-        unsigned short mypacketid;
+        LOG_W("callback threads still busy, they end on their own.");
+        return;
+    }
 
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
-            rc = grantedQoS; // 0, 1, 2 or 0x80
+    mqtt_dispatch_free(pool);
+}
 
-        if (rc != 0x80)
-        {
-            rc = 0;
-        }
+static int mqtt_dispatch_start(MQTTClient *c, int num)
+{
+    struct MQTTDispatchPool *pool;
+    char name[RT_NAME_MAX];
+    int i;
+
+    pool = rt_calloc(1, sizeof(struct MQTTDispatchPool) + (num - 1) * sizeof(struct MQTTDispatchWorker));
+    if (pool == RT_NULL)
+        return PAHO_FAILURE;
+
+    pool->client = c;
+    pool->num = num;
+    c->dispatch_pool = pool;
+
+    pool->exit_sem = rt_sem_create("mqdexit", 0, RT_IPC_FLAG_FIFO);
+    if (pool->exit_sem == RT_NULL)
+        goto _exit;
+
+    for (i = 0; i < num; i++)
+    {
+        struct MQTTDispatchWorker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+
+        rt_snprintf(name, RT_NAME_MAX, "mqd%d", i);
+        worker->mb = rt_mb_create(name, MQTT_DISPATCH_QUEUE_SIZE, RT_IPC_FLAG_FIFO);
+        if (worker->mb == RT_NULL)
+            goto _exit;
+
+        worker->tid = rt_thread_create(name, mqtt_dispatch_thread, worker,
+                                       RT_PKG_MQTT_THREAD_STACK_SIZE, RT_THREAD_PRIORITY_MAX / 3 + 1, 2);
+        if (worker->tid == RT_NULL)
+            goto _exit;
+        pool->live++;
+        rt_thread_startup(worker->tid);
     }
-    else
-        rc = PAHO_FAILURE;
+
+    return PAHO_SUCCESS;
 
 _exit:
-    return rc;
+    mqtt_dispatch_stop(c);
+    return PAHO_FAILURE;
 }
 
-static void NewMessageData(MessageData *md, MQTTString *aTopicName, MQTTMessage *aMessage)
+static int mqtt_dispatch_post(MQTTClient *c, MQTTString *topicName, MQTTMessage *message,
+                              subscribe_cb *cbs, int cb_num)
 {
-    md->topicName = aTopicName;
-    md->message = aMessage;
-}
+    struct MQTTDispatchPool *pool = c->dispatch_pool;
+    struct MQTTDispatchWorker *worker;
+    struct MQTTDispatchMsg *msg;
+    int len = topicName->lenstring.len;
+    char *data;
+
+    msg = rt_malloc(sizeof(struct MQTTDispatchMsg) + cb_num * sizeof(subscribe_cb) + len + message->payloadlen);
+    if (msg == RT_NULL)
+    {
+        LOG_E("no memory to dispatch message on %.*s, dropped.", len, topicName->lenstring.data);
+        c->dispatch_stat.dropped++;
+        return PAHO_FAILURE;
+    }
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-static char isTopicMatched(char *topicFilter, MQTTString *topicName)
-{
-    char *curf = topicFilter;
-    char *curn = topicName->lenstring.data;
-    char *curn_end = curn + topicName->lenstring.len;
+    msg->cb_num = cb_num;
+    rt_memcpy(msg->cbs, cbs, cb_num * sizeof(subscribe_cb));
+    data = (char *)&msg->cbs[cb_num ? cb_num : 1];
+
+    msg->message = *message;
+    msg->message.payload = data + len;
+    rt_memcpy(msg->message.payload, message->payload, message->payloadlen);
+
+    msg->topicName.cstring = RT_NULL;
+    msg->topicName.lenstring.data = data;
+    msg->topicName.lenstring.len = len;
+    rt_memcpy(data, topicName->lenstring.data, len);
+
+    /* never waits, a slow callback must not hold up the connections of the worker */
+    worker = &pool->workers[topic_hash(RT_NULL, data, len) % pool->num];
+    if (rt_mb_send(worker->mb, (rt_ubase_t)msg) != RT_EOK)
+    {
+        LOG_E("dispatch queue is full, message on %.*s dropped.", len, data);
+        c->dispatch_stat.dropped++;
+        rt_free(msg);
+        return PAHO_FAILURE;
+    }
 
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {
-            // skip until we meet the next separator, or end of string
-            char *nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
+    c->dispatch_stat.posted++;
+    if (worker->mb->entry > c->dispatch_stat.depth_max)
+        c->dispatch_stat.depth_max = worker->mb->entry;
 
-    return (curn == curn_end) && (*curf == '\0');
+    return PAHO_SUCCESS;
 }
 
 static int deliverMessage(MQTTClient *c, MQTTString *topicName, MQTTMessage *message)
 {
-    int i;
-    int rc = PAHO_FAILURE;
+    int i, num;
+    MessageData md;
 
-    // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-    {
-        if (c->messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(topicName, (char *)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char *)c->messageHandlers[i].topicFilter, topicName)))
-        {
-            if (c->messageHandlers[i].callback != NULL)
-            {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].callback(c, &md);
-                rc = PAHO_SUCCESS;
-            }
-        }
-    }
+    num = mqtt_topic_match(c, topicName->lenstring.data, topicName->lenstring.len);
+    if (num == 0 && c->defaultMessageHandler == RT_NULL)
+        return PAHO_FAILURE;
 
-    if (rc == PAHO_FAILURE && c->defaultMessageHandler != NULL)
-    {
-        MessageData md;
-        NewMessageData(&md, topicName, message);
+    if (c->dispatch_pool)
+        return mqtt_dispatch_post(c, topicName, message, c->topic_index->matches, num);
+
+    NewMessageData(&md, topicName, message);
+    if (num == 0)
         c->defaultMessageHandler(c, &md);
-        rc = PAHO_SUCCESS;
-    }
+    for (i = 0; i < num; i++)
+        c->topic_index->matches[i](c, &md);
 
-    return rc;
+    return PAHO_SUCCESS;
 }
 
-static int MQTT_cycle(MQTTClient *c)
+/* handle the packet read into readbuf, worker thread only */
+int MQTT_handlePacket(MQTTClient *c, int packet_type)
 {
-    // read the socket, see what work is due
-    int packet_type = MQTTPacket_readPacket(c);
-
     int len = 0,
         rc = PAHO_SUCCESS;
 
-
-    if (packet_type == -1)
-    {
-        rc = PAHO_FAILURE;
-        goto exit;
-    }
-
     switch (packet_type)
     {
-    case CONNACK:
     case PUBACK:
-    case SUBACK:
+    case PUBCOMP:
     {
-        int count = 0, grantedQoS = -1;
         unsigned short mypacketid;
+        unsigned char dup, type;
 
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, c->readbuf, c->readbuf_size) == 1)
-            rc = grantedQoS; // 0, 1, 2 or 0x80
+        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            rc = PAHO_FAILURE;
+        else
+            rc = mqtt_pub_ring_ack(c, type, mypacketid);
+        break;
+    }
+    case SUBACK:
+    {
+        int count = 0, grantedQoS[MQTT_SUB_BATCH_MAX];
+        unsigned short mypacketid;
 
-        if (rc != 0x80)
-            rc = 0;
+        if (MQTTDeserialize_suback(&mypacketid, MQTT_SUB_BATCH_MAX, &count, grantedQoS, c->readbuf, c->readbuf_size) != 1)
+        {
+            rc = PAHO_FAILURE;
+            break;
+        }
 
+        rc = mqtt_suback(c, mypacketid, count, grantedQoS);
+        if (rc == 0 && c->timers->suback_wait)
+        {
+            /* the last subscription of the connect is acknowledged */
+            rc = mqtt_session_online(c);
+        }
+        else if (rc > 0)
+        {
+            rc = PAHO_SUCCESS;
+        }
         break;
-    }  
+    }
     case UNSUBACK:
     {
         unsigned short mypacketid;
 
         if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
+        {
+            mqtt_unsuback(c, mypacketid);
             rc =  PAHO_SUCCESS;
+        }
         else
             rc =  PAHO_FAILURE;
 
@@ -812,12 +4429,20 @@ static int MQTT_cycle(MQTTClient *c)
     {
         MQTTString topicName;
         MQTTMessage msg;
-        int intQoS;
+        int intQoS, payloadlen, fresh = 1;
         if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
-                                    (unsigned char **)&msg.payload, (int *)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
+                                    (unsigned char **)&msg.payload, &payloadlen, c->readbuf, c->readbuf_size) != 1)
             goto exit;
         msg.qos = (enum QoS)intQoS;
-        deliverMessage(c, &topicName, &msg);
+        msg.payloadlen = payloadlen; /* size_t may be wider than int */
+        /* a QoS2 message is delivered once, resends before its PUBREL are only acknowledged */
+        if (msg.qos == QOS2 && (fresh = qos2_in_receive(c, msg.id)) < 0)
+        {
+            rc = PAHO_FAILURE;
+            goto exit;
+        }
+        if (fresh)
+            deliverMessage(c, &topicName, &msg);
         if (msg.qos != QOS0)
         {
             if (msg.qos == QOS1)
@@ -839,18 +4464,33 @@ static int MQTT_cycle(MQTTClient *c)
         unsigned char dup, type;
         if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
             rc = PAHO_FAILURE;
-        else if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, mypacketid)) <= 0)
-            rc = PAHO_FAILURE;
-        else if ((rc = sendPacket(c, len)) != PAHO_SUCCESS) // send the PUBREL packet
+        else if ((rc = mqtt_pub_ring_rec(c, mypacketid)) != PAHO_SUCCESS) // send the PUBREL packet
             rc = PAHO_FAILURE; // there was a problem
         if (rc == PAHO_FAILURE)
             goto exit; // there was a problem
         break;
     }
-    case PUBCOMP:
+    case PUBREL:
+    {
+        unsigned short mypacketid;
+        unsigned char dup, type;
+        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            rc = PAHO_FAILURE;
+        else
+        {
+            qos2_in_release(c, mypacketid);
+            if ((len = MQTTSerialize_ack(c->buf, c->buf_size, PUBCOMP, 0, mypacketid)) <= 0)
+                rc = PAHO_FAILURE;
+            else if ((rc = sendPacket(c, len)) != PAHO_SUCCESS) // send the PUBCOMP packet
+                rc = PAHO_FAILURE; // there was a problem
+        }
+        if (rc == PAHO_FAILURE)
+            goto exit; // there was a problem
         break;
+    }
     case PINGRESP:
-        c->tick_ping = rt_tick_get();
+        c->ping_outstanding = 0;
+        mqtt_timer_stop(c, &c->timers->ping);
         break;
     }
 
@@ -858,13 +4498,38 @@ exit:
     return rc;
 }
 
-static int MQTT_local_send(MQTTClient *c, const void *data, int len)
+static int MQTT_cycle(MQTTClient *c)
 {
-    int send_len;
+    int packet_type, rc = PAHO_SUCCESS;
 
-    send_len = write(c->pub_pipe[1], data, len);
+    // read the socket once, then handle every complete packet it buffered
+    do
+    {
+        if (net_read(c) < 0)
+            return PAHO_FAILURE;
 
-    return send_len;
+        while ((packet_type = MQTTPacket_readPacket(c)) > 0)
+        {
+            if ((rc = MQTT_handlePacket(c, packet_type)) < 0)
+                return rc;
+        }
+
+        if (packet_type < 0)
+            return PAHO_FAILURE;
+
+#ifdef MQTT_USING_STORE
+        /* the QoS state these packets changed */
+        mqtt_session_flush(c);
+#endif
+
+#ifdef MQTT_USING_TLS
+        /* decrypted data still held by mbedtls will not wake up select */
+    } while (c->tls_session && mbedtls_ssl_get_bytes_avail(&c->tls_session->ssl) > 0);
+#else
+    } while (0);
+#endif
+
+    return rc;
 }
 
 /*
@@ -873,41 +4538,34 @@ MQTT_CMD:
 */
 int MQTT_CMD(MQTTClient *c, const char *cmd)
 {
-    char *data = 0;
-    int cmd_len, len;
     int rc = PAHO_FAILURE;
 
-    if (!c->isconnected)
+    /* the worker may serve other clients, the command is left with this one */
+    if (c->reactor == RT_NULL || c->state == MQTT_STATE_STOPPED)
         goto _exit;
 
-    cmd_len = strlen(cmd) + 1;
-    if (cmd_len >= sizeof(MQTTMessage))
+    if (strcmp(cmd, "DISCONNECT") == 0)
     {
-        LOG_E("Commond is too long %d:%d.", cmd_len, sizeof(MQTTMessage));
-        goto _exit;
+        c->stop_requested = 1;
     }
-
-    data = rt_malloc(cmd_len);
-    if (!data)
+    else
+    {
+        LOG_E("Unknown command %s.", cmd);
         goto _exit;
+    }
 
-    strcpy(data, cmd);
-    len = MQTT_local_send(c, data, cmd_len);
-    if (len == cmd_len)
+    if (MQTT_local_send(c, "", 1) == 1)
     {
         rc = 0;
     }
 
 _exit:
-    if (data)
-        rt_free(data);
-
     return rc;
 }
 
 /**
  * This function publish message to specified mqtt topic.
- * [MQTTMessage] + [payload] + [topic] + '\0'
+ * The packet is serialized directly into the publish ring and sent from there by the worker.
  *
  * @param c the pointer of MQTT context structure
  * @param topicFilter topic filter name
@@ -918,278 +4576,645 @@ _exit:
 int MQTTPublish(MQTTClient *c, const char *topicName, MQTTMessage *message)
 {
     int rc = PAHO_FAILURE;
-    int len, msg_len;
-    char *data = 0;
+    int len;
+#ifdef MQTT_USING_STORE
+    int stored;
+#endif
+    struct MQTTPubSlot *slot;
+    MQTTString topic = MQTTString_initializer;
+
+    topic.cstring = (char *)topicName;
+
+    if (!c->pub_ring)
+        goto exit;
+
+#ifdef MQTT_USING_STORE
+    /* offline, or queued behind publishes still stored: the store keeps the order */
+    if (c->store)
+    {
+        rt_mutex_take(c->store->lock, RT_WAITING_FOREVER);
+        stored = !mqtt_store_empty(c->store);
+        rt_mutex_release(c->store->lock);
+
+        if (!c->isconnected || stored)
+        {
+            rc = mqtt_store_append(c, &topic, message);
+            goto exit;
+        }
+    }
+#endif
+
+    if (!c->isconnected)
+        goto exit;
+
+    len = MQTTPacket_len(MQTTSerialize_publishLength(message->qos, topic, message->payloadlen));
+
+    slot = mqtt_pub_ring_reserve(c, len, message);
+    if (slot == RT_NULL)
+    {
+#ifdef MQTT_USING_STORE
+        if (c->store)
+        {
+            rc = mqtt_store_append(c, &topic, message);
+            goto exit;
+        }
+#endif
+        LOG_D("publish ring is full, %d bytes dropped.", len);
+        goto exit;
+    }
+
+    if (MQTTSerialize_publish(c->pub_ring + slot->offset, len, 0, message->qos, message->retained, message->id,
+                              topic, (unsigned char *)message->payload, message->payloadlen) != len)
+    {
+        mqtt_pub_ring_commit(c, slot, PUB_SLOT_CANCELLED);
+        goto exit;
+    }
+
+    mqtt_pub_ring_commit(c, slot, PUB_SLOT_COMMITTED);
+    rc = PAHO_SUCCESS;
+
+    if (c->isblocking && c->pub_mutex)
+    {
+        if(rt_mutex_take(c->pub_mutex, 5 * RT_TICK_PER_SECOND) < 0)
+        {
+            rc = PAHO_FAILURE;
+        }
+    }
+
+exit:
+    return rc;
+}
+
+static struct rt_pipe_device *mqtt_pipe_init(int filds[2])
+{
+    char dname[8];
+    char dev_name[32];
+    static int pipeno = 0;
+    struct rt_pipe_device *pipe = RT_NULL;
+
+    rt_snprintf(dname, sizeof(dname), "MQTT%d", pipeno++);
+    pipe = rt_pipe_create(dname, PIPE_BUFSZ);
+    if (pipe == RT_NULL)
+    {
+        LOG_E("create mqtt pipe fail\n");
+        return RT_NULL;
+    }
+
+    rt_snprintf(dev_name, sizeof(dev_name), "/dev/%s", dname);
+    filds[0] = open(dev_name, O_RDONLY, 0);
+    if (filds[0] < 0)
+    {
+        LOG_E("pipe_read_fd open failed\n");
+        return RT_NULL;
+    }
+
+    filds[1] = open(dev_name, O_WRONLY, 0);
+    if (filds[1] < 0)
+    {
+        close(filds[1]);
+        LOG_E("pipe_write_fd open failed\n");
+        return RT_NULL;
+    }
+    
+    return pipe;
+}
+
+/* what the worker needs to serve a client */
+static int mqtt_client_open(MQTTReactor *r, MQTTClient *c)
+{
+    /* partial packets are parsed into readbuf, the ring only batches the reads */
+    c->recv_ring_size = MQTT_RECV_RING_SIZE;
+    c->recv_ring = rt_malloc(c->recv_ring_size);
+    if (c->recv_ring == RT_NULL)
+    {
+        LOG_E("no memory for receive ring.");
+        return PAHO_FAILURE;
+    }
+    c->transport.sck = c;
+    c->transport.getfn = recv_ring_getfn;
+
+    c->timers = mqtt_client_timers_create(&r->wheel);
+    if (c->timers == RT_NULL)
+    {
+        LOG_E("no memory for client timers.");
+        return PAHO_FAILURE;
+    }
+
+    return PAHO_SUCCESS;
+}
+
+/* the connection is lost or was never made, wait for the next attempt */
+static void mqtt_client_restart(MQTTClient *c)
+{
+    rt_uint32_t delay;
+
+    if (c->offline_callback)
+    {
+        c->offline_callback(c);
+    }
+
+    net_disconnect(c);
+    mqtt_timer_stop_session(c);
+    mqtt_timer_stop(c, &c->timers->request);
+    mqtt_suback_reset(c);
+    c->timers->failed = 0;
+
+    delay = mqtt_reconnect_delay(c);
+    LOG_D("reconnect in %d ms.", delay);
+    mqtt_timer_start(c, &c->timers->reconnect, rt_tick_from_millisecond(delay));
+    c->state = MQTT_STATE_RECONNECT;
+}
+
+static void mqtt_client_fail(MQTTClient *c)
+{
+    if (c->state == MQTT_STATE_ONLINE)
+    {
+#ifdef MQTT_USING_TLS
+        mqtt_tls_uncork(c);
+#endif
+        MQTTDisconnect(c);
+    }
+
+    mqtt_client_restart(c);
+}
+
+/* start connecting, the sockets are watched by the select of the worker from now on */
+static void mqtt_client_connect(MQTTClient *c)
+{
+    int rc;
+
+    if (c->connect_callback)
+    {
+        c->connect_callback(c);
+    }
+
+    rc = net_connect(c);
+    if (rc != 0)
+    {
+        LOG_E("Net connect error(%d).", rc);
+        mqtt_client_restart(c);
+        return;
+    }
+
+    mqtt_timer_start(c, &c->timers->request,
+                     rt_tick_from_millisecond(c->connect_timeout ? c->connect_timeout : MQTT_SOCKET_TIMEO));
+    c->state = MQTT_STATE_CONNECTING;
+}
+
+/* the connection is up, send CONNECT and wait for the CONNACK */
+static int mqtt_client_send_connect(MQTTClient *c)
+{
+    int rc;
+
+    rc = MQTTConnect(c);
+    if (rc != 0)
+    {
+        LOG_E("MQTT connect error(%d).", rc);
+        return PAHO_FAILURE;
+    }
+
+    mqtt_timer_start(c, &c->timers->request,
+                     rt_tick_from_millisecond(c->connect_timeout ? c->connect_timeout : MQTT_REQUEST_TIMEOUT));
+    c->state = MQTT_STATE_CONNACK;
+
+    return PAHO_SUCCESS;
+}
+
+#ifdef MQTT_USING_TLS
+/* the socket is ready for the next handshake step, send CONNECT once the handshake is done */
+static int mqtt_client_handshake(MQTTClient *c)
+{
+    int rc;
+
+    rc = net_handshake(c);
+    if (rc == 0)
+        return PAHO_SUCCESS;
+    if (rc < 0)
+        return PAHO_FAILURE;
+
+    mqtt_timer_stop(c, &c->timers->request);
+    return mqtt_client_send_connect(c);
+}
+#endif
+
+/* a socket of the connection attempt is writable, go on once one is connected */
+static int mqtt_client_connecting(MQTTClient *c, fd_set *writeset)
+{
+    int rc;
+
+    rc = mqtt_connect_check(c, writeset);
+    if (rc == -1)
+        return PAHO_SUCCESS;
+    if (rc < 0)
+    {
+        mqtt_connect_fail(c);
+        return PAHO_FAILURE;
+    }
+
+    mqtt_timer_stop(c, &c->timers->request);
+    if (net_connected(c, rc) != 0)
+    {
+        LOG_E("Net connect error.");
+        return PAHO_FAILURE;
+    }
+
+#ifdef MQTT_USING_TLS
+    if (c->tls_session)
+    {
+        mqtt_timer_start(c, &c->timers->request,
+                         rt_tick_from_millisecond(c->connect_timeout ? c->connect_timeout : MQTT_SOCKET_TIMEO));
+        c->state = MQTT_STATE_HANDSHAKE;
+        return mqtt_client_handshake(c);
+    }
+#endif
 
-    if (!c->isconnected)
-        goto exit;
+    return mqtt_client_send_connect(c);
+}
 
-    msg_len = sizeof(MQTTMessage) + message->payloadlen + strlen(topicName) + 1;
-    data = rt_malloc(msg_len);
-    if (!data)
-        goto exit;
+/* the CONNACK is in, bring the session up */
+static int mqtt_client_connected(MQTTClient *c)
+{
+    int rc;
 
-    memcpy(data, message, sizeof(MQTTMessage));
-    memcpy(data + sizeof(MQTTMessage), message->payload, message->payloadlen);
-    strcpy(data + sizeof(MQTTMessage) + message->payloadlen, topicName);
+    LOG_I("MQTT server connect success.");
+    c->state = MQTT_STATE_ONLINE;
 
+    /* online once the SUBACKs of the subscriptions sent with the CONNECT are in */
+    c->timers->suback_wait = 1;
+    if (mqtt_suback(c, 0, 0, RT_NULL) == 0)
+    {
+        mqtt_session_online(c);
+    }
+    else
+    {
+        mqtt_timer_start(c, &c->timers->suback, rt_tick_from_millisecond(MQTT_REQUEST_TIMEOUT));
+    }
 
-    len = MQTT_local_send(c, data, msg_len);
-    if (len == msg_len)
+    /* subscription changes and unacknowledged or queued packets from before the connection was lost */
+    if (mqtt_sub_flush(c) != PAHO_SUCCESS ||
+            mqtt_pub_ring_rewind(c) != PAHO_SUCCESS || mqtt_pub_ring_flush(c) != PAHO_SUCCESS)
     {
-        rc = PAHO_SUCCESS;
+        return PAHO_FAILURE;
     }
 
-    if (c->isblocking && c->pub_mutex)
+    /* packets that came in with the CONNACK are buffered already, select would not see them */
+    while ((rc = MQTTPacket_readPacket(c)) > 0)
     {
-        if(rt_mutex_take(c->pub_mutex, 5 * RT_TICK_PER_SECOND) < 0)
-        {
-            rc = PAHO_FAILURE;
-        }
+        if (MQTT_handlePacket(c, rc) < 0)
+            return PAHO_FAILURE;
+    }
+    if (rc < 0)
+    {
+        return PAHO_FAILURE;
     }
 
-exit:
-    if (data)
-        rt_free(data);
+    c->tick_ping = rt_tick_get();
+    c->ping_outstanding = 0;
+    if (c->keepAliveInterval > 0)
+    {
+        mqtt_timer_start(c, &c->timers->keepalive, keepalive_left(c));
+    }
 
-    return rc;
+    return PAHO_SUCCESS;
 }
 
-static struct rt_pipe_device *mqtt_pipe_init(int filds[2])
+/* data arrived while waiting for the CONNACK */
+static int mqtt_client_connack(MQTTClient *c)
 {
-    char dname[8];
-    char dev_name[32];
-    static int pipeno = 0;
-    struct rt_pipe_device *pipe = RT_NULL;
+    int rc;
 
-    rt_snprintf(dname, sizeof(dname), "MQTT%d", pipeno++);
-    pipe = rt_pipe_create(dname, PIPE_BUFSZ);
-    if (pipe == RT_NULL)
+    if (net_read(c) < 0)
+        return PAHO_FAILURE;
+
+    rc = MQTTPacket_readPacket(c);
+    if (rc == 0)
+        return PAHO_SUCCESS;
+    if (rc < 0)
     {
-        LOG_E("create mqtt pipe fail\n");
-        return RT_NULL;
+        LOG_E("%s MQTTPacket_readPacket fail", __FUNCTION__);
+        return PAHO_FAILURE;
     }
 
-    rt_snprintf(dev_name, sizeof(dev_name), "/dev/%s", dname);
-    filds[0] = open(dev_name, O_RDONLY, 0);
-    if (filds[0] < 0)
+    mqtt_timer_stop(c, &c->timers->request);
+    rc = MQTTConnack(c, rc);
+    if (rc != 0)
     {
-        LOG_E("pipe_read_fd open failed\n");
-        return RT_NULL;
+        LOG_E("MQTT connect error(%d): %s.", rc, MQTTSerialize_connack_string(rc));
+        return PAHO_FAILURE;
     }
 
-    filds[1] = open(dev_name, O_WRONLY, 0);
-    if (filds[1] < 0)
+    return mqtt_client_connected(c);
+}
+
+static void mqtt_client_close(MQTTClient *c)
+{
+    if (c->state == MQTT_STATE_ONLINE)
     {
-        close(filds[1]);
-        LOG_E("pipe_write_fd open failed\n");
-        return RT_NULL;
+        /* what was published before paho_mqtt_stop still goes out */
+        mqtt_pub_ring_flush(c);
+#ifdef MQTT_USING_TLS
+        mqtt_tls_uncork(c);
+#endif
+        MQTTDisconnect(c);
     }
-    
-    return pipe;
+
+    net_disconnect_exit(c);
+    c->state = MQTT_STATE_STOPPED;
+
+    LOG_I("MQTT server is disconnected.");
 }
 
-static void paho_mqtt_thread(void *param)
+/*
+ * The ready sockets of a client, before the timers of the turn run: a packet
+ * that came in by a deadline must be seen before the deadline is.
+ */
+static void mqtt_client_input(MQTTClient *c, fd_set *readset, fd_set *writeset)
 {
-    MQTTClient *c = (MQTTClient *)param;
-    int i, rc, len;
-    int rc_t = 0;
+    int rc = PAHO_SUCCESS;
 
-    /* create publish pipe */
-    c->pipe_device = mqtt_pipe_init(c->pub_pipe);
-    if (c->pipe_device == RT_NULL)
+    if (c->stop_requested || c->timers->failed)
+        return;
+
+    if (c->state == MQTT_STATE_CONNECTING)
     {
-        LOG_E("Create publish pipe device error.");
-        goto _mqtt_exit;
+        rc = mqtt_client_connecting(c, writeset);
     }
-
-_mqtt_start:
-    if (c->connect_callback)
+#ifdef MQTT_USING_TLS
+    else if (c->state == MQTT_STATE_HANDSHAKE)
     {
-        c->connect_callback(c);
+        if (FD_ISSET(c->sock, readset) || FD_ISSET(c->sock, writeset))
+            rc = mqtt_client_handshake(c);
     }
-
-    rc = net_connect(c);
-    if (rc != 0)
+#endif
+    else if (c->state == MQTT_STATE_CONNACK)
     {
-        LOG_E("Net connect error(%d).", rc);
-        goto _mqtt_restart;
+        if (FD_ISSET(c->sock, readset))
+            rc = mqtt_client_connack(c);
+    }
+    else if (c->state == MQTT_STATE_ONLINE)
+    {
+        if (FD_ISSET(c->sock, readset))
+            rc = MQTT_cycle(c);
     }
 
-    rc = MQTTConnect(c);
-    if (rc != 0)
+    if (rc != PAHO_SUCCESS)
     {
-        LOG_E("MQTT connect error(%d): %s.", rc, MQTTSerialize_connack_string(rc));
-        goto _mqtt_restart;
+        mqtt_client_fail(c);
     }
+}
 
-    LOG_I("MQTT server connect success.");
+/* the share of a worker turn of one client, after its sockets and the timers */
+static void mqtt_client_serve(MQTTClient *c, int woken)
+{
+    int rc = PAHO_SUCCESS;
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+    if (c->stop_requested)
     {
-        const char *topic = c->messageHandlers[i].topicFilter;
-        enum QoS qos = c->messageHandlers[i].qos;
-
-        if (topic == RT_NULL)
-            continue;
+        mqtt_client_close(c);
+        return;
+    }
 
-        rc = MQTTSubscribe(c, topic, qos);
-        LOG_I("Subscribe #%d %s %s!", i, topic, (rc < 0) || (rc == 0x80) ? ("fail") : ("OK"));
+    if (c->timers->failed)
+    {
+        rc = PAHO_FAILURE;
+    }
+    else if (c->state == MQTT_STATE_ONLINE)
+    {
+        if (c->sub_changed)
+        {
+            rc = mqtt_sub_flush(c);
+        }
 
-        if (rc != 0)
+        if (rc == PAHO_SUCCESS && woken && (rc = mqtt_pub_ring_flush(c)) != PAHO_SUCCESS)
         {
-            if (rc == 0x80)
-            {
-                LOG_E("QoS(%d) config err!", qos);
-            }
-            goto _mqtt_disconnect;
+            LOG_D("publish ring sendPacket rc: %d", rc);
         }
+
+#ifdef MQTT_USING_TLS
+        if (rc == PAHO_SUCCESS)
+            rc = mqtt_tls_uncork(c);
+#endif
     }
 
-    if (c->online_callback)
+    if (rc != PAHO_SUCCESS)
     {
-        c->online_callback(c);
+        mqtt_client_fail(c);
     }
+}
+
+static void mqtt_reactor_free(MQTTReactor *r)
+{
+    close(r->pipe[0]);
+    close(r->pipe[1]);
+    rt_pipe_delete((const char *)r->pipe_device->parent.parent.name);
+    rt_free(r);
+}
+
+static void mqtt_reactor_thread(void *param)
+{
+    MQTTReactor *r = (MQTTReactor *)param;
+    MQTTClient *c, *next, **link;
+    rt_base_t level;
 
-    c->tick_ping = rt_tick_get();
     while (1)
     {
-        int res;
-        rt_tick_t tick_now;
-        fd_set readset;
+        int res, maxfd, woken = 0;
+        rt_tick_t tick_left;
+        fd_set readset, writeset;
         struct timeval timeout;
 
-        tick_now = rt_tick_get();
-        if (((tick_now - c->tick_ping) / RT_TICK_PER_SECOND) > (c->keepAliveInterval - 5))
+        /* take over the clients started since the last turn */
+        level = rt_hw_interrupt_disable();
+        c = r->joining;
+        r->joining = RT_NULL;
+        rt_hw_interrupt_enable(level);
+        for (; c; c = next)
         {
-            timeout.tv_sec = 1;
-            //LOG_D("tick close to ping.");
+            next = c->reactor_next;
+            c->reactor_next = r->clients;
+            r->clients = c;
+            if (mqtt_client_open(r, c) != PAHO_SUCCESS)
+            {
+                net_disconnect_exit(c);
+                c->state = MQTT_STATE_STOPPED;
+            }
         }
-        else
+
+        /* stopped clients leave, a standalone reactor ends with its client */
+        for (link = &r->clients; *link; )
+        {
+            c = *link;
+            if (c->state == MQTT_STATE_STOPPED)
+            {
+                rt_sem_t stop_sem = c->stop_sem;
+
+                /* the owner may free the client as soon as it is out */
+                *link = c->reactor_next;
+                c->reactor_next = RT_NULL;
+                c->reactor = RT_NULL;
+                if (stop_sem)
+                    rt_sem_release(stop_sem);
+                continue;
+            }
+            link = &c->reactor_next;
+        }
+        if (r->clients == RT_NULL && r->joining == RT_NULL && (r->standalone || r->closing))
+            break;
+
+        for (c = r->clients; c; c = c->reactor_next)
         {
-            timeout.tv_sec = c->keepAliveInterval - 10 - (tick_now - c->tick_ping) / RT_TICK_PER_SECOND;
-            //LOG_D("timeount for ping: %d", timeout.tv_sec);
+            if (c->state == MQTT_STATE_CONNECT && !c->stop_requested)
+                mqtt_client_connect(c);
         }
-        timeout.tv_usec = 0;
 
+        /* sleep until a socket is readable or connected, a wakeup or the next timer of any client */
         FD_ZERO(&readset);
-        FD_SET(c->sock, &readset);
-        FD_SET(c->pub_pipe[0], &readset);
-
-        /* int select(maxfdp1, readset, writeset, exceptset, timeout); */
-        res = select(((c->pub_pipe[0] > c->sock) ? c->pub_pipe[0] : c->sock) + 1,
-                     &readset, RT_NULL, RT_NULL, &timeout);
-        if (res == 0)
+        FD_ZERO(&writeset);
+        FD_SET(r->pipe[0], &readset);
+        maxfd = r->pipe[0];
+        for (c = r->clients; c; c = c->reactor_next)
         {
-            len = MQTTSerialize_pingreq(c->buf, c->buf_size);
-            rc = sendPacket(c, len);
-            if (rc != 0)
+            if (c->state == MQTT_STATE_CONNACK || c->state == MQTT_STATE_ONLINE)
             {
-                LOG_E("[%d] send ping rc: %d ", rt_tick_get(), rc);
-                goto _mqtt_disconnect;
+                FD_SET(c->sock, &readset);
+                if (c->sock > maxfd)
+                    maxfd = c->sock;
             }
-
-            /* wait Ping Response. */
-            timeout.tv_sec = 5;
-            timeout.tv_usec = 0;
-
-            FD_ZERO(&readset);
-            FD_SET(c->sock, &readset);
-
-            res = select(c->sock + 1, &readset, RT_NULL, RT_NULL, &timeout);
-            if (res <= 0)
+            else if (c->state == MQTT_STATE_CONNECTING)
+            {
+                maxfd = mqtt_connect_fdset(c, &writeset, maxfd);
+            }
+#ifdef MQTT_USING_TLS
+            else if (c->state == MQTT_STATE_HANDSHAKE)
             {
-                LOG_E("[%d] wait Ping Response res: %d", rt_tick_get(), res);
-                goto _mqtt_disconnect;
+                FD_SET(c->sock, c->attempt->want_write ? &writeset : &readset);
+                if (c->sock > maxfd)
+                    maxfd = c->sock;
             }
-        } /* res == 0: timeount for ping. */
+#endif
+        }
+
+        tick_left = mqtt_timer_next(&r->wheel);
+        timeout.tv_sec = tick_left / RT_TICK_PER_SECOND;
+        timeout.tv_usec = (tick_left % RT_TICK_PER_SECOND) * (1000000 / RT_TICK_PER_SECOND);
 
+        /* int select(maxfdp1, readset, writeset, exceptset, timeout); */
+        res = select(maxfd + 1, &readset, &writeset, RT_NULL,
+                     (tick_left != (rt_tick_t)RT_WAITING_FOREVER) ? &timeout : RT_NULL);
         if (res < 0)
         {
+            /* which socket went bad is unknown, every connection is made again */
             LOG_E("select res: %d", res);
-            goto _mqtt_disconnect;
+            FD_ZERO(&readset);
+            FD_ZERO(&writeset);
+            for (c = r->clients; c; c = c->reactor_next)
+            {
+                if (c->state == MQTT_STATE_CONNECTING || c->state == MQTT_STATE_HANDSHAKE ||
+                        c->state == MQTT_STATE_CONNACK || c->state == MQTT_STATE_ONLINE)
+                    c->timers->failed = 1;
+            }
         }
 
-        if (FD_ISSET(c->sock, &readset))
+        if (res > 0 && FD_ISSET(r->pipe[0], &readset))
         {
-            //LOG_D("sock FD_ISSET");
-            rc_t = MQTT_cycle(c);
-            //LOG_D("sock FD_ISSET rc_t : %d", rc_t);
-            if (rc_t < 0)    goto _mqtt_disconnect;
+            char buf[32];
 
-            continue;
+            /* a wakeup carries no data, the clients tell what is due */
+            read(r->pipe[0], buf, sizeof(buf));
+            woken = 1;
+
+            /* clear before draining, a packet committed from now on signals again */
+            for (c = r->clients; c; c = c->reactor_next)
+            {
+                level = rt_hw_interrupt_disable();
+                c->pub_signaled = 0;
+                rt_hw_interrupt_enable(level);
+            }
         }
 
-        if (FD_ISSET(c->pub_pipe[0], &readset))
+#ifdef MQTT_USING_TLS
+        /* acks, pings and publishes of this turn go out together before the next select */
+        for (c = r->clients; c; c = c->reactor_next)
         {
-            MQTTMessage *message;
-            MQTTString topic = MQTTString_initializer;
+            if (c->state == MQTT_STATE_ONLINE)
+                mqtt_tls_cork(c);
+        }
+#endif
 
-            //LOG_D("pub_sock FD_ISSET");
+        for (c = r->clients; c; c = c->reactor_next)
+        {
+            mqtt_client_input(c, &readset, &writeset);
+        }
 
-            len = read(c->pub_pipe[0], c->readbuf, c->readbuf_size);
+        mqtt_timer_run(&r->wheel);
 
-            if (len < sizeof(MQTTMessage))
-            {
-                c->readbuf[len] = '\0';
-                LOG_D("pub_sock recv %d byte: %s", len, c->readbuf);
+        for (c = r->clients; c; c = c->reactor_next)
+        {
+            mqtt_client_serve(c, woken);
+        }
+    }
 
-                if (strcmp((const char *)c->readbuf, "DISCONNECT") == 0)
-                {
-                    goto _mqtt_disconnect_exit;
-                }
+    mqtt_reactor_free(r);
+}
 
-                continue;
-            }
+/*
+ * @param owner the only client of a standalone reactor, RT_NULL for a shared one
+ */
+static MQTTReactor *mqtt_reactor_create(const char *name, MQTTClient *owner)
+{
+    MQTTReactor *r;
+    rt_thread_t tid;
 
-            message = (MQTTMessage *)c->readbuf;
-            message->payload = c->readbuf + sizeof(MQTTMessage);
-            topic.cstring = (char *)c->readbuf + sizeof(MQTTMessage) + message->payloadlen;
-            //LOG_D("pub_sock topic:%s, payloadlen:%d", topic.cstring, message->payloadlen);
+    r = rt_calloc(1, sizeof(MQTTReactor));
+    if (r == RT_NULL)
+        return RT_NULL;
 
-            len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
-                                        topic, (unsigned char *)message->payload, message->payloadlen);
-            if (len <= 0)
-            {
-                LOG_D("MQTTSerialize_publish len: %d", len);
-                goto _mqtt_disconnect;
-            }
+    mqtt_timer_wheel_init(&r->wheel);
 
-            if ((rc = sendPacket(c, len)) != PAHO_SUCCESS) // send the subscribe packet
-            {
-                LOG_D("MQTTSerialize_publish sendPacket rc: %d", rc);
-                goto _mqtt_disconnect;
-            }
+    /* create wakeup pipe */
+    r->pipe_device = mqtt_pipe_init(r->pipe);
+    if (r->pipe_device == RT_NULL)
+    {
+        LOG_E("Create wakeup pipe device error.");
+        rt_free(r);
+        return RT_NULL;
+    }
 
-            if (c->isblocking && c->pub_mutex)
-            {
-                rt_mutex_release(c->pub_mutex);
-            }
-        } /* pbulish sock handler. */
-    } /* while (1) */
+    /* joined before the worker runs, it would end right away without a client */
+    if (owner)
+    {
+        r->standalone = 1;
+        owner->reactor = r;
+        owner->reactor_next = RT_NULL;
+        r->joining = owner;
+    }
 
-_mqtt_disconnect:
-    MQTTDisconnect(c);
-_mqtt_restart:
-    if (c->offline_callback)
+    tid = rt_thread_create(name,
+                           mqtt_reactor_thread, (void *) r,        // fun, parameter
+                           RT_PKG_MQTT_THREAD_STACK_SIZE,          // stack size
+                           RT_THREAD_PRIORITY_MAX / 3, 2);         //priority, tick
+    if (tid == RT_NULL)
     {
-        c->offline_callback(c);
+        if (owner)
+            owner->reactor = RT_NULL;
+        mqtt_reactor_free(r);
+        return RT_NULL;
     }
+    rt_thread_startup(tid);
 
-    net_disconnect(c);
-    rt_thread_delay(c->reconnect_interval > 0 ? 
-        rt_tick_from_millisecond(c->reconnect_interval) : RT_TICK_PER_SECOND * 5);
-    LOG_D("restart!");
-    goto _mqtt_start;
+    return r;
+}
 
-_mqtt_disconnect_exit:
-    MQTTDisconnect(c);
-    net_disconnect_exit(c);
+static void mqtt_reactor_join(MQTTReactor *r, MQTTClient *c)
+{
+    rt_base_t level;
 
-_mqtt_exit:
-    LOG_I("MQTT server is disconnected.");
+    level = rt_hw_interrupt_disable();
+    c->reactor_next = r->joining;
+    r->joining = c;
+    rt_hw_interrupt_enable(level);
 
-    return;
+    write(r->pipe[1], "", 1);
 }
 
 /**
@@ -1201,9 +5226,9 @@ _mqtt_exit:
  */
 int paho_mqtt_start(MQTTClient *client)
 {
-    rt_thread_t tid = RT_NULL;
     static uint8_t counts = 0;
     char pub_name[RT_NAME_MAX], thread_name[RT_NAME_MAX];
+    int i;
 
     /* create publish mutex */
     rt_memset(pub_name, 0x00, sizeof(pub_name));
@@ -1215,18 +5240,147 @@ int paho_mqtt_start(MQTTClient *client)
         return PAHO_FAILURE;
     }
 
+    /* create subscribe mutex */
+    rt_memset(pub_name, 0x00, sizeof(pub_name));
+    rt_snprintf(pub_name, RT_NAME_MAX, "smtx%d", counts);
+    client->sub_mutex = rt_mutex_create(pub_name, RT_IPC_FLAG_FIFO);
+    if (client->sub_mutex == RT_NULL)
+    {
+        LOG_E("Create subscribe mutex error.");
+        rt_mutex_delete(client->pub_mutex);
+        client->pub_mutex = RT_NULL;
+        return PAHO_FAILURE;
+    }
+
+#ifdef MQTT_USING_STORE
+    client->store = RT_NULL;
+#endif
+    /* no socket yet, a client failing to open is closed without one */
+    client->sock = -1;
+    client->reconnect_delay = 0;
+    client->reconnect_rand = 0;
+    client->addr_cache = RT_NULL;
+#ifdef MQTT_USING_TLS
+    client->tls_session = RT_NULL;
+    client->tls_resume = RT_NULL;
+    client->tls_out = RT_NULL;
+    client->tls_out_len = 0;
+    client->tls_record_size = 0;
+    client->tls_corked = 0;
+    client->tls_heap_peak = 0;
+#endif
+
+    /* create publish ring */
+    client->pub_ring_size = MQTT_PUB_RING_SIZE;
+    client->pub_slot_num = MQTT_PUB_RING_SLOTS;
+    client->pub_ring = rt_malloc(client->pub_ring_size);
+    client->pub_slots = rt_calloc(client->pub_slot_num, sizeof(struct MQTTPubSlot));
+    if (client->pub_ring == RT_NULL || client->pub_slots == RT_NULL)
+    {
+        LOG_E("no memory for publish ring.");
+        goto _nomem;
+    }
+    for (i = 0; i < client->pub_slot_num; i++)
+    {
+        mqtt_timer_init(&client->pub_slots[i].retry, mqtt_pub_retry_timeout);
+    }
+    client->timers = RT_NULL;
+    client->recv_ring = RT_NULL;
+    client->connect_pkt = RT_NULL;
+    client->packetid_map = rt_calloc((MAX_PACKET_ID + 1) / 32, sizeof(rt_uint32_t));
+    if (client->packetid_map == RT_NULL)
+    {
+        LOG_E("no memory for packet id map.");
+        goto _nomem;
+    }
+    if (client->inflight_window == 0 || client->inflight_window > client->pub_slot_num)
+    {
+        client->inflight_window = (MQTT_INFLIGHT_WINDOW < client->pub_slot_num) ? MQTT_INFLIGHT_WINDOW : client->pub_slot_num;
+    }
+    client->inflight_count = 0;
+    client->next_packetid = 0;
+    client->pub_ring_wr = client->pub_ring_used = 0;
+    client->pub_slot_head = client->pub_slot_send = client->pub_slot_tail = client->pub_slot_count = 0;
+    client->pub_signaled = 0;
+#ifdef MQTT_USING_STORE
+    if (client->store_path && (mqtt_store_open(client) != PAHO_SUCCESS || mqtt_session_restore(client) != PAHO_SUCCESS))
+    {
+        LOG_E("Open publish store error.");
+        goto _nomem;
+    }
+#endif
+
+    /* create subscription table, starting with the messageHandlers set before start */
+    client->subs = RT_NULL;
+    client->sub_arena = RT_NULL;
+    client->sub_num = client->sub_size = 0;
+    client->sub_free = -1;
+    client->sub_digest = 0;
+    client->session_subscribed = 0;
+    if (mqtt_topic_index_init(client) != PAHO_SUCCESS)
+    {
+        LOG_E("no memory for topic index.");
+        goto _nomem;
+    }
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+    {
+        if (client->messageHandlers[i].topicFilter == RT_NULL)
+            continue;
+
+        if (mqtt_sub_add(client, client->messageHandlers[i].topicFilter, client->messageHandlers[i].qos,
+                         client->messageHandlers[i].callback) < 0)
+            goto _nomem;
+    }
+
+    /* create callback threads */
+    client->dispatch_pool = RT_NULL;
+    rt_memset(&client->dispatch_stat, 0x00, sizeof(client->dispatch_stat));
+    if (client->dispatch_threads == 0)
+    {
+        client->dispatch_threads = MQTT_DISPATCH_THREADS;
+    }
+    if (client->dispatch_threads > 0 && mqtt_dispatch_start(client, client->dispatch_threads) != PAHO_SUCCESS)
+    {
+        LOG_E("Create message callback threads error.");
+        goto _nomem;
+    }
+
+    client->state = MQTT_STATE_CONNECT;
+    client->stop_requested = 0;
+    if (client->reactor)
+    {
+        mqtt_reactor_join(client->reactor, client);
+        return PAHO_SUCCESS;
+    }
+
+    /* a worker thread of its own */
     rt_memset(thread_name, 0x00, sizeof(thread_name));
     rt_snprintf(thread_name, RT_NAME_MAX, "mqtt%d", counts++);
-    tid = rt_thread_create( thread_name,
-                            paho_mqtt_thread, (void *) client,      // fun, parameter
-                            RT_PKG_MQTT_THREAD_STACK_SIZE,          // stack size
-                            RT_THREAD_PRIORITY_MAX / 3, 2 );         //priority, tick      
-    if (tid)
+    if (mqtt_reactor_create(thread_name, client) == RT_NULL)
     {
-        rt_thread_startup(tid);
+        LOG_E("Create mqtt worker thread error.");
+        goto _nomem;
     }
 
     return PAHO_SUCCESS;
+
+_nomem:
+#ifdef MQTT_USING_STORE
+    mqtt_store_close(client);
+#endif
+    mqtt_sub_free_all(client);
+    mqtt_dispatch_stop(client);
+    rt_free(client->pub_ring);
+    rt_free(client->pub_slots);
+    rt_free(client->packetid_map);
+    client->pub_ring = RT_NULL;
+    client->pub_slots = RT_NULL;
+    client->packetid_map = RT_NULL;
+    rt_mutex_delete(client->pub_mutex);
+    client->pub_mutex = RT_NULL;
+    rt_mutex_delete(client->sub_mutex);
+    client->sub_mutex = RT_NULL;
+    return PAHO_FAILURE;
 }
 
 /**
@@ -1242,21 +5396,68 @@ int paho_mqtt_stop(MQTTClient *client)
 }
 
 /**
- * This function send an MQTT subscribe packet and wait for suback before returning.
+ * This function create a worker thread serving any number of MQTT clients.
+ *
+ * @return the reactor, RT_NULL on failure.
+ */
+MQTTReactor *paho_mqtt_reactor_create(void)
+{
+    static int counts = 0;
+    char thread_name[RT_NAME_MAX];
+
+    rt_memset(thread_name, 0x00, sizeof(thread_name));
+    rt_snprintf(thread_name, RT_NAME_MAX, "mqttr%d", counts++);
+
+    return mqtt_reactor_create(thread_name, RT_NULL);
+}
+
+/**
+ * This function stop a reactor worker thread once its clients are stopped.
+ *
+ * @param reactor the reactor created by paho_mqtt_reactor_create
+ *
+ * @return the error code, 0 on success.
+ */
+int paho_mqtt_reactor_delete(MQTTReactor *reactor)
+{
+    RT_ASSERT(reactor);
+
+    reactor->closing = 1;
+    if (write(reactor->pipe[1], "", 1) != 1)
+        return PAHO_FAILURE;
+
+    return PAHO_SUCCESS;
+}
+
+/* hand the subscription changes to the worker, which owns the send buffer */
+static void mqtt_sub_signal(MQTTClient *client)
+{
+    client->sub_changed = 1;
+    rt_mutex_release(client->sub_mutex);
+
+    if (client->reactor)
+    {
+        MQTT_local_send(client, "", 1);
+    }
+}
+
+/**
+ * This function subscribe a topic filter, the worker sends the SUBSCRIBE packet
+ * and nothing waits for its suback. A filter refused by the broker is removed
+ * from the subscriptions again, the refusal is only logged.
  *
  * @param client the pointer of MQTT context structure
  * @param qos MQTT Qos type, only support QOS1
  * @param topic topic filter name
  * @param callback the pointer of subscribe topic receive data function
  *
- * @return the error code, 0 on start successfully.
+ * @return the error code, 0 when the filter is queued for the worker, which
+ *         does not mean the broker accepted it.
  */
 int paho_mqtt_subscribe(MQTTClient *client, enum QoS qos, const char *topic, subscribe_cb callback)
 {
-    int i, lenght, rc = PAHO_SUCCESS;
-    int qos_sub = qos;
-    MQTTString topicFilters = MQTTString_initializer;
-    topicFilters.cstring = (char *)topic;
+    struct MQTTSubscription *sub;
+    int i;
 
     RT_ASSERT(client);
     RT_ASSERT(topic);
@@ -1267,132 +5468,92 @@ int paho_mqtt_subscribe(MQTTClient *client, enum QoS qos, const char *topic, sub
         return PAHO_FAILURE;
     }
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS ; ++i)
+    rt_mutex_take(client->sub_mutex, RT_WAITING_FOREVER);
+    i = mqtt_sub_find(client, topic);
+    if (i >= 0)
     {
-        if (client->messageHandlers[i].topicFilter && 
-                rt_strncmp(client->messageHandlers[i].topicFilter, topic, rt_strlen(topic)) == 0)
+        sub = &client->subs[i];
+        if (!sub->unsub)
         {
+            rt_mutex_release(client->sub_mutex);
             LOG_D("MQTT client topic(%s) is already subscribed.", topic);
             return PAHO_SUCCESS;
         }
-    }
-
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-    {
-        if (client->messageHandlers[i].topicFilter)
-        {
-            continue;
-        }
-
-        lenght = MQTTSerialize_subscribe(client->buf, client->buf_size, 0, getNextPacketId(client), 1, &topicFilters, &qos_sub);
-        if (lenght <= 0)
-        {
-            LOG_E("Subscribe #%d %s failed!", i, topic);
-            client->isconnected = 0;
-            goto _exit;
-        }
-
-        rc = sendPacket(client, lenght);
-        if (rc != PAHO_SUCCESS) 
-        {
-            LOG_E("Subscribe #%d %s failed!", i, topic);
-            client->isconnected = 0;
-            goto _exit;
-        }
 
-        client->messageHandlers[i].qos = qos;
-        client->messageHandlers[i].topicFilter = rt_strdup((char *)topic);
-        if (callback)
+        /* still in the table on its way out, keep it */
+        sub->unsub = 0;
+        sub->callback = callback;
+        if (sub->unsub_id == 0)
         {
-            client->messageHandlers[i].callback = callback;
+            rt_mutex_release(client->sub_mutex);
+            return PAHO_SUCCESS;
         }
-
-        LOG_I("Subscribe #%d %s OK!", i, topic);
-        goto _exit;
+        sub->runtime = 1;
     }
-
-    /* check subscribe numble support */
-    if (i >= MAX_MESSAGE_HANDLERS)
+    else
     {
-        LOG_E("Subscribe MAX_MESSAGE_HANDLERS size(%d) is not enough!", MAX_MESSAGE_HANDLERS);
-        rc = PAHO_FAILURE;
-        goto _exit;
+        i = mqtt_sub_add(client, topic, qos, callback);
+        if (i < 0)
+        {
+            rt_mutex_release(client->sub_mutex);
+            return PAHO_FAILURE;
+        }
+        client->subs[i].runtime = 1;
     }
+    mqtt_sub_signal(client);
 
-_exit:
-    return rc;
+    return PAHO_SUCCESS;
 }
 
 /**
- * This function send an MQTT unsubscribe packet and wait for unsuback before returning.
+ * This function unsubscribe a topic filter, the worker sends the UNSUBSCRIBE
+ * packet and nothing waits for its unsuback. No message is delivered to the
+ * filter anymore once this function returns.
  *
  * @param client the pointer of MQTT context structure
  * @param topic topic filter name
  *
- * @return the error code, 0 on start successfully.
+ * @return the error code, 0 when the filter is queued for the worker, which
+ *         removes it on the unsuback.
  */
 int paho_mqtt_unsubscribe(MQTTClient *client, const char *topic)
 {
-    int i, length, rc = PAHO_SUCCESS;
-    MQTTString topicFilter = MQTTString_initializer;
-    topicFilter.cstring = (char *)topic;
+    struct MQTTSubscription *sub;
+    int i;
 
     RT_ASSERT(client);
     RT_ASSERT(topic);
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    rt_mutex_take(client->sub_mutex, RT_WAITING_FOREVER);
+    i = mqtt_sub_find(client, topic);
+    if (i < 0 || client->subs[i].unsub)
     {
-        if (client->messageHandlers[i].topicFilter == RT_NULL || 
-                rt_strncmp(client->messageHandlers[i].topicFilter, topic, rt_strlen(topic)) != 0)
-        {
-            continue;
-        }
-
-        length = MQTTSerialize_unsubscribe(client->buf, client->buf_size, 0, getNextPacketId(client), 1, &topicFilter);
-        if (length <= 0)
-        {
-            LOG_E("Unubscribe #%d %s failed!", i, topic);
-            client->isconnected = 0;
-            goto _exit;
-        }
-
-        rc = sendPacket(client, length);
-        if (rc != PAHO_SUCCESS)
-        {
-            LOG_E("Unubscribe #%d %s failed!", i, topic);
-            client->isconnected = 0;
-            goto _exit;
-        }
-
-        /* clear message handler */
-        if (client->messageHandlers[i].topicFilter)
-        {
-            rt_free(client->messageHandlers[i].topicFilter);
-            client->messageHandlers[i].topicFilter = RT_NULL;
-        }
-        client->messageHandlers[i].callback = RT_NULL; 
-
-        LOG_I("Unsubscribe #%d %s OK!", i, topic);
-        goto _exit;
+        rt_mutex_release(client->sub_mutex);
+        LOG_E("Unsubscribe topic(%s) is not exist!", topic);
+        return PAHO_FAILURE;
     }
 
-    /* check subscribe topic */
-    if (i >= MAX_MESSAGE_HANDLERS)
+    sub = &client->subs[i];
+    if (sub->runtime && sub->suback_id == 0 && sub->unsub_id == 0)
     {
-        LOG_E("Unsubscribe topic(%s) is not exist!", topic);
-        rc = PAHO_FAILURE;
-        goto _exit;
+        /* its SUBSCRIBE has not gone out yet */
+        mqtt_sub_remove(client, i);
+        rt_mutex_release(client->sub_mutex);
+        return PAHO_SUCCESS;
     }
 
-_exit:
-    return rc;
+    sub->unsub = 1;
+    sub->callback = RT_NULL;
+    mqtt_sub_signal(client);
+
+    return PAHO_SUCCESS;
 }
 
 /**
  * This function publish message to specified mqtt topic.
  *
  * @param c the pointer of MQTT context structure
- * @param qos MQTT QOS type, only support QOS1
+ * @param qos MQTT QOS type, QOS0, QOS1 or QOS2
  * @param topic topic filter name
  * @param msg_str the pointer of MQTTMessage structure
  *
@@ -1402,9 +5563,9 @@ int paho_mqtt_publish(MQTTClient *client, enum QoS qos, const char *topic, const
 {
     MQTTMessage message;
 
-    if (qos != QOS1)
+    if (qos < QOS0 || qos > QOS2)
     {
-        LOG_E("Not support Qos(%d) config, only support Qos(d).", qos, QOS1);
+        LOG_E("Not support Qos(%d) config.", qos);
         return PAHO_FAILURE;
     }
 
@@ -1416,6 +5577,122 @@ int paho_mqtt_publish(MQTTClient *client, enum QoS qos, const char *topic, const
     return MQTTPublish(client, topic, &message);
 }
 
+/**
+ * This function publish a payload too large for the client buffers. The
+ * payload is pulled from the producer in chunks of buf_size bytes while the
+ * packet is sent, from offset 0 again whenever the publish is resent. The
+ * producer is called from the worker thread, never after this function returned.
+ *
+ * @param client the pointer of MQTT context structure
+ * @param qos MQTT QOS type, QOS0, QOS1 or QOS2
+ * @param topic topic name
+ * @param payloadlen the length of the payload
+ * @param producer the function filling in the payload
+ * @param arg the argument of producer
+ * @param timeout milliseconds to wait for the publish, MQTT_SOCKET_TIMEO if 0
+ *
+ * @return the error code, 0 once sent (QOS0) or acknowledged (QOS1, QOS2).
+ */
+int paho_mqtt_publish_stream(MQTTClient *client, enum QoS qos, const char *topic, size_t payloadlen,
+                             publish_producer_cb producer, void *arg, int timeout)
+{
+    struct MQTTPubStream *stream;
+    struct MQTTPubSlot *slot;
+    MQTTMessage message;
+    MQTTString topic_name = MQTTString_initializer;
+    rt_base_t level;
+    int len, rc, busy;
+
+    RT_ASSERT(client);
+    RT_ASSERT(topic);
+    RT_ASSERT(producer);
+
+    if (qos < QOS0 || qos > QOS2)
+    {
+        LOG_E("Not support Qos(%d) config.", qos);
+        return PAHO_FAILURE;
+    }
+
+    /* the largest remaining length MQTT can encode */
+    if (payloadlen > 268435455 - 4 - rt_strlen(topic))
+    {
+        LOG_E("publish payload %d bytes is too long.", (int)payloadlen);
+        return PAHO_FAILURE;
+    }
+
+    /* never stored, the producer is only at hand while the caller waits */
+    if (!client->pub_ring || !client->isconnected)
+        return PAHO_FAILURE;
+
+    if (timeout <= 0)
+        timeout = MQTT_SOCKET_TIMEO;
+
+    topic_name.cstring = (char *)topic;
+    len = MQTTPacket_len(MQTTSerialize_publishLength(qos, topic_name, payloadlen)) - payloadlen;
+
+    stream = rt_calloc(1, sizeof(struct MQTTPubStream));
+    if (stream == RT_NULL)
+        return PAHO_FAILURE;
+    stream->producer = producer;
+    stream->arg = arg;
+    stream->payloadlen = payloadlen;
+    stream->rc = PAHO_FAILURE;
+    stream->refs = 2;
+    stream->done = rt_sem_create("mqstrm", 0, RT_IPC_FLAG_FIFO);
+    if (stream->done == RT_NULL)
+    {
+        rt_free(stream);
+        return PAHO_FAILURE;
+    }
+
+    rt_memset(&message, 0, sizeof(message));
+    message.qos = qos;
+    message.payloadlen = payloadlen;
+
+    /* only the header goes into the ring */
+    slot = mqtt_pub_ring_reserve(client, len, &message);
+    if (slot == RT_NULL)
+    {
+        LOG_D("publish ring is full, %d bytes dropped.", len);
+        goto _free;
+    }
+
+    if (MQTTSerialize_publishHeader(client->pub_ring + slot->offset, len, 0, qos, 0, message.id,
+                                    topic_name, payloadlen) != len)
+    {
+        if (qos != QOS0)
+            packetid_release(client, message.id);
+        mqtt_pub_ring_commit(client, slot, PUB_SLOT_CANCELLED);
+        goto _free;
+    }
+
+    slot->stream = stream;
+    mqtt_pub_ring_commit(client, slot, PUB_SLOT_COMMITTED);
+
+    if (rt_sem_take(stream->done, rt_tick_from_millisecond(timeout)) != RT_EOK)
+    {
+        level = rt_hw_interrupt_disable();
+        busy = !stream->finished && stream->busy;
+        stream->orphan = !stream->finished;
+        rt_hw_interrupt_enable(level);
+
+        /* the worker drops the publish, a producer call in progress is waited for */
+        if (busy)
+            rt_sem_take(stream->done, RT_WAITING_FOREVER);
+        if (stream->orphan)
+            LOG_E("publish stream of %d bytes timeout.", (int)payloadlen);
+    }
+    rc = stream->orphan ? PAHO_FAILURE : stream->rc;
+    mqtt_pub_stream_put(stream);
+
+    return rc;
+
+_free:
+    stream->refs = 1;
+    mqtt_pub_stream_put(stream);
+    return PAHO_FAILURE;
+}
+
 /**
  * This function control MQTT client configure, such as connect timeout, reconnect interval.
  *
@@ -1439,6 +5716,10 @@ int paho_mqtt_control(MQTTClient *client, int cmd, void *arg)
         case MQTT_CTRL_SET_RECONN_INTERVAL:
             client->reconnect_interval = *(int *)arg;
             break;
+
+        case MQTT_CTRL_SET_RECONN_MAX_INTERVAL:
+            client->reconnect_max = *(int *)arg;
+            break;
         
         case MQTT_CTRL_SET_KEEPALIVE_INTERVAL:
             client->keepAliveInterval = *(unsigned int *)arg;
@@ -1447,6 +5728,18 @@ int paho_mqtt_control(MQTTClient *client, int cmd, void *arg)
         case MQTT_CTRL_PUBLISH_BLOCK:
             client->isblocking = *(int *)arg;
             break;
+
+        case MQTT_CTRL_SET_INFLIGHT_WINDOW:
+            client->inflight_window = *(unsigned int *)arg;
+            if (client->inflight_window == 0)
+            {
+                client->inflight_window = 1;
+            }
+            if (client->pub_slot_num && client->inflight_window > client->pub_slot_num)
+            {
+                client->inflight_window = client->pub_slot_num;
+            }
+            break;
         
         default:
             LOG_E("Input control commoand(%d) error.", cmd);
@@ -1456,3 +5749,320 @@ int paho_mqtt_control(MQTTClient *client, int cmd, void *arg)
     return PAHO_SUCCESS;
 }
 
+
+/* FNV-1a of the topic, the same topic always lands on the same shard */
+static MQTTClient *mqtt_group_shard(MQTTClientGroup *group, const char *topic)
+{
+    rt_uint32_t hash = 2166136261UL;
+
+    while (*topic)
+    {
+        hash = (hash ^ (unsigned char)*topic++) * 16777619UL;
+    }
+
+    return &group->shards[hash % group->shard_num];
+}
+
+/* what a shard that could not start still holds, the worker frees the others */
+static void mqtt_group_shard_free(MQTTClient *c)
+{
+    int i;
+
+    rt_free(c->buf);
+    rt_free(c->readbuf);
+    c->buf = c->readbuf = RT_NULL;
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+    {
+        rt_free(c->messageHandlers[i].topicFilter);
+        c->messageHandlers[i].topicFilter = RT_NULL;
+    }
+}
+
+static int mqtt_group_close(MQTTClientGroup *group);
+
+/**
+ * This function start the shards of a client group, each a copy of the group
+ * config with the client id and store path suffixed by the shard number.
+ *
+ * @param group the pointer of MQTT client group structure
+ *
+ * @return the error code, 0 on start successfully.
+ */
+int paho_mqtt_group_start(MQTTClientGroup *group)
+{
+    MQTTClient *config = &group->config, *c;
+    const char *id = config->condata.clientID.cstring;
+    size_t id_size = (id ? rt_strlen(id) : 0) + 12, path_size = 0;
+    char *name;
+    int i, n;
+
+    RT_ASSERT(group->shard_num > 0);
+
+#ifdef MQTT_USING_STORE
+    /* the shards keep their stores in numbered directories below store_path */
+    if (config->store_path)
+    {
+        path_size = rt_strlen(config->store_path) + 12;
+        mkdir(config->store_path, 0777);
+    }
+#endif
+
+    group->published = group->refused = 0;
+    group->shard_started = 0;
+    group->shards = rt_calloc(group->shard_num, sizeof(MQTTClient));
+    group->names = rt_malloc(group->shard_num * (id_size + path_size));
+    if (group->shards == RT_NULL || group->names == RT_NULL)
+    {
+        LOG_E("no memory for client group.");
+        goto _nomem;
+    }
+
+    group->stopped = rt_sem_create("mqgrp", 0, RT_IPC_FLAG_FIFO);
+    if (group->stopped == RT_NULL)
+        goto _nomem;
+
+    group->own_reactor = (group->reactor == RT_NULL);
+    if (group->own_reactor && (group->reactor = paho_mqtt_reactor_create()) == RT_NULL)
+    {
+        LOG_E("Create client group worker thread error.");
+        goto _nomem;
+    }
+
+    for (n = 0; n < group->shard_num; n++)
+    {
+        c = &group->shards[n];
+        rt_memcpy(c, config, sizeof(MQTTClient));
+        c->reactor = group->reactor;
+        c->stop_sem = group->stopped;
+        c->buf = c->readbuf = RT_NULL;
+        for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+        {
+            c->messageHandlers[i].topicFilter = RT_NULL;
+        }
+
+        name = group->names + n * (id_size + path_size);
+        if (id)
+        {
+            rt_snprintf(name, id_size, "%s-%d", id, n);
+            c->condata.clientID.cstring = name;
+        }
+#ifdef MQTT_USING_STORE
+        if (config->store_path)
+        {
+            rt_snprintf(name + id_size, path_size, "%s/%d", config->store_path, n);
+            c->store_path = name + id_size;
+        }
+#endif
+
+        /* each initial subscription goes to the shard of its filter */
+        for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+        {
+            if (config->messageHandlers[i].topicFilter == RT_NULL ||
+                mqtt_group_shard(group, config->messageHandlers[i].topicFilter) != c)
+                continue;
+            c->messageHandlers[i].topicFilter = rt_strdup(config->messageHandlers[i].topicFilter);
+            if (c->messageHandlers[i].topicFilter == RT_NULL)
+                goto _fail;
+        }
+
+        c->buf = rt_malloc(c->buf_size);
+        c->readbuf = rt_malloc(c->readbuf_size);
+        if (c->buf == RT_NULL || c->readbuf == RT_NULL)
+            goto _fail;
+
+        if (paho_mqtt_start(c) != PAHO_SUCCESS)
+            goto _fail;
+        group->shard_started = n + 1;
+    }
+
+    return PAHO_SUCCESS;
+
+_fail:
+    LOG_E("Start client group shard %d error.", n);
+    mqtt_group_shard_free(c);
+    c->reactor = RT_NULL;
+    /* the config is kept, the group may be started again */
+    mqtt_group_close(group);
+    return PAHO_FAILURE;
+
+_nomem:
+    if (group->stopped)
+        rt_sem_delete(group->stopped);
+    rt_free(group->shards);
+    rt_free(group->names);
+    group->stopped = RT_NULL;
+    group->shards = RT_NULL;
+    group->names = RT_NULL;
+    return PAHO_FAILURE;
+}
+
+/* stop the shards started, wait for them to close and free the group resources */
+static int mqtt_group_close(MQTTClientGroup *group)
+{
+    rt_tick_t deadline;
+    rt_int32_t left;
+    int n;
+
+    for (n = 0; n < group->shard_started; n++)
+    {
+        if (group->shards[n].reactor)
+            paho_mqtt_stop(&group->shards[n]);
+    }
+
+    /*
+     * The worker still uses the shards until it has closed them, a connect may be
+     * pending. Each shard it lets go of releases the semaphore once.
+     */
+    deadline = rt_tick_get() + rt_tick_from_millisecond(MQTT_SOCKET_TIMEO * 2);
+    for (n = 0; n < group->shard_started; n++)
+    {
+        while (group->shards[n].reactor)
+        {
+            left = (rt_int32_t)(deadline - rt_tick_get());
+            if (left <= 0 || rt_sem_take(group->stopped, left) != RT_EOK)
+            {
+                /* still in use by the worker, nothing is freed */
+                LOG_E("client group shard %d not closed.", n);
+                return PAHO_FAILURE;
+            }
+        }
+    }
+
+    if (group->own_reactor)
+    {
+        paho_mqtt_reactor_delete(group->reactor);
+        group->reactor = RT_NULL;
+    }
+
+    rt_sem_delete(group->stopped);
+    rt_free(group->shards);
+    rt_free(group->names);
+    group->stopped = RT_NULL;
+    group->shards = RT_NULL;
+    group->names = RT_NULL;
+    group->shard_started = 0;
+
+    return PAHO_SUCCESS;
+}
+
+/**
+ * This function stop the shards of a client group and wait for them to close.
+ *
+ * @param group the pointer of MQTT client group structure
+ *
+ * @return the error code, 0 on stop successfully.
+ */
+int paho_mqtt_group_stop(MQTTClientGroup *group)
+{
+    int i;
+
+    if (group->shards == RT_NULL || mqtt_group_close(group) != PAHO_SUCCESS)
+        return PAHO_FAILURE;
+
+    /* the shards took copies, the config handlers are freed as a client's would be */
+    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++)
+    {
+        if (group->config.messageHandlers[i].topicFilter)
+        {
+            rt_free(group->config.messageHandlers[i].topicFilter);
+            group->config.messageHandlers[i].topicFilter = RT_NULL;
+        }
+    }
+
+    return PAHO_SUCCESS;
+}
+
+/**
+ * This function publish message on the shard of the topic.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param topic topic name
+ * @param message the pointer of MQTTMessage structure
+ *
+ * @return the error code, 0 on publish successfully.
+ */
+int paho_mqtt_group_publish(MQTTClientGroup *group, const char *topic, MQTTMessage *message)
+{
+    rt_base_t level;
+    int rc;
+
+    RT_ASSERT(group);
+    RT_ASSERT(topic);
+
+    rc = MQTTPublish(mqtt_group_shard(group, topic), topic, message);
+
+    level = rt_hw_interrupt_disable();
+    if (rc == PAHO_SUCCESS)
+        group->published++;
+    else
+        group->refused++;
+    rt_hw_interrupt_enable(level);
+
+    return rc;
+}
+
+/**
+ * This function subscribe a topic filter on the shard of the filter.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param qos MQTT Qos type, only support QOS1
+ * @param topic topic filter name
+ * @param callback the pointer of subscribe topic receive data function
+ *
+ * @return the error code, 0 on subscribe successfully.
+ */
+int paho_mqtt_group_subscribe(MQTTClientGroup *group, enum QoS qos, const char *topic, subscribe_cb callback)
+{
+    RT_ASSERT(group);
+    RT_ASSERT(topic);
+
+    return paho_mqtt_subscribe(mqtt_group_shard(group, topic), qos, topic, callback);
+}
+
+/**
+ * This function unsubscribe a topic filter on the shard of the filter.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param topic topic filter name
+ *
+ * @return the error code, 0 on unsubscribe successfully.
+ */
+int paho_mqtt_group_unsubscribe(MQTTClientGroup *group, const char *topic)
+{
+    RT_ASSERT(group);
+    RT_ASSERT(topic);
+
+    return paho_mqtt_unsubscribe(mqtt_group_shard(group, topic), topic);
+}
+
+/**
+ * This function sum up the publish and dispatch statistics of the shards.
+ *
+ * @param group the pointer of MQTT client group structure
+ * @param stat the statistics filled in
+ */
+void paho_mqtt_group_stat(MQTTClientGroup *group, MQTTGroupStat *stat)
+{
+    MQTTClient *c;
+    int n;
+
+    RT_ASSERT(group);
+    RT_ASSERT(stat);
+
+    rt_memset(stat, 0, sizeof(MQTTGroupStat));
+    stat->published = group->published;
+    stat->refused = group->refused;
+
+    /* read without locking, a snapshot that may be off by the publishes in progress */
+    for (n = 0; n < group->shard_started && group->shards; n++)
+    {
+        c = &group->shards[n];
+        stat->online += c->isconnected ? 1 : 0;
+        stat->queued += c->pub_slot_count;
+        stat->inflight += c->inflight_count;
+        stat->dispatch.posted += c->dispatch_stat.posted;
+        stat->dispatch.dropped += c->dispatch_stat.dropped;
+        if (c->dispatch_stat.depth_max > stat->dispatch.depth_max)
+            stat->dispatch.depth_max = c->dispatch_stat.depth_max;
+    }
+}
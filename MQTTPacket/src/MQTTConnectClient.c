@@ -149,7 +149,7 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 		goto exit;
 
 	flags.all = readChar(&curdata);
-	*sessionPresent = flags.bits.sessionpresent;
+	*sessionPresent = flags.all & 0x01; /* bit 0 whatever the bit-field layout of the compiler */
 	*connack_rc = readChar(&curdata);
 
 	rc = 1;
@@ -0,0 +1,53 @@
+/*
+ * File      : mqtt_backoff_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Reconnect backoff tests.
+ */
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* the first delay is below the interval, the next ones grow to at most three times the last, capped */
+void utest_reconnect_backoff(void)
+{
+    MQTTClient c;
+    rt_uint32_t delay, prev, hi;
+    int i, above = 0;
+
+    rt_memset(&c, 0, sizeof(c));
+    c.condata.clientID.cstring = "utest";
+    c.reconnect_interval = 1000;
+    c.reconnect_max = 60000;
+
+    for (i = 0; i < 1000; i++)
+    {
+        prev = c.reconnect_delay;
+        delay = mqtt_reconnect_delay(&c);
+        if (prev == 0)
+        {
+            UTEST_CHECK(delay <= c.reconnect_interval);
+        }
+        else
+        {
+            hi = (prev * 3 < c.reconnect_max) ? prev * 3 : c.reconnect_max;
+            UTEST_CHECK(delay >= c.reconnect_interval && delay <= (hi > c.reconnect_interval ? hi : c.reconnect_interval));
+            above += (delay > c.reconnect_interval);
+        }
+        UTEST_CHECK(c.reconnect_delay != 0);
+
+        /* online again now and then, the backoff starts over */
+        if (i % 100 == 99)
+            c.reconnect_delay = 0;
+    }
+    UTEST_CHECK(above > 0);
+
+    /* a maximum below the interval is raised to it */
+    c.reconnect_max = 10;
+    c.reconnect_delay = 500;
+    UTEST_CHECK(mqtt_reconnect_delay(&c) == c.reconnect_interval);
+}
+
+#endif /* MQTT_UTEST */
@@ -0,0 +1,29 @@
+/*
+ * File      : mqtt_connack_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * CONNACK decoding: the session present flag and the return code.
+ */
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* session present is bit 0 of the CONNACK flags, whatever the bit-field layout */
+void utest_connack_session(void)
+{
+    unsigned char present[4] = {0x20, 0x02, 0x01, 0x00};
+    unsigned char absent[4] = {0x20, 0x02, 0x00, 0x05};
+    unsigned char session, rc;
+
+    session = rc = 0xFF;
+    UTEST_CHECK(MQTTDeserialize_connack(&session, &rc, present, sizeof(present)) == 1);
+    UTEST_CHECK(session == 1 && rc == 0);
+
+    session = rc = 0xFF;
+    UTEST_CHECK(MQTTDeserialize_connack(&session, &rc, absent, sizeof(absent)) == 1);
+    UTEST_CHECK(session == 0 && rc == 5);
+}
+
+#endif /* MQTT_UTEST */
@@ -0,0 +1,58 @@
+/*
+ * File      : mqtt_inbound_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Inbound publishes: a PUBLISH read into readbuf reaches the callbacks of the
+ * matching filters with its whole payload.
+ */
+#include <string.h>
+
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+static size_t utest_payloadlen;
+static char utest_payload[32];
+
+static void utest_inbound_cb(MQTTClient *c, MessageData *msg_data)
+{
+    utest_payloadlen = msg_data->message->payloadlen;
+    if (utest_payloadlen <= sizeof(utest_payload))
+        rt_memcpy(utest_payload, msg_data->message->payload, utest_payloadlen);
+}
+
+/* the payload length is read as an int and widened, not written into the size_t through an int pointer */
+void utest_inbound_publish(void)
+{
+    MQTTClient c;
+    MQTTString topic = MQTTString_initializer;
+    int len;
+
+    if (utest_client_init(&c, 64, 1) != PAHO_SUCCESS || mqtt_topic_index_init(&c) != PAHO_SUCCESS)
+        goto _exit;
+    UTEST_CHECK(mqtt_sub_add(&c, "inbound/+", QOS1, utest_inbound_cb) >= 0);
+
+    topic.cstring = "inbound/a";
+    len = MQTTSerialize_publish(c.readbuf, c.readbuf_size, 0, QOS0, 0, 0, topic, (unsigned char *)"0123456789", 10);
+    UTEST_CHECK(len > 0);
+
+    utest_payloadlen = (size_t)-1;
+    utest_stack_fill();
+    UTEST_CHECK(MQTT_handlePacket(&c, PUBLISH) >= 0);
+    UTEST_CHECK(utest_payloadlen == 10);
+    UTEST_CHECK(memcmp(utest_payload, "0123456789", 10) == 0);
+
+    /* an empty payload is delivered as one */
+    len = MQTTSerialize_publish(c.readbuf, c.readbuf_size, 0, QOS0, 0, 0, topic, (unsigned char *)"", 0);
+    utest_payloadlen = (size_t)-1;
+    utest_stack_fill();
+    UTEST_CHECK(MQTT_handlePacket(&c, PUBLISH) >= 0);
+    UTEST_CHECK(utest_payloadlen == 0);
+
+_exit:
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */
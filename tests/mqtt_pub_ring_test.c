@@ -0,0 +1,65 @@
+/*
+ * File      : mqtt_pub_ring_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Publish ring: slots are reserved in order and their space is given back
+ * in order, a packet never wraps around the end of the ring.
+ */
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* a packet never wraps, the end of the ring is skipped and given back with it */
+void utest_pub_ring_wrap(void)
+{
+    MQTTClient c;
+    struct MQTTPubSlot *slot[4];
+    rt_uint32_t len;
+
+    if (utest_client_init(&c, 100, 4) != PAHO_SUCCESS)
+        goto _exit;
+
+    slot[0] = utest_publish(&c, QOS0, "wrap/a", 30, 1);
+    slot[1] = utest_publish(&c, QOS0, "wrap/b", 30, 1);
+    UTEST_CHECK(slot[0] && slot[1]);
+    if (!(slot[0] && slot[1]))
+        goto _exit;
+    len = slot[0]->len;
+    UTEST_CHECK(slot[0]->offset == 0 && slot[1]->offset == len);
+    UTEST_CHECK(c.pub_signaled == 1);
+
+    /* the third would run past the end, at offset 0 it overlaps the first */
+    UTEST_CHECK(3 * len > c.pub_ring_size);
+    UTEST_CHECK(utest_publish(&c, QOS0, "wrap/c", 30, 1) == RT_NULL);
+
+    slot[0]->state = PUB_SLOT_DONE;
+    mqtt_pub_ring_release(&c);
+    UTEST_CHECK(c.pub_slot_count == 1 && c.pub_ring_used == len);
+
+    slot[2] = utest_publish(&c, QOS0, "wrap/c", 30, 1);
+    UTEST_CHECK(slot[2] != RT_NULL);
+    if (slot[2] == RT_NULL)
+        goto _exit;
+    UTEST_CHECK(slot[2]->offset == 0);
+    UTEST_CHECK(slot[2]->span == len + c.pub_ring_size - 2 * len);
+    UTEST_CHECK(c.pub_ring_used == len + slot[2]->span);
+
+    /* released in order only, the wrapped span comes back with its slot */
+    slot[2]->state = PUB_SLOT_DONE;
+    mqtt_pub_ring_release(&c);
+    UTEST_CHECK(c.pub_slot_count == 2);
+    slot[1]->state = PUB_SLOT_DONE;
+    mqtt_pub_ring_release(&c);
+    UTEST_CHECK(c.pub_slot_count == 0 && c.pub_ring_used == 0);
+
+    /* an empty ring starts over at offset 0 */
+    slot[3] = utest_publish(&c, QOS0, "wrap/d", 30, 1);
+    UTEST_CHECK(slot[3] && slot[3]->offset == 0 && slot[3]->span == slot[3]->len);
+
+_exit:
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */
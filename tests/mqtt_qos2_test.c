@@ -0,0 +1,34 @@
+/*
+ * File      : mqtt_qos2_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Inbound QoS2: a publish is delivered once until its PUBREL releases the
+ * packet id.
+ */
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* an inbound QoS2 publish is delivered once until its PUBREL */
+void utest_qos2_dedup(void)
+{
+    MQTTClient c;
+
+    rt_memset(&c, 0, sizeof(c));
+
+    UTEST_CHECK(qos2_in_receive(&c, 5) == 1);
+    UTEST_CHECK(qos2_in_receive(&c, 5) == 0);
+    UTEST_CHECK(qos2_in_receive(&c, 37) == 1);
+    UTEST_CHECK(qos2_in_receive(&c, MAX_PACKET_ID) == 1);
+    UTEST_CHECK(qos2_in_receive(&c, MAX_PACKET_ID) == 0);
+
+    qos2_in_release(&c, 5);
+    UTEST_CHECK(qos2_in_receive(&c, 37) == 0);
+    UTEST_CHECK(qos2_in_receive(&c, 5) == 1);
+
+    rt_free(c.qos2_in_map);
+}
+
+#endif /* MQTT_UTEST */
@@ -0,0 +1,80 @@
+/*
+ * File      : mqtt_recv_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Receive ring: packets are parsed from the ring as their bytes arrive.
+ */
+#include <string.h>
+
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* append bytes to the receive ring as net_read does, wrapping at its end */
+static void utest_recv_feed(MQTTClient *c, const unsigned char *data, int len)
+{
+    while (len-- > 0)
+    {
+        c->recv_ring[(c->recv_ring_pos + c->recv_ring_len) % c->recv_ring_size] = *data++;
+        c->recv_ring_len++;
+    }
+}
+
+/* a packet arriving in pieces across the end of the ring is parsed where it stopped */
+void utest_recv_ring(void)
+{
+    MQTTClient c;
+    MQTTString topic = MQTTString_initializer;
+    unsigned char packet[64], acks[8];
+    int len, pos, chunk, type = -1;
+
+    if (utest_client_init(&c, 64, 2) != PAHO_SUCCESS)
+        goto _exit;
+    c.recv_ring_size = 16;
+    c.recv_ring = rt_malloc(c.recv_ring_size);
+    c.transport.sck = &c;
+    c.transport.getfn = recv_ring_getfn;
+    if (c.recv_ring == RT_NULL)
+        goto _exit;
+
+    topic.cstring = "ring/test";
+    len = MQTTSerialize_publish(packet, sizeof(packet), 0, QOS1, 0, 10, topic, (unsigned char *)"0123456789abcdef", 16);
+    UTEST_CHECK(len > c.recv_ring_size);
+
+    /* start near the end of the ring so the packet wraps, three bytes per read */
+    c.recv_ring_pos = 11;
+    for (pos = 0; pos < len; pos += chunk)
+    {
+        chunk = (len - pos < 3) ? len - pos : 3;
+        utest_recv_feed(&c, packet + pos, chunk);
+        type = MQTTPacket_readPacket(&c);
+        if (pos + chunk < len)
+            UTEST_CHECK(type == 0);
+    }
+    UTEST_CHECK(type == PUBLISH);
+    UTEST_CHECK(memcmp(c.readbuf, packet, len) == 0);
+    UTEST_CHECK(c.recv_ring_len == 0);
+
+    /* two packets buffered by one read come out one by one */
+    len = MQTTSerialize_ack(acks, sizeof(acks), PUBACK, 0, 7);
+    acks[len++] = PINGRESP << 4;
+    acks[len++] = 0;
+    utest_recv_feed(&c, acks, len);
+    UTEST_CHECK(MQTTPacket_readPacket(&c) == PUBACK);
+    UTEST_CHECK(c.readbuf[3] == 7);
+    UTEST_CHECK(MQTTPacket_readPacket(&c) == PINGRESP);
+    UTEST_CHECK(MQTTPacket_readPacket(&c) == 0);
+
+    /* a packet larger than readbuf is an error */
+    c.readbuf_size = 16;
+    len = MQTTSerialize_publish(packet, sizeof(packet), 0, QOS0, 0, 0, topic, (unsigned char *)"0123456789abcdef", 16);
+    utest_recv_feed(&c, packet, 3);
+    UTEST_CHECK(MQTTPacket_readPacket(&c) == -1);
+
+_exit:
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */
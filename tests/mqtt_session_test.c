@@ -0,0 +1,147 @@
+/*
+ * File      : mqtt_session_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Session journal tests: replay after a restart and publishes forwarded from
+ * the store.
+ */
+#include <rtthread.h>
+#include <dfs_posix.h>
+
+#include "mqtt_utest.h"
+
+#if defined(MQTT_UTEST) && defined(MQTT_USING_STORE)
+
+/* the journal replays the session up to a damaged record */
+void utest_store_journal(void)
+{
+    MQTTClient c;
+    struct MQTTPubSlot *slot;
+    unsigned char junk[24];
+    unsigned short ids[3];
+    char path[64];
+    int i, fd;
+
+    utest_store_clean();
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+    c.store_path = MQTT_UTEST_STORE_PATH;
+    UTEST_CHECK(mqtt_store_open(&c) == PAHO_SUCCESS && mqtt_session_restore(&c) == PAHO_SUCCESS);
+    if (c.store == RT_NULL || c.store->ses_fd < 0)
+    {
+        rt_kprintf("  store %s not writable, journal replay skipped\n", MQTT_UTEST_STORE_PATH);
+        goto _exit;
+    }
+
+    /* three QoS1 publishes sent, the second one acknowledged, an inbound QoS2 id pending */
+    for (i = 0; i < 3; i++)
+    {
+        slot = utest_publish(&c, QOS1, "journal", 10 + i, 1);
+        UTEST_CHECK(slot != RT_NULL);
+        if (slot == RT_NULL)
+            goto _exit;
+        ids[i] = slot->id;
+    }
+    mqtt_session_log_sent(&c, c.pub_slot_tail, 3);
+    mqtt_session_log(&c, SESSION_REC_DONE, ids[1], RT_NULL);
+    UTEST_CHECK(qos2_in_receive(&c, 77) == 1);
+    mqtt_session_flush(&c);
+    mqtt_store_close(&c);
+    utest_client_free(&c);
+
+    /* a record cut short by a power loss ends the replay */
+    rt_snprintf(path, sizeof(path), "%s/session", MQTT_UTEST_STORE_PATH);
+    fd = open(path, O_WRONLY | O_APPEND, 0);
+    UTEST_CHECK(fd >= 0);
+    if (fd >= 0)
+    {
+        rt_memset(junk, 0xA5, sizeof(junk));
+        junk[0] = SESSION_REC_DONE;
+        write(fd, junk, sizeof(junk));
+        close(fd);
+    }
+
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+    c.store_path = MQTT_UTEST_STORE_PATH;
+    UTEST_CHECK(mqtt_store_open(&c) == PAHO_SUCCESS && mqtt_session_restore(&c) == PAHO_SUCCESS);
+
+    /* the unacknowledged publishes are back as sent, in order, with their ids */
+    UTEST_CHECK(c.pub_slot_count == 2);
+    UTEST_CHECK(c.pub_slots[0].id == ids[0] && c.pub_slots[0].state == PUB_SLOT_INFLIGHT);
+    UTEST_CHECK(c.pub_slots[1].id == ids[2] && c.pub_slots[1].state == PUB_SLOT_INFLIGHT);
+    UTEST_CHECK(c.pub_slots[0].qos == QOS1 && (c.pub_ring[c.pub_slots[0].offset] & 0xF6) == 0x32);
+    UTEST_CHECK(PACKET_ID_IN_USE(&c, ids[0]) && PACKET_ID_IN_USE(&c, ids[2]) && !PACKET_ID_IN_USE(&c, ids[1]));
+    UTEST_CHECK(getNextPacketId(&c) == ids[2] + 1);
+    UTEST_CHECK(qos2_in_receive(&c, 77) == 0);
+
+_exit:
+    if (c.store)
+        mqtt_store_close(&c);
+    utest_client_free(&c);
+    utest_store_clean();
+}
+
+/* a publish forwarded from the store is journaled as a reference to its store record */
+void utest_store_forward_journal(void)
+{
+    MQTTClient c;
+    MQTTMessage message;
+    MQTTString topic = MQTTString_initializer;
+    unsigned char packet[64];
+    rt_uint32_t off, len = 0;
+    unsigned short id = 0;
+
+    utest_store_clean();
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+    c.store_path = MQTT_UTEST_STORE_PATH;
+    UTEST_CHECK(mqtt_store_open(&c) == PAHO_SUCCESS && mqtt_session_restore(&c) == PAHO_SUCCESS);
+    if (c.store == RT_NULL || c.store->ses_fd < 0)
+    {
+        rt_kprintf("  store %s not writable, journal replay skipped\n", MQTT_UTEST_STORE_PATH);
+        goto _exit;
+    }
+
+    /* stored while offline, forwarded into the ring and sent */
+    rt_memset(&message, 0, sizeof(message));
+    message.qos = QOS1;
+    message.payload = "stored payload";
+    message.payloadlen = 14;
+    topic.cstring = "forward";
+    UTEST_CHECK(mqtt_store_append(&c, &topic, &message) == PAHO_SUCCESS);
+    UTEST_CHECK(mqtt_store_forward(&c) == 1 && c.pub_slot_count == 1);
+    if (c.pub_slot_count != 1)
+        goto _exit;
+    id = c.pub_slots[0].id;
+    len = c.pub_slots[0].len;
+    UTEST_CHECK(c.pub_slots[0].store_seq != 0 && len <= sizeof(packet));
+    rt_memcpy(packet, c.pub_ring + c.pub_slots[0].offset, len);
+
+    /* the journal only grows by the record, the packet is not copied */
+    off = c.store->ses_off;
+    mqtt_session_log_sent(&c, c.pub_slot_tail, 1);
+    UTEST_CHECK(c.store->ses_off - off == sizeof(struct MQTTSessionRecord));
+    mqtt_store_close(&c);
+    utest_client_free(&c);
+
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+    c.store_path = MQTT_UTEST_STORE_PATH;
+    UTEST_CHECK(mqtt_store_open(&c) == PAHO_SUCCESS && mqtt_session_restore(&c) == PAHO_SUCCESS);
+
+    /* read back from the store with its packet id, and not forwarded a second time */
+    UTEST_CHECK(c.pub_slot_count == 1);
+    UTEST_CHECK(c.pub_slots[0].id == id && c.pub_slots[0].state == PUB_SLOT_INFLIGHT);
+    UTEST_CHECK(c.pub_slots[0].len == len && rt_memcmp(c.pub_ring + c.pub_slots[0].offset, packet, len) == 0);
+    UTEST_CHECK(PACKET_ID_IN_USE(&c, id));
+    UTEST_CHECK(mqtt_store_forward(&c) == 0 && c.pub_slot_count == 1);
+
+_exit:
+    if (c.store)
+        mqtt_store_close(&c);
+    utest_client_free(&c);
+    utest_store_clean();
+}
+
+#endif /* defined(MQTT_UTEST) && defined(MQTT_USING_STORE) */
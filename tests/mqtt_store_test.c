@@ -0,0 +1,133 @@
+/*
+ * File      : mqtt_store_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Store: records are checked by their CRC-32 and forwarded into the publish
+ * ring in order, the rest of a file is given up at a damaged record.
+ */
+#include <string.h>
+
+#include <rtthread.h>
+#include <dfs_posix.h>
+
+#include "mqtt_utest.h"
+
+#if defined(MQTT_UTEST) && defined(MQTT_USING_STORE)
+
+/* remove the files the store cases leave behind */
+void utest_store_clean(void)
+{
+    static const char *names[] = {"session", "session.tmp", "cursor", "00000001.log", "00000002.log"};
+    char path[64];
+    int i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        rt_snprintf(path, sizeof(path), "%s/%s", MQTT_UTEST_STORE_PATH, names[i]);
+        unlink(path);
+    }
+    rmdir(MQTT_UTEST_STORE_PATH);
+}
+
+/* the CRC-32 of a record covers its header and its packet */
+void utest_store_crc(void)
+{
+    struct MQTTStoreRecord rec;
+    unsigned char packet[16];
+    rt_uint32_t crc;
+
+    /* the standard check value, computed whole and in two parts */
+    UTEST_CHECK(mqtt_store_crc32(0, (const unsigned char *)"123456789", 9) == 0xCBF43926);
+    crc = mqtt_store_crc32(0, (const unsigned char *)"1234", 4);
+    UTEST_CHECK(mqtt_store_crc32(crc, (const unsigned char *)"56789", 5) == 0xCBF43926);
+
+    /* a record CRC covers the header and the packet */
+    rt_memset(&rec, 0, sizeof(rec));
+    rt_memset(packet, 0x30, sizeof(packet));
+    rec.magic = MQTT_STORE_MAGIC;
+    rec.qos = QOS1;
+    rec.len = sizeof(packet);
+    crc = mqtt_store_record_crc(&rec, packet);
+    packet[9] ^= 0x01;
+    UTEST_CHECK(mqtt_store_record_crc(&rec, packet) != crc);
+    packet[9] ^= 0x01;
+    rec.qos = QOS2;
+    UTEST_CHECK(mqtt_store_record_crc(&rec, packet) != crc);
+
+}
+
+/* stored publishes are forwarded in order with fresh packet ids, a damaged record ends its file */
+void utest_store_forward(void)
+{
+    MQTTClient c;
+    MQTTMessage message;
+    MQTTString topic = MQTTString_initializer;
+    struct MQTTStoreRecord rec;
+    char path[64];
+    int i, fd;
+
+    utest_store_clean();
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+    c.store_path = MQTT_UTEST_STORE_PATH;
+    UTEST_CHECK(mqtt_store_open(&c) == PAHO_SUCCESS);
+    if (c.store == RT_NULL)
+        goto _exit;
+
+    rt_memset(&message, 0, sizeof(message));
+    message.qos = QOS1;
+    message.payload = "stored";
+    message.payloadlen = 6;
+    topic.cstring = "store/a";
+    for (i = 0; i < 3; i++)
+    {
+        UTEST_CHECK(mqtt_store_append(&c, &topic, &message) == PAHO_SUCCESS);
+    }
+    if (c.store->wr_fd < 0)
+    {
+        rt_kprintf("  store %s not writable, forward skipped\n", MQTT_UTEST_STORE_PATH);
+        goto _exit;
+    }
+
+    /* flip a byte in the packet of the last record */
+    rt_snprintf(path, sizeof(path), "%s/%08x.log", MQTT_UTEST_STORE_PATH, c.store->wr_seq);
+    fd = open(path, O_RDWR, 0);
+    UTEST_CHECK(fd >= 0);
+    if (fd < 0)
+        goto _exit;
+    UTEST_CHECK(read(fd, &rec, sizeof(rec)) == sizeof(rec));
+    lseek(fd, 3 * sizeof(rec) + 2 * rec.len + 4, SEEK_SET);
+    write(fd, "!", 1);
+    close(fd);
+
+    /* the slot taken by the damaged record is cancelled */
+    UTEST_CHECK(mqtt_store_forward(&c) == 2);
+    UTEST_CHECK(c.pub_slot_count == 3 && c.pub_slots[2].state == PUB_SLOT_CANCELLED);
+    UTEST_CHECK(c.pub_slots[0].state == PUB_SLOT_COMMITTED && c.pub_slots[0].store_seq != 0);
+    UTEST_CHECK(c.pub_slots[0].id != 0 && c.pub_slots[1].id != 0 && c.pub_slots[0].id != c.pub_slots[1].id);
+    UTEST_CHECK(c.pub_slots[1].store_end > c.pub_slots[0].store_end);
+
+    /* the packet id is written into the forwarded packet */
+    for (i = 0; i < 2; i++)
+    {
+        unsigned char *packet = c.pub_ring + c.pub_slots[i].offset;
+        int pos = c.pub_slots[i].len - 6 - 2;
+
+        UTEST_CHECK(((packet[pos] << 8) | packet[pos + 1]) == c.pub_slots[i].id);
+    }
+    UTEST_CHECK(mqtt_store_forward(&c) == 0);
+    UTEST_CHECK(c.store->rd_seq == c.store->wr_seq && c.store->rd_off == c.store->wr_off);
+
+    /* the next publish goes to a new file */
+    UTEST_CHECK(mqtt_store_append(&c, &topic, &message) == PAHO_SUCCESS);
+    UTEST_CHECK(mqtt_store_forward(&c) == 1 && c.pub_slot_count == 4);
+    UTEST_CHECK(c.pub_slots[3].store_seq == c.pub_slots[0].store_seq + 1);
+
+_exit:
+    if (c.store)
+        mqtt_store_close(&c);
+    utest_client_free(&c);
+    utest_store_clean();
+}
+
+#endif /* defined(MQTT_UTEST) && defined(MQTT_USING_STORE) */
@@ -0,0 +1,74 @@
+/*
+ * File      : mqtt_timer_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Timer wheel: timers on the coarse levels are cascaded down and fire on
+ * their own tick, in expiry order.
+ */
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+static struct MQTTTimer utest_timers[5];
+static int utest_fired[5], utest_fired_num;
+static rt_tick_t utest_fired_tick[5];
+
+static int utest_timer_cb(MQTTClient *c, struct MQTTTimer *timer)
+{
+    int i = timer - utest_timers;
+
+    utest_fired[utest_fired_num++] = i;
+    utest_fired_tick[i] = utest_wheel.now;
+
+    return PAHO_SUCCESS;
+}
+
+/* timers on the coarse levels are cascaded down and fire on their tick, in order */
+void utest_timer_wheel(void)
+{
+    static const rt_tick_t delay[5] = {20000, 3, 39000, 700, 140000};
+    MQTTClient c;
+    rt_tick_t base;
+    int i;
+
+    if (utest_client_init(&c, 64, 1) != PAHO_SUCCESS)
+        goto _exit;
+
+    /* let the wheel lag 40000 ticks behind, one run catches up through every level */
+    base = rt_tick_get() - 40000;
+    utest_wheel.now = base;
+    utest_fired_num = 0;
+    for (i = 0; i < 5; i++)
+    {
+        mqtt_timer_init(&utest_timers[i], utest_timer_cb);
+        utest_timers[i].expire = base + delay[i];
+        utest_timers[i].client = &c;
+        mqtt_timer_insert(&utest_wheel, &utest_timers[i]);
+    }
+    UTEST_CHECK(utest_wheel.count == 5);
+    UTEST_CHECK(utest_wheel.pending[0] && utest_wheel.pending[1] && utest_wheel.pending[2] && utest_wheel.pending[3]);
+
+    mqtt_timer_run(&utest_wheel);
+
+    UTEST_CHECK(utest_fired_num == 4);
+    UTEST_CHECK(utest_fired[0] == 1 && utest_fired[1] == 3 && utest_fired[2] == 0 && utest_fired[3] == 2);
+    for (i = 0; i < 4; i++)
+    {
+        UTEST_CHECK(utest_fired_tick[i] == base + delay[i]);
+    }
+
+    /* the last one is still waiting, and is the next wakeup */
+    UTEST_CHECK(utest_wheel.count == 1 && !rt_list_isempty(&utest_timers[4].list));
+    UTEST_CHECK(mqtt_timer_next(&utest_wheel) != (rt_tick_t)RT_WAITING_FOREVER);
+    UTEST_CHECK(mqtt_timer_next(&utest_wheel) <= base + delay[4] - rt_tick_get());
+    mqtt_timer_stop(&c, &utest_timers[4]);
+    UTEST_CHECK(utest_wheel.count == 0);
+    UTEST_CHECK(mqtt_timer_next(&utest_wheel) == (rt_tick_t)RT_WAITING_FOREVER);
+
+_exit:
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */
@@ -0,0 +1,105 @@
+/*
+ * File      : mqtt_topic_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Subscription table and index: exact filters are found through the hash, the
+ * wildcard ones through the trie of topic levels.
+ */
+#include <string.h>
+
+#include <rtthread.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+#define UTEST_SUB_NUM    7
+
+#define UTEST_SUB_CB(n) \
+    static void utest_sub_cb##n(MQTTClient *c, MessageData *msg_data) {}
+UTEST_SUB_CB(0) UTEST_SUB_CB(1) UTEST_SUB_CB(2) UTEST_SUB_CB(3)
+UTEST_SUB_CB(4) UTEST_SUB_CB(5) UTEST_SUB_CB(6)
+
+static const subscribe_cb utest_sub_cbs[UTEST_SUB_NUM] =
+{
+    utest_sub_cb0, utest_sub_cb1, utest_sub_cb2, utest_sub_cb3,
+    utest_sub_cb4, utest_sub_cb5, utest_sub_cb6,
+};
+
+/* the filters matching a topic, one bit per entry of utest_sub_cbs */
+static rt_uint32_t utest_matched(MQTTClient *c, const char *topic)
+{
+    rt_uint32_t mask = 0;
+    int i, j, num;
+
+    num = mqtt_topic_match(c, topic, strlen(topic));
+    for (i = 0; i < num; i++)
+    {
+        for (j = 0; j < UTEST_SUB_NUM; j++)
+        {
+            if (c->topic_index->matches[i] == utest_sub_cbs[j])
+                mask |= 1UL << j;
+        }
+    }
+
+    return mask;
+}
+
+/* exact filters are hashed, the others walk the trie with '+' and '#' */
+void utest_topic_match(void)
+{
+    static const char *filters[UTEST_SUB_NUM] =
+    {
+        "a/b/c", "a/+/c", "a/#", "#", "+/b/+", "a/b", "a/+",
+    };
+    MQTTClient c;
+    int i, entry[UTEST_SUB_NUM];
+
+    if (utest_client_init(&c, 64, 1) != PAHO_SUCCESS || mqtt_topic_index_init(&c) != PAHO_SUCCESS)
+        goto _exit;
+
+    for (i = 0; i < UTEST_SUB_NUM; i++)
+    {
+        entry[i] = mqtt_sub_add(&c, filters[i], QOS1, utest_sub_cbs[i]);
+        UTEST_CHECK(entry[i] >= 0);
+        if (entry[i] < 0)
+            goto _exit;
+    }
+    UTEST_CHECK(c.sub_num == UTEST_SUB_NUM);
+    UTEST_CHECK(mqtt_sub_find(&c, "a/+/c") == entry[1]);
+    UTEST_CHECK(mqtt_sub_find(&c, "a/+/d") == -1);
+
+    UTEST_CHECK(utest_matched(&c, "a/b/c") == 0x1F);
+    UTEST_CHECK(utest_matched(&c, "a/b") == 0x6C);  /* '#' also matches its parent level */
+    UTEST_CHECK(utest_matched(&c, "a") == 0x0C);
+    UTEST_CHECK(utest_matched(&c, "x/b/y") == 0x18);
+    UTEST_CHECK(utest_matched(&c, "a/x/c/d") == 0x0C);
+    UTEST_CHECK(utest_matched(&c, "a/b/") == 0x1C); /* an empty level is matched by '+' and '#' */
+
+    /* removed filters stop matching, the others are unaffected */
+    mqtt_sub_remove(&c, entry[2]);
+    mqtt_sub_remove(&c, entry[3]);
+    UTEST_CHECK(utest_matched(&c, "a") == 0);
+    UTEST_CHECK(utest_matched(&c, "a/b/c") == 0x13);
+    UTEST_CHECK(mqtt_sub_find(&c, "a/#") == -1);
+
+    /* the freed entries are reused */
+    UTEST_CHECK(mqtt_sub_add(&c, "a/#", QOS0, utest_sub_cbs[2]) >= 0);
+    UTEST_CHECK(c.sub_num == UTEST_SUB_NUM - 1);
+    UTEST_CHECK(utest_matched(&c, "a") == 0x04);
+
+    /* a filter whose SUBSCRIBE cannot fit the send buffer is refused */
+    {
+        char filter[300];
+
+        rt_memset(filter, 'x', sizeof(filter) - 1);
+        filter[sizeof(filter) - 1] = '\0';
+        UTEST_CHECK(mqtt_sub_add(&c, filter, QOS1, utest_sub_cbs[0]) == -1);
+        UTEST_CHECK(c.sub_num == UTEST_SUB_NUM - 1);
+    }
+
+_exit:
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */
@@ -0,0 +1,187 @@
+/*
+ * File      : mqtt_utest.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Unit tests of the pipe mode client internals: the test client, the helpers
+ * shared by the cases and the 'mqtt_unit_test' command running them.
+ */
+#include <string.h>
+
+#include <rtthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+int utest_checks, utest_failures;
+
+struct MQTTTimerWheel utest_wheel;
+
+int utest_client_init(MQTTClient *c, rt_uint32_t ring_size, rt_uint32_t slot_num)
+{
+    rt_uint32_t i;
+
+    rt_memset(c, 0, sizeof(MQTTClient));
+    mqtt_timer_wheel_init(&utest_wheel);
+
+    c->sock = -1;
+    c->sub_free = -1;
+    c->buf_size = c->readbuf_size = 256;
+    c->buf = rt_malloc(c->buf_size);
+    c->readbuf = rt_malloc(c->readbuf_size);
+    c->pub_ring_size = ring_size;
+    c->pub_slot_num = slot_num;
+    c->pub_ring = rt_malloc(ring_size);
+    c->pub_slots = rt_calloc(slot_num, sizeof(struct MQTTPubSlot));
+    c->packetid_map = rt_calloc((MAX_PACKET_ID + 1) / 32, sizeof(rt_uint32_t));
+    c->inflight_window = slot_num;
+    c->timers = mqtt_client_timers_create(&utest_wheel);
+    c->sub_mutex = rt_mutex_create("mutest", RT_IPC_FLAG_FIFO);
+    if (!(c->buf && c->readbuf && c->pub_ring && c->pub_slots && c->packetid_map && c->timers && c->sub_mutex))
+    {
+        rt_kprintf("  no memory for the test client\n");
+        return PAHO_FAILURE;
+    }
+
+    for (i = 0; i < slot_num; i++)
+    {
+        mqtt_timer_init(&c->pub_slots[i].retry, mqtt_pub_retry_timeout);
+    }
+
+    return PAHO_SUCCESS;
+}
+
+void utest_client_free(MQTTClient *c)
+{
+    rt_uint32_t i;
+
+    for (i = 0; c->pub_slots && c->timers && i < c->pub_slot_num; i++)
+    {
+        mqtt_timer_stop(c, &c->pub_slots[i].retry);
+    }
+    if (c->topic_index)
+        mqtt_sub_free_all(c);
+    if (c->sub_mutex)
+        rt_mutex_delete(c->sub_mutex);
+    rt_free(c->timers);
+    rt_free(c->packetid_map);
+    rt_free(c->qos2_in_map);
+    rt_free(c->pub_slots);
+    rt_free(c->pub_ring);
+    rt_free(c->recv_ring);
+    rt_free(c->readbuf);
+    rt_free(c->buf);
+    rt_memset(c, 0, sizeof(MQTTClient));
+}
+
+/* reserve a slot and serialize a publish into it, as paho_mqtt_publish does */
+struct MQTTPubSlot *utest_publish(MQTTClient *c, enum QoS qos, const char *topic, int payloadlen, int commit)
+{
+    struct MQTTPubSlot *slot;
+    MQTTString topic_str = MQTTString_initializer;
+    MQTTMessage message;
+    static unsigned char payload[64];
+    int len;
+
+    rt_memset(&message, 0, sizeof(message));
+    rt_memset(payload, '*', sizeof(payload));
+    message.qos = qos;
+    topic_str.cstring = (char *)topic;
+    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, qos, 0, 1, topic_str, payload, payloadlen);
+    if (len <= 0)
+        return RT_NULL;
+
+    slot = mqtt_pub_ring_reserve(c, len, &message);
+    if (slot == RT_NULL)
+        return RT_NULL;
+
+    MQTTSerialize_publish(c->pub_ring + slot->offset, len, 0, qos, 0, message.id, topic_str, payload, payloadlen);
+    if (commit)
+        mqtt_pub_ring_commit(c, slot, PUB_SLOT_COMMITTED);
+
+    return slot;
+}
+
+/* a datagram socket connected to itself, publishes written to it go nowhere */
+int utest_loop_socket(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+
+    rt_memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        closesocket(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* leave non-zero bytes on the stack below the caller, where its callees keep their locals */
+void utest_stack_fill(void)
+{
+    volatile unsigned char fill[512];
+    int i;
+
+    for (i = 0; i < sizeof(fill); i++)
+    {
+        fill[i] = 0xA5;
+    }
+}
+
+static const struct
+{
+    const char *name;
+    void (*run)(void);
+} utest_cases[] =
+{
+    {"receive ring", utest_recv_ring},
+    {"publish ring wrap", utest_pub_ring_wrap},
+    {"in-flight window", utest_inflight_window},
+    {"full window", utest_window_full},
+    {"QoS2 duplicates", utest_qos2_dedup},
+    {"timer wheel", utest_timer_wheel},
+    {"topic match", utest_topic_match},
+    {"inbound publish", utest_inbound_publish},
+#ifdef MQTT_USING_STORE
+    {"store CRC", utest_store_crc},
+    {"store forward", utest_store_forward},
+    {"store journal", utest_store_journal},
+    {"store forward journal", utest_store_forward_journal},
+#endif
+    {"reconnect backoff", utest_reconnect_backoff},
+    {"CONNACK session", utest_connack_session},
+};
+
+static void mqtt_unit_test(void)
+{
+    int i, failures, failed = 0;
+
+    utest_checks = utest_failures = 0;
+    for (i = 0; i < sizeof(utest_cases) / sizeof(utest_cases[0]); i++)
+    {
+        failures = utest_failures;
+        utest_cases[i].run();
+        rt_kprintf("[%s] %s\n", (utest_failures == failures) ? " OK " : "FAIL", utest_cases[i].name);
+        failed += (utest_failures != failures);
+    }
+
+    rt_kprintf("==== MQTT unit test: %d checks, %d failed, %d/%d cases passed ====\n",
+               utest_checks, utest_failures, (int)(sizeof(utest_cases) / sizeof(utest_cases[0])) - failed,
+               (int)(sizeof(utest_cases) / sizeof(utest_cases[0])));
+}
+MSH_CMD_EXPORT(mqtt_unit_test, MQTT client internals unit test);
+
+#endif /* MQTT_UTEST */
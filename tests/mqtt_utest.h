@@ -0,0 +1,70 @@
+/*
+ * File      : mqtt_utest.h
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * Helpers shared by the unit tests of the pipe mode client internals. Each
+ * tests/mqtt_*_test.c file holds the cases of one part of the client, the
+ * 'mqtt_unit_test' command of mqtt_utest.c runs them all.
+ */
+#ifndef __MQTT_UTEST_H__
+#define __MQTT_UTEST_H__
+
+#include <rtthread.h>
+
+#include "paho_mqtt.h"
+
+#if defined(PKG_USING_PAHOMQTT_TEST) && defined(PAHOMQTT_PIPE_MODE)
+#define MQTT_UTEST
+
+#include "paho_mqtt_internal.h"
+
+#ifndef MQTT_UTEST_STORE_PATH
+#define MQTT_UTEST_STORE_PATH   "/mqtt_utest" /* created and removed again by the store cases */
+#endif
+
+extern int utest_checks, utest_failures;
+
+#define UTEST_CHECK(cond)                                                           \
+    do                                                                              \
+    {                                                                               \
+        utest_checks++;                                                             \
+        if (!(cond))                                                                \
+        {                                                                           \
+            utest_failures++;                                                       \
+            rt_kprintf("  %s:%d check failed: %s\n", __FUNCTION__, __LINE__, #cond); \
+        }                                                                           \
+    } while (0)
+
+/* the wheel of the test clients */
+extern struct MQTTTimerWheel utest_wheel;
+
+int utest_client_init(MQTTClient *c, rt_uint32_t ring_size, rt_uint32_t slot_num);
+void utest_client_free(MQTTClient *c);
+struct MQTTPubSlot *utest_publish(MQTTClient *c, enum QoS qos, const char *topic, int payloadlen, int commit);
+int utest_loop_socket(void);
+void utest_stack_fill(void);
+#ifdef MQTT_USING_STORE
+void utest_store_clean(void);
+#endif
+
+/* the cases */
+void utest_recv_ring(void);
+void utest_pub_ring_wrap(void);
+void utest_inflight_window(void);
+void utest_window_full(void);
+void utest_qos2_dedup(void);
+void utest_timer_wheel(void);
+void utest_topic_match(void);
+void utest_inbound_publish(void);
+#ifdef MQTT_USING_STORE
+void utest_store_crc(void);
+void utest_store_forward(void);
+void utest_store_journal(void);
+void utest_store_forward_journal(void);
+#endif
+void utest_reconnect_backoff(void);
+void utest_connack_session(void);
+
+#endif /* defined(PKG_USING_PAHOMQTT_TEST) && defined(PAHOMQTT_PIPE_MODE) */
+
+#endif /* __MQTT_UTEST_H__ */
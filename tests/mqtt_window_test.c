@@ -0,0 +1,125 @@
+/*
+ * File      : mqtt_window_test.c
+ * COPYRIGHT (C) 2012-2018, Shanghai Real-Thread Technology Co., Ltd
+ *
+ * In-flight window: packet ids in flight are skipped, at most inflight_window
+ * QoS1/QoS2 publishes wait for their acknowledgement, and the ring space comes
+ * back once the oldest one is done.
+ */
+#include <rtthread.h>
+#include <sys/socket.h>
+
+#include "mqtt_utest.h"
+
+#ifdef MQTT_UTEST
+
+/* packet ids in flight are skipped, and at most inflight_window publishes are sent */
+void utest_inflight_window(void)
+{
+    MQTTClient c;
+    struct MQTTPubSlot *slot[4];
+    int i;
+
+    if (utest_client_init(&c, 512, 8) != PAHO_SUCCESS)
+        goto _exit;
+
+    /* the counter wraps to 1 and steps over the ids taken */
+    c.next_packetid = MAX_PACKET_ID - 1;
+    packetid_take(&c, MAX_PACKET_ID);
+    packetid_take(&c, 1);
+    packetid_take(&c, 2);
+    UTEST_CHECK(getNextPacketId(&c) == 3);
+    packetid_release(&c, 1);
+    c.next_packetid = MAX_PACKET_ID - 1;
+    UTEST_CHECK(getNextPacketId(&c) == 1);
+    packetid_release(&c, 2);
+    packetid_release(&c, MAX_PACKET_ID);
+    UTEST_CHECK(!PACKET_ID_IN_USE(&c, 2) && !PACKET_ID_IN_USE(&c, MAX_PACKET_ID));
+
+    c.sock = utest_loop_socket();
+    if (c.sock < 0)
+    {
+        rt_kprintf("  no loopback socket, in-flight window skipped\n");
+        goto _exit;
+    }
+
+    c.inflight_window = 2;
+    for (i = 0; i < 4; i++)
+    {
+        slot[i] = utest_publish(&c, QOS1, "window", 8, 1);
+        UTEST_CHECK(slot[i] != RT_NULL);
+        if (slot[i] == RT_NULL)
+            goto _exit;
+        UTEST_CHECK(PACKET_ID_IN_USE(&c, slot[i]->id));
+    }
+    UTEST_CHECK(slot[0]->id != slot[1]->id && slot[1]->id != slot[2]->id);
+
+    UTEST_CHECK(mqtt_pub_ring_send(&c) == PAHO_SUCCESS);
+    UTEST_CHECK(c.inflight_count == 2);
+    UTEST_CHECK(slot[0]->state == PUB_SLOT_INFLIGHT && slot[1]->state == PUB_SLOT_INFLIGHT);
+    UTEST_CHECK(slot[2]->state == PUB_SLOT_COMMITTED && slot[3]->state == PUB_SLOT_COMMITTED);
+
+    /* an unknown id changes nothing, a PUBACK makes room for one more */
+    UTEST_CHECK(mqtt_pub_ring_ack(&c, PUBACK, slot[3]->id) == PAHO_SUCCESS);
+    UTEST_CHECK(c.inflight_count == 2 && slot[2]->state == PUB_SLOT_COMMITTED);
+    i = slot[0]->id;
+    UTEST_CHECK(mqtt_pub_ring_ack(&c, PUBACK, i) == PAHO_SUCCESS);
+    UTEST_CHECK(!PACKET_ID_IN_USE(&c, i));
+    UTEST_CHECK(c.inflight_count == 2 && c.pub_slot_count == 3);
+    UTEST_CHECK(slot[2]->state == PUB_SLOT_INFLIGHT && slot[3]->state == PUB_SLOT_COMMITTED);
+
+    /* acknowledged out of order, the ring space comes back once the tail is done */
+    UTEST_CHECK(mqtt_pub_ring_ack(&c, PUBACK, slot[2]->id) == PAHO_SUCCESS);
+    UTEST_CHECK(c.pub_slot_count == 3 && slot[3]->state == PUB_SLOT_INFLIGHT);
+    UTEST_CHECK(mqtt_pub_ring_ack(&c, PUBACK, slot[1]->id) == PAHO_SUCCESS);
+    UTEST_CHECK(mqtt_pub_ring_ack(&c, PUBACK, slot[3]->id) == PAHO_SUCCESS);
+    UTEST_CHECK(c.inflight_count == 0 && c.pub_slot_count == 0 && c.pub_ring_used == 0);
+
+_exit:
+    if (c.sock >= 0)
+        closesocket(c.sock);
+    utest_client_free(&c);
+}
+
+/* a ring full of publishes past PUBREC has nothing to send, the send scan stops after one lap */
+void utest_window_full(void)
+{
+    MQTTClient c;
+    struct MQTTPubSlot *slot;
+    int i;
+
+    if (utest_client_init(&c, 512, 4) != PAHO_SUCCESS)
+        goto _exit;
+    c.sock = utest_loop_socket();
+    if (c.sock < 0)
+    {
+        rt_kprintf("  no loopback socket, full window skipped\n");
+        goto _exit;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        UTEST_CHECK(utest_publish(&c, QOS2, "full", 8, 1) != RT_NULL);
+    }
+    UTEST_CHECK(mqtt_pub_ring_send(&c) == PAHO_SUCCESS && c.inflight_count == 4);
+    /* their PUBRECs are in */
+    for (i = 0; i < 4; i++)
+    {
+        c.pub_slots[i].state = PUB_SLOT_RELEASING;
+    }
+
+    UTEST_CHECK(mqtt_pub_ring_send(&c) == PAHO_SUCCESS);
+    UTEST_CHECK(c.pub_slot_count == 4 && c.inflight_count == 4);
+    for (i = 0; i < 4; i++)
+    {
+        slot = &c.pub_slots[i];
+        UTEST_CHECK(slot->state == PUB_SLOT_RELEASING);
+    }
+
+_exit:
+    if (c.sock >= 0)
+        closesocket(c.sock);
+    utest_client_free(&c);
+}
+
+#endif /* MQTT_UTEST */